@@ -0,0 +1,17 @@
+# Assemble ASM with TNASM into DIR, keeping tnasm's listing next to the .bin
+# so the same program can be profiled with tnprof or traced with tntrace.
+get_filename_component(name ${ASM} NAME_WE)
+file(MAKE_DIRECTORY ${DIR})
+file(REMOVE ${DIR}/${name}.bin)
+
+execute_process(
+    COMMAND ${TNASM} ${ASM}
+    WORKING_DIRECTORY ${DIR}
+    OUTPUT_FILE ${DIR}/${name}.lst
+    RESULT_VARIABLE result
+)
+
+# tnasm reports errors by writing no .bin at all
+if(NOT result EQUAL 0 OR NOT EXISTS ${DIR}/${name}.bin)
+    message(FATAL_ERROR "tnasm could not assemble ${ASM}")
+endif()
@@ -0,0 +1,400 @@
+/*
+ * teenyat_bench runs the programs bundled with the lcd and edison systems
+ * headless, behind bus callbacks that do nothing, so the numbers it reports
+ * are the cost of the core alone.  Each program is run for a fixed number of
+ * cycles on each engine, several times over, from the same seed every time.
+ *
+ * The plain report is meant for people; --json is meant for saving and
+ * comparing one run against another.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+
+#include "teenyat.h"
+
+#define DEFAULT_CYCLES 10000000
+#define DEFAULT_REPS   5
+#define MAX_REPS       1000
+#define MAX_PROGRAMS   256
+#define BENCH_SEED     0x7EE27A7ULL
+
+#define ENGINE_CNT 4
+static const char *engine_names[ENGINE_CNT] = {
+	[TNY_ENGINE_SWITCH] = "switch",
+	[TNY_ENGINE_THREADED] = "threaded",
+	[TNY_ENGINE_BLOCK] = "block",
+	[TNY_ENGINE_JIT] = "jit",
+};
+
+typedef struct bench_program {
+	char name[128];
+	char path[1024];
+} bench_program;
+
+typedef struct bench_result {
+	const bench_program *program;
+	uint8_t engine;
+	uint64_t instructions;
+	double ns_mean;  /* per cycle */
+	double ns_min;
+	double ns_stddev;
+} bench_result;
+
+static void bus_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay) {
+	(void)t;
+	(void)addr;
+	(void)delay;
+	data->u = 0;
+
+	return;
+}
+
+static void bus_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay) {
+	(void)t;
+	(void)addr;
+	(void)data;
+	(void)delay;
+
+	return;
+}
+
+static uint64_t ns_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_usage(FILE *out) {
+	fprintf(out, "Usage:   teenyat_bench [options] [bin file ...]\n");
+	fprintf(out, "\n");
+	fprintf(out, "  --cycles N     cycles to run each program for (default %d)\n", DEFAULT_CYCLES);
+	fprintf(out, "  --reps N       times to repeat each run (default %d)\n", DEFAULT_REPS);
+	fprintf(out, "  --engine NAME  switch, threaded, block, or jit (default all four)\n");
+	fprintf(out, "  --json         machine-readable output\n");
+	fprintf(out, "\n");
+	fprintf(out, "Without bin files, every program bundled with lcd and edison is run.\n");
+
+	return;
+}
+
+/**
+ * @brief
+ *   Set up an instance to run a program on the given engine
+ *
+ * @return
+ *   True on success, false otherwise.
+ */
+static bool load(teenyat *t, const char *path, uint8_t engine) {
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return false;
+	}
+
+	bool ok = tny_init_unclocked(t, f, bus_read, bus_write);
+	fclose(f);
+	if(!ok) {
+		fprintf(stderr, "Unable to initialize a TeenyAT with %s\n", path);
+		return false;
+	}
+
+	/* every run starts from the same random state */
+	tny_reset_with_seed(t, BENCH_SEED);
+
+	if(engine != TNY_ENGINE_SWITCH) {
+		if(!tny_set_decode_cache(t, true) || !tny_set_engine(t, engine)) {
+			fprintf(stderr, "Unable to use the %s engine\n", engine_names[engine]);
+			tny_destroy(t);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief
+ *   Count the instructions a program starts in its first cycles
+ *
+ * This steps one cycle at a time, outside of any timing, as an instruction
+ * starts on every cycle that isn't paying off an earlier one's delay.  All
+ * engines execute the same instructions, so one count serves them all.
+ */
+static bool count_instructions(const char *path, uint64_t cycles, uint64_t *instructions) {
+	teenyat t;
+	if(!load(&t, path, TNY_ENGINE_SWITCH)) {
+		return false;
+	}
+
+	uint64_t cnt = 0;
+	for(uint64_t i = 0; i < cycles; i++) {
+		if(t.delay_cycles == 0) {
+			cnt++;
+		}
+		tny_clock(&t);
+	}
+	tny_destroy(&t);
+
+	*instructions = cnt;
+
+	return true;
+}
+
+static bool bench(bench_result *r, uint64_t cycles, int reps) {
+	double ns[MAX_REPS] = {0};
+
+	for(int i = 0; i < reps; i++) {
+		teenyat t;
+		if(!load(&t, r->program->path, r->engine)) {
+			return false;
+		}
+
+		uint64_t start = ns_clock();
+		uint64_t ran = tny_run(&t, cycles);
+		uint64_t end = ns_clock();
+		tny_destroy(&t);
+
+		if(ran != cycles) {
+			fprintf(stderr, "%s only ran %" PRIu64 " of %" PRIu64 " cycles\n",
+			        r->program->name, ran, cycles);
+			return false;
+		}
+
+		ns[i] = (double)(end - start) / cycles;
+	}
+
+	double sum = 0.0;
+	r->ns_min = ns[0];
+	for(int i = 0; i < reps; i++) {
+		sum += ns[i];
+		if(ns[i] < r->ns_min) {
+			r->ns_min = ns[i];
+		}
+	}
+	r->ns_mean = sum / reps;
+
+	/* sample standard deviation, across the repetitions */
+	double sq = 0.0;
+	for(int i = 0; i < reps; i++) {
+		sq += (ns[i] - r->ns_mean) * (ns[i] - r->ns_mean);
+	}
+	r->ns_stddev = (reps > 1) ? sqrt(sq / (reps - 1)) : 0.0;
+
+	return true;
+}
+
+/* Guest instructions per host second, going by the mean run */
+static double instructions_per_second(const bench_result *r, uint64_t cycles) {
+	double seconds = r->ns_mean * cycles / 1e9;
+
+	return (seconds > 0.0) ? r->instructions / seconds : 0.0;
+}
+
+/**
+ * @brief
+ *   Read the list of programs assembled along with teenyat_bench
+ *
+ * Each line of the manifest is a name, a tab, and the path of its .bin file.
+ */
+static int read_manifest(const char *path, bench_program *programs, int max) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL) {
+		fprintf(stderr, "Unable to open the program manifest %s\n", path);
+		return -1;
+	}
+
+	int cnt = 0;
+	char line[sizeof(programs[0].name) + sizeof(programs[0].path) + 2];
+	while(cnt < max && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char *tab = strchr(line, '\t');
+		if(tab == NULL) {
+			continue;
+		}
+		size_t name_len = tab - line;
+		size_t path_len = strlen(tab + 1);
+		if(name_len >= sizeof(programs[cnt].name) || path_len >= sizeof(programs[cnt].path)) {
+			fprintf(stderr, "Skipping an overlong manifest entry\n");
+			continue;
+		}
+		memcpy(programs[cnt].name, line, name_len);
+		programs[cnt].name[name_len] = '\0';
+		memcpy(programs[cnt].path, tab + 1, path_len + 1);
+		cnt++;
+	}
+	fclose(f);
+
+	return cnt;
+}
+
+static void json_string(FILE *out, const char *s) {
+	fputc('"', out);
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\') {
+			fputc('\\', out);
+		}
+		fputc(*s, out);
+	}
+	fputc('"', out);
+
+	return;
+}
+
+static void print_json(FILE *out, const bench_result *results, int cnt, uint64_t cycles, int reps) {
+	fprintf(out, "{\n");
+	fprintf(out, "  \"build\": ");
+	json_string(out, TNY_BENCH_BUILD_TYPE);
+	fprintf(out, ",\n");
+	fprintf(out, "  \"cycles\": %" PRIu64 ",\n", cycles);
+	fprintf(out, "  \"reps\": %d,\n", reps);
+	fprintf(out, "  \"results\": [\n");
+	for(int i = 0; i < cnt; i++) {
+		const bench_result *r = &results[i];
+		fprintf(out, "    {\"program\": ");
+		json_string(out, r->program->name);
+		fprintf(out, ", \"engine\": \"%s\", \"instructions\": %" PRIu64 ", "
+		        "\"ns_per_cycle_mean\": %.4f, \"ns_per_cycle_min\": %.4f, "
+		        "\"ns_per_cycle_stddev\": %.4f, \"instructions_per_second\": %.0f}%s\n",
+		        engine_names[r->engine], r->instructions,
+		        r->ns_mean, r->ns_min, r->ns_stddev,
+		        instructions_per_second(r, cycles), (i + 1 < cnt) ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+
+	return;
+}
+
+static void print_table(FILE *out, const bench_result *results, int cnt, uint64_t cycles, int reps) {
+	fprintf(out, "%" PRIu64 " cycles per run, %d runs each\n\n", cycles, reps);
+	fprintf(out, "%-32s %-9s %10s %10s %10s %10s\n",
+	        "program", "engine", "ns/cycle", "min", "stddev", "MIPS");
+	for(int i = 0; i < cnt; i++) {
+		const bench_result *r = &results[i];
+		fprintf(out, "%-32s %-9s %10.3f %10.3f %10.3f %10.2f\n",
+		        r->program->name, engine_names[r->engine],
+		        r->ns_mean, r->ns_min, r->ns_stddev,
+		        instructions_per_second(r, cycles) / 1e6);
+	}
+
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t cycles = DEFAULT_CYCLES;
+	int reps = DEFAULT_REPS;
+	int only_engine = -1;
+	bool json = false;
+
+	static bench_program programs[MAX_PROGRAMS];
+	int program_cnt = 0;
+
+	for(int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if(strcmp(arg, "--cycles") == 0 && value) {
+			cycles = strtoull(value, NULL, 10);
+			i++;
+		}
+		else if(strcmp(arg, "--reps") == 0 && value) {
+			reps = atoi(value);
+			i++;
+		}
+		else if(strcmp(arg, "--engine") == 0 && value) {
+			for(int e = 0; e < ENGINE_CNT; e++) {
+				if(strcmp(value, engine_names[e]) == 0) {
+					only_engine = e;
+				}
+			}
+			if(only_engine < 0) {
+				fprintf(stderr, "Unknown engine %s\n", value);
+				exit(EXIT_FAILURE);
+			}
+			i++;
+		}
+		else if(strcmp(arg, "--json") == 0) {
+			json = true;
+		}
+		else if(strcmp(arg, "--help") == 0) {
+			print_usage(stdout);
+			exit(EXIT_SUCCESS);
+		}
+		else if(arg[0] == '-') {
+			print_usage(stderr);
+			exit(EXIT_FAILURE);
+		}
+		else if(program_cnt < MAX_PROGRAMS) {
+			/* named for the file, less any directories */
+			const char *name = strrchr(arg, '/');
+			name = name ? name + 1 : arg;
+			snprintf(programs[program_cnt].name, sizeof(programs[program_cnt].name), "%s", name);
+			snprintf(programs[program_cnt].path, sizeof(programs[program_cnt].path), "%s", arg);
+			program_cnt++;
+		}
+	}
+
+	if(cycles == 0 || reps < 1 || reps > MAX_REPS) {
+		print_usage(stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if(program_cnt == 0) {
+		program_cnt = read_manifest(TNY_BENCH_MANIFEST, programs, MAX_PROGRAMS);
+		if(program_cnt <= 0) {
+			fprintf(stderr, "No programs to run\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bench_result *results = calloc((size_t)program_cnt * ENGINE_CNT, sizeof(bench_result));
+	if(results == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int result_cnt = 0;
+	bool ok = true;
+	for(int p = 0; p < program_cnt; p++) {
+		uint64_t instructions;
+		if(!count_instructions(programs[p].path, cycles, &instructions)) {
+			ok = false;
+			continue;
+		}
+
+		for(int e = 0; e < ENGINE_CNT; e++) {
+			if(only_engine >= 0 && e != only_engine) {
+				continue;
+			}
+
+			bench_result *r = &results[result_cnt];
+			r->program = &programs[p];
+			r->engine = e;
+			r->instructions = instructions;
+			if(!bench(r, cycles, reps)) {
+				ok = false;
+				continue;
+			}
+			result_cnt++;
+		}
+	}
+
+	if(json) {
+		print_json(stdout, results, result_cnt, cycles, reps);
+	}
+	else {
+		print_table(stdout, results, result_cnt, cycles, reps);
+	}
+
+	free(results);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -138,10 +138,19 @@
 #define FADER_LEFT 0xA020
 #define FADER_RIGHT 0xA021
 
+/* cycles between looks at the mouse and keyboard, 1 ms at 1 MHz so input stays responsive */
+#define INPUT_CYCLES 1000
+/* cycles between renders of the board, 20 Hz === 50 ms at 1 MHz */
+#define FRAME_CYCLES 50000
+
 
 void bus_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay);
 void bus_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay);
 void port_change(teenyat *t, bool is_port_a, tny_word port);
+void buzzer_write(void *ctx, tny_uword addr, tny_word data, uint64_t cycle);
+void input_event(teenyat *t, void *ctx, uint64_t cycle);
+void frame_event(teenyat *t, void *ctx, uint64_t cycle);
+void render_board(teenyat *t, tny_write_queue *buzzer_queue);
 
 int main(int argc, char* argv[])
 {  
@@ -152,10 +161,18 @@ int main(int argc, char* argv[])
 
     std::string fileName = argv[1];
     teenyat t;
+    /* starting and stopping audio devices is slow, so it happens on a thread of its own */
+    tny_write_queue *buzzer_queue = tny_write_queue_create(64, buzzer_write, NULL);
     FILE *bin_file = fopen(fileName.c_str(), "rb");
     if(bin_file != NULL) {
         tny_init_clocked(&t, bin_file, bus_read, bus_write, 1);
         tny_port_change(&t,port_change);
+        tny_register_queued_peripheral(&t, BUZZER_LEFT, BUZZER_RIGHT, NULL, buzzer_queue, NULL);
+        /* programs waiting in a loop for something to change needn't be run through it */
+        tny_set_spin_skip(&t, true);
+        /* the board is seen to between runs, by these */
+        tny_schedule_event(&t, INPUT_CYCLES, input_event, NULL);
+        tny_schedule_event(&t, FRAME_CYCLES, frame_event, buzzer_queue);
         fclose(bin_file);
     }else {
         std::cout << "Failed to init bin file (invalid path?)" << std::endl;
@@ -176,30 +193,64 @@ int main(int argc, char* argv[])
 
     auto last_update_time = std::chrono::steady_clock::now();
     while(!tigrClosed(window) && !tigrKeyDown(window, TK_ESCAPE)) {
+        /* runs until the input event sees the clock paused or the board closed */
+        if(!CLOCK_PAUSED) {
+            tny_run(&t, FRAME_CYCLES);
+            continue;
+        }
+
+        /* paused, the board still needs seeing to, though the TeenyAT doesn't */
         process_mouse(&t);
         process_keyboard(&t);
-        if(!CLOCK_PAUSED) tny_clock(&t);
         auto now = std::chrono::steady_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update_time);
         
         /* 20 Hz === 50 ms */
         if(duration.count() >= 50) {
-            /* Render all components so aplhas fill out  */
-            lcd_render_full_screen();
-            led_array_draw(&t); 
-            segment_render_display(&t);
-            linear_fader_render();
-            render_buzzers();
+            render_board(&t, buzzer_queue);
             last_update_time = now;
-            tigrUpdate(window); 
         }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 
+    tny_write_queue_destroy(buzzer_queue);
     kill_board();
     free_audio();
     return EXIT_SUCCESS;
 }
 
+void input_event(teenyat *t, void * /*ctx*/, uint64_t cycle)
+{
+    process_mouse(t);
+    process_keyboard(t);
+    if(CLOCK_PAUSED || tigrClosed(window) || tigrKeyDown(window, TK_ESCAPE)) {
+        tny_stop(t);
+    }
+    tny_schedule_event(t, cycle + INPUT_CYCLES, input_event, NULL);
+    return;
+}
+
+void frame_event(teenyat *t, void *ctx, uint64_t cycle)
+{
+    render_board(t, static_cast<tny_write_queue *>(ctx));
+    tny_schedule_event(t, cycle + FRAME_CYCLES, frame_event, ctx);
+    return;
+}
+
+void render_board(teenyat *t, tny_write_queue *buzzer_queue)
+{
+    /* Render all components so aplhas fill out  */
+    lcd_render_full_screen();
+    led_array_draw(t); 
+    segment_render_display(t);
+    linear_fader_render();
+    /* the buzzer states are set by the queue's thread */
+    tny_write_queue_flush(buzzer_queue);
+    render_buzzers();
+    tigrUpdate(window); 
+    return;
+}
+
 void bus_read(teenyat * /*t*/, tny_uword addr, tny_word *data, uint16_t */*delay*/)
 {
     switch(addr){
@@ -295,6 +346,14 @@ void bus_write(teenyat * /*t*/, tny_uword addr, tny_word data, uint16_t */*delay
         case LCD_CURSOR_XY: 
             lcd_set_cursor_x_y(data,false,true);
             break;
+        default:
+            break;
+    }
+}
+
+void buzzer_write(void * /*ctx*/, tny_uword addr, tny_word data, uint64_t /*cycle*/)
+{
+    switch(addr){
         case BUZZER_LEFT:
             buzzer_state[0] = data.u & 0x7FFFF;
             play_sound(data.u,0);
@@ -140,13 +140,23 @@
 #define TERM 0xFFFF
 #define KEY 0xFFFE
 
+/* cycles between profiler samples, prime so it won't fall in step with loops */
+#define PROFILE_PERIOD 997
+
+/* cycles between screen updates */
+#define FRAME_CYCLES (gridLength * gridLength * gridLength + 1)
+
 void bus_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay);
 void bus_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay);
+void live_screen_written(teenyat *t, void *ctx, tny_uword first, tny_uword last);
+void term_write(void *ctx, tny_uword addr, tny_word data, uint64_t cycle);
+void frame(teenyat *t, void *ctx, uint64_t cycle);
 
 int main(int argc, char *argv[])
 {   
     if(argc < 2) {
         std::cout << "Please provide a binary file" << std::endl;
+        std::cout << "Usage:   lcd <bin file> [profile file]" << std::endl;
         return 1;
     }
 
@@ -155,46 +165,68 @@ int main(int argc, char *argv[])
 
     std::string fileName = argv[1];
     teenyat t;
+    /* printing to the terminal is slow, so it happens on a thread of its own */
+    tny_write_queue *term_queue = tny_write_queue_create(256, term_write, NULL);
     FILE *bin_file = fopen(fileName.c_str(), "rb");
     if(bin_file != NULL) {
         tny_init_from_file(&t, bin_file, bus_read, bus_write);
         fclose(bin_file);
+        /* the screens are mapped straight into the TeenyAT's address space */
+        tny_map_window(&t, LIVESCREEN_START, LIVESCREEN_END, reinterpret_cast<tny_word *>(live_screen),
+                       NULL, live_screen_written, NULL);
+        tny_map_window(&t, UPDATESCREEN_START, UPDATESCREEN_END, reinterpret_cast<tny_word *>(update_screen),
+                       NULL, NULL, NULL);
+        tny_register_queued_peripheral(&t, TERM, TERM, NULL, term_queue, NULL);
+        /* programs waiting in a loop for something to change needn't be run through it */
+        tny_set_spin_skip(&t, true);
+        /* given somewhere to put it, profile the program for tnprof */
+        if(argc > 2) {
+            tny_set_profiler(&t, PROFILE_PERIOD);
+        }
+        tny_schedule_event(&t, FRAME_CYCLES, frame, NULL);
     }else {
         std::cout << "Failed to init bin file (invalid path?)" << std::endl;
         return 0;
     }
 
+    /* the screen and keyboard are seen to between runs, by the frame event */
     while(!tigrClosed(window) && !tigrKeyDown(window, TK_ESCAPE)) {
-        if(current_frame > (gridLength * gridLength * gridLength)){
-            tigrUpdate(window);
-            current_frame = 0;
-        }
-        if(key_pressed(window)) {
-            tny_external_interrupt(&t, TNY_XINT0);
+        tny_run(&t, FRAME_CYCLES);
+    }
+
+    if(argc > 2) {
+        FILE *profile_file = fopen(argv[2], "w");
+        if(profile_file != NULL) {
+            tny_dump_profile(&t, profile_file);
+            fclose(profile_file);
+        }else {
+            std::cout << "Failed to write profile to " << argv[2] << std::endl;
         }
-        tny_clock(&t);
-        current_frame++;
     }
 
+    tny_write_queue_destroy(term_queue);
     tigrFree(window);
     return EXIT_SUCCESS;
 }
 
-void bus_read(teenyat * /*t*/, tny_uword addr, tny_word *data, uint16_t *delay)
+void frame(teenyat *t, void * /*ctx*/, uint64_t cycle)
 {
-    /* Handles pixel screen reads */
-    if(addr >= UPDATESCREEN_START && addr <= UPDATESCREEN_END) {
-        int index = map(addr, UPDATESCREEN_START, UPDATESCREEN_END, 0, (gridLength * gridLength) - 1);
-        data->u = update_screen[index];
-        return;
+    tigrUpdate(window);
+    if(key_pressed(window)) {
+        tny_external_interrupt(t, TNY_XINT0);
     }
+    tny_schedule_event(t, cycle + FRAME_CYCLES, frame, NULL);
+    return;
+}
 
-    if(addr >= LIVESCREEN_START && addr <= LIVESCREEN_END) {
-        int index = map(addr, LIVESCREEN_START, LIVESCREEN_END, 0, (gridLength * gridLength) - 1);
-        data->u = live_screen[index];
-        return;
-    }
+void live_screen_written(teenyat * /*t*/, void * /*ctx*/, tny_uword /*first*/, tny_uword /*last*/)
+{
+    render();
+    return;
+}
 
+void bus_read(teenyat * /*t*/, tny_uword addr, tny_word *data, uint16_t *delay)
+{
     switch(addr) {
     case X1:
         data->u = lcd_x1;
@@ -253,21 +285,6 @@ void bus_read(teenyat * /*t*/, tny_uword addr, tny_word *data, uint16_t *delay)
 
 void bus_write(teenyat * /*t*/, tny_uword addr, tny_word data, uint16_t * /*delay*/)
 {
-    
-    /* Handles pixel screen writes */
-    if(addr >= UPDATESCREEN_START && addr <= UPDATESCREEN_END) {
-        int index = map(addr, UPDATESCREEN_START, UPDATESCREEN_END, 0, (gridLength * gridLength) - 1);
-        update_screen[index] = data.u;
-        return;
-    }
-
-    if(addr >= LIVESCREEN_START && addr <= LIVESCREEN_END) {
-        int index = map(addr, LIVESCREEN_START, LIVESCREEN_END, 0, (gridLength * gridLength) - 1);
-        live_screen[index] = data.u;
-        render();
-        return;
-    }
-
     switch(addr) {
     case X1:
         setVal(data.u, &lcd_x1);
@@ -305,22 +322,25 @@ void bus_write(teenyat * /*t*/, tny_uword addr, tny_word data, uint16_t * /*dela
     case POINT:
         point();
         break;
-    case TERM:
-        std::cout << "0x" << std::hex << std::setfill('0') << std::setw(4) << data.u;
-        std::cout << std::dec << std::setfill(' ') << std::setw(5);
-        std::cout << "    unsigned: " << data.u;
-        std::cout << "    signed: " << data.s;
-        std::cout << "    char: ";
-        if(data.u < 256) {
-            std::cout << (char)(data.u);
-        }
-        else {
-            std::cout << "<out of range>";
-        }
-        std::cout << std::endl;
-        break;
     default:
         break;
     }
     return;
 }
+
+void term_write(void * /*ctx*/, tny_uword /*addr*/, tny_word data, uint64_t /*cycle*/)
+{
+    std::cout << "0x" << std::hex << std::setfill('0') << std::setw(4) << data.u;
+    std::cout << std::dec << std::setfill(' ') << std::setw(5);
+    std::cout << "    unsigned: " << data.u;
+    std::cout << "    signed: " << data.s;
+    std::cout << "    char: ";
+    if(data.u < 256) {
+        std::cout << (char)(data.u);
+    }
+    else {
+        std::cout << "<out of range>";
+    }
+    std::cout << std::endl;
+    return;
+}
@@ -20,7 +20,6 @@ extern double pixelSize;
 extern int mouseX;
 extern int mouseY;
 extern int mouseButton;
-extern int current_frame;
 
 extern int lcd_x1;
 extern int lcd_y1;
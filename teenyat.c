@@ -6,14 +6,27 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "teenyat.h"
 
+/*
+ * The JIT engine translates blocks into x86-64 machine code, so it is only
+ * native on x86-64 hosts with mmap().  Everywhere else it is the block engine.
+ */
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(TNY_NO_JIT)
+	#define TNY_JIT_NATIVE
+	#include <stddef.h>
+	#include <sys/mman.h>
+#endif
+
 /*
  * Platform Independent microsecond clock function
  */
@@ -27,7 +40,15 @@
 		/* Convert to micorseconds */
 		return (counter.QuadPart * 1000000LL) / frequency.QuadPart;
 	}
+	/* Sleep until around a us_clock() time; Sleep() only does whole milliseconds */
+	static void sleep_until_us(uint64_t deadline) {
+		uint64_t now = us_clock();
+		if(deadline > now + 1000) {
+			Sleep((DWORD)((deadline - now) / 1000) - 1);
+		}
+	}
 #else
+	#include <errno.h>
 	#include <unistd.h>
 	uint64_t us_clock(void) {
 		struct timespec ts;
@@ -35,8 +56,34 @@
 		/* Convert to micorseconds */
 		return (uint64_t)(ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL);
 	}
+	/* Sleep until a us_clock() time */
+	static void sleep_until_us(uint64_t deadline) {
+		#if defined(__APPLE__)
+			/* no clock_nanosleep() here, so sleep for whatever is left instead */
+			uint64_t now = us_clock();
+			if(deadline > now) {
+				struct timespec ts = {
+					.tv_sec = (deadline - now) / 1000000,
+					.tv_nsec = ((deadline - now) % 1000000) * 1000
+				};
+				nanosleep(&ts, NULL);
+			}
+		#else
+			struct timespec ts = {
+				.tv_sec = deadline / 1000000,
+				.tv_nsec = (deadline % 1000000) * 1000
+			};
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		#endif
+	}
 #endif
 
+/*
+ * Sleeping can overshoot by a few tens of microseconds, so hybrid pacing
+ * wakes this much early and spins the rest of the way.
+ */
+#define TNY_PACING_SPIN_US 50
+
 tny_uword tny_random(teenyat *t);
 uint64_t  tny_calibrate_1_MHZ(void);
 
@@ -63,286 +110,2282 @@ static inline void set_pc(teenyat *t, tny_uword addr) {
 	return;
 }
 
-static inline void inc_pc(teenyat *t) {
-	set_pc(t, t->reg[TNY_REG_PC].u + 1);
+/*
+ * An instruction with its fields already extracted, as held by the decode
+ * cache.  A length of 0 marks a cache entry that has yet to be decoded.
+ */
+struct tny_decoded {
+	tny_sword immed;
+	uint8_t opcode;
+	uint8_t reg1;
+	uint8_t reg2;
+	uint8_t cond;    /* the inst_flags bits used by JMP */
+	uint8_t length;  /* 1 for teeny instructions, 2 otherwise */
+	uint8_t cycles;  /* cost known without executing, including this cycle */
+	/* basic block starting here, as used by the block engine */
+	uint8_t block_len;     /* instruction count, or one of TNY_BLOCK_* */
+	uint8_t block_cycles;  /* total cost of the whole block */
+};
 
-	return;
-}
+/*
+ * The block engine runs straight-line stretches of "pure" instructions as a
+ * unit.  A block ends at its first control transfer, and at most
+ * TNY_BLOCK_MAX_LEN instructions are put in one so a RAM write only ever has
+ * a small span of block summaries to throw out.
+ */
+#define TNY_BLOCK_UNKNOWN 0     /* not yet worked out */
+#define TNY_BLOCK_NONE    0xFF  /* the instruction here can't start a block */
+#define TNY_BLOCK_MAX_LEN 16
+#define TNY_BLOCK_MAX_SPAN (2 * TNY_BLOCK_MAX_LEN)
+
+#ifdef TNY_JIT_NATIVE
+
+/* room for translations, all thrown out to start over once it fills up */
+#define TNY_JIT_CODE_SIZE (1 << 20)
+/* more than the translation of any one block could need */
+#define TNY_JIT_BLOCK_ROOM 4096
+
+struct tny_jit {
+	/* mapped executable, except while a block is being translated */
+	uint8_t *code;
+	size_t used;
+	/* how much of it the way in and the way out (see jit_create()) take up */
+	size_t stubs;
+	/* where every translation goes to hand control back to run_jit() */
+	uint8_t *exit;
+	/* the translation of the block starting at each address, if there is one */
+	uint8_t *entries[TNY_RAM_SIZE];
+};
 
-static inline void dec_pc(teenyat *t) {
-	set_pc(t, t->reg[TNY_REG_PC].u - 1);
+/* Throw out the translation of any block that may have run over the given words */
+static inline void jit_forget(teenyat *t, tny_uword first, unsigned cnt) {
+	if(!t->jit) return;
+
+	for(unsigned i = 0; i < cnt + TNY_BLOCK_MAX_SPAN; i++) {
+		t->jit->entries[(first + cnt - 1 - i) & TNY_MAX_RAM_ADDRESS] = NULL;
+	}
 
 	return;
 }
 
-static void default_bus_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay) {
-	/* all parameters unused */
-	(void)t;
-	(void)addr;
-	(void)data;
-	(void)delay;
+static inline void jit_forget_all(teenyat *t) {
+	if(!t->jit) return;
+
+	memset(t->jit->entries, 0, sizeof(t->jit->entries));
 
 	return;
 }
 
-static void default_bus_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay) {
-	/* all parameters unused */
-	(void)t;
-	(void)addr;
-	(void)data;
-	(void)delay;
+static bool jit_create(teenyat *t);
+
+static void jit_destroy(teenyat *t) {
+	if(!t->jit) return;
+
+	munmap(t->jit->code, TNY_JIT_CODE_SIZE);
+	free(t->jit);
+	t->jit = NULL;
 
 	return;
 }
 
-bool tny_init_from_file(teenyat *t, FILE *bin_file,
-                        TNY_READ_FROM_BUS_FNPTR bus_read,
-                        TNY_WRITE_TO_BUS_FNPTR bus_write) {
+#else
 
-	if(!t) {
-		return false;
-	}
-	t->initialized = false;
-	if(!bin_file) return false;
+/* Without native code, there are never any translations to throw out */
+static inline void jit_forget(teenyat *t, tny_uword first, unsigned cnt) { (void)t; (void)first; (void)cnt; }
+static inline void jit_forget_all(teenyat *t) { (void)t; }
+static inline void jit_destroy(teenyat *t) { (void)t; }
+static inline bool jit_create(teenyat *t) { (void)t; return false; }
 
-	/* Clear the entire instance */
-	memset(t, 0, sizeof(teenyat));
+#endif /* TNY_JIT_NATIVE */
 
-	/* backup .bin file */
-	size_t words_read = fread(t->bin_image, sizeof(tny_word), TNY_RAM_SIZE, bin_file);
-	if((words_read <= 0) || ferror(bin_file)) {
-		return false;
-	}
+/* Every bit of teenyat.dirty_pages and teenyat.private_pages */
+_Static_assert(TNY_RAM_PAGE_CNT == 32, "page masks hold one bit per RAM page");
+#define TNY_ALL_RAM_PAGES UINT32_MAX
 
-	/* store bus callbacks */
-	t->bus_read = bus_read ? bus_read : default_bus_read;
-	t->bus_write = bus_write ? bus_write : default_bus_write;
+/*
+ * RAM is made of pages that can be shared, copy-on-write, by any number of
+ * instances.  Those of an image are never written or freed on their own.
+ */
+struct tny_ram_page {
+	uint32_t refs;
+	tny_word words[TNY_RAM_PAGE_SIZE];
+};
 
-	t->clock_manager.calibrate_cycles = TNY_DEFAULT_CALIBRATE_CYCLES;
-	t->clock_manager.busy_loop_cnt = tny_calibrate_1_MHZ();
-	t->clock_manager.target_mhz = 1;
+/*
+ * A read-only copy of a .bin file shared by every instance initialized from
+ * it.  Words past the end of the file are zero, just as they would be in RAM.
+ */
+struct tny_image {
+	uint32_t refs;
+	/* identifies the contents, so delta snapshots are loaded against the same image */
+	uint64_t hash;
+	tny_ram_page pages[TNY_RAM_PAGE_CNT];
+};
 
-	if(!tny_reset(t)) {
-		return false;
+#ifdef TNY_PERF_COUNTERS
+
+#define TNY_PERF_NO_OPCODE 0xFF
+
+struct tny_perf {
+	tny_perf_counters counters;
+	/* every cycle up to this one has been charged to some opcode */
+	uint64_t charged_cycle;
+	/* the instruction in progress, or TNY_PERF_NO_OPCODE */
+	uint8_t opcode;
+};
+
+/* Charge the cycles since the last charge to the instruction in progress */
+static inline void perf_charge(tny_perf *p, uint64_t cycle) {
+	if(p->opcode != TNY_PERF_NO_OPCODE) {
+		p->counters.cycles[p->opcode] += cycle - p->charged_cycle;
 	}
+	p->charged_cycle = cycle;
 
-	t->initialized = true;
+	return;
+}
 
-	return true;
+/* Start counting from the given cycle, charging nothing before it */
+static inline void perf_restart(tny_perf *p, uint64_t cycle) {
+	p->charged_cycle = cycle;
+	p->opcode = TNY_PERF_NO_OPCODE;
+
+	return;
 }
 
-bool tny_init_clocked(teenyat *t, FILE *bin_file,
-                      TNY_READ_FROM_BUS_FNPTR bus_read,
-                      TNY_WRITE_TO_BUS_FNPTR bus_write,
-                      uint16_t MHz){
+/* An instruction starting on the current cycle */
+static inline void perf_start(teenyat *t, const tny_decoded *d) {
+	if(!t->perf) return;
 
-	if(!t) return false;
-	/* Cannot have negative or zero target mhz */
-	if(MHz == 0 ) return false;
+	perf_charge(t->perf, t->cycle_cnt - 1);
+	t->perf->opcode = d->opcode;
+	t->perf->counters.retired[d->opcode]++;
 
-	bool result = tny_init_from_file(t,bin_file,bus_read,bus_write);
-	t->clock_manager.target_mhz = MHz;
+	return;
+}
 
-	return result;
+/* A block is about to start on the cycle after the current one */
+static inline void perf_block_start(teenyat *t) {
+	if(!t->perf) return;
+
+	perf_charge(t->perf, t->cycle_cnt);
+
+	return;
 }
 
-bool tny_init_unclocked(teenyat *t, FILE *bin_file,
-                        TNY_READ_FROM_BUS_FNPTR bus_read,
-                        TNY_WRITE_TO_BUS_FNPTR bus_write){
+/* An instruction of a block, which costs exactly its decoded cycles */
+static inline void perf_block_instruction(teenyat *t, const tny_decoded *d) {
+	if(!t->perf) return;
 
-	if(!t) return false;
+	t->perf->opcode = d->opcode;
+	t->perf->counters.retired[d->opcode]++;
+	t->perf->counters.cycles[d->opcode] += d->cycles;
+	t->perf->charged_cycle += d->cycles;
 
-	bool result = tny_init_from_file(t,bin_file,bus_read,bus_write);
-	tny_set_calibration_window(t,-1);
-	
-	return result;
+	return;
 }
 
-bool tny_set_calibration_window(teenyat *t,int16_t calibrate_cycles){
-	if(!t) return false;
-	t->clock_manager.calibrate_cycles = calibrate_cycles;
-	t->clock_manager.cycles_until_calibrate = calibrate_cycles;
-	return true;
+static inline void perf_read(teenyat *t, bool external) {
+	if(!t->perf) return;
+
+	if(external) {
+		t->perf->counters.external_reads++;
+	}
+	else {
+		t->perf->counters.internal_reads++;
+	}
+
+	return;
 }
 
-bool tny_reset(teenyat *t) {
-	if(!t) return false;
+static inline void perf_write(teenyat *t, bool external) {
+	if(!t->perf) return;
 
-	/* restore ram to it's initial post-bin-load state */
-	memcpy(t->ram, t->bin_image, TNY_RAM_SIZE);
+	if(external) {
+		t->perf->counters.external_writes++;
+	}
+	else {
+		t->perf->counters.internal_writes++;
+	}
 
-	t->reg[TNY_REG_PC].u = 0x0;
-	t->reg[TNY_REG_SP].u = 0x7FFF;
-	t->reg[TNY_REG_ZERO].u = 0;
-	t->reg[TNY_REG_A].u = 0;
-	t->reg[TNY_REG_B].u = 0;
-	t->reg[TNY_REG_C].u = 0;
-	t->reg[TNY_REG_D].u = 0;
-	t->reg[TNY_REG_E].u = 0;
+	return;
+}
 
-	t->flags.carry   = false;
-	t->flags.equals  = false;
-	t->flags.less    = false;
-	t->flags.greater = false;
+static inline void perf_interrupt(teenyat *t) {
+	if(!t->perf) return;
 
-	/* "instruction" and "immediate" members do not need initialization */
+	t->perf->counters.interrupts++;
 
-	/* Initialize ports to output w/ all 0s */
-	t->port_a.u = 0;
-	t->port_a_directions.u = 0;
-	t->port_b.u = 0;
-	t->port_b_directions.u = 0;
+	return;
+}
 
-	t->port_change = NULL;
+static inline void perf_dly(teenyat *t, uint64_t cycles) {
+	if(!t->perf) return;
 
-	/* Disable all architectural features */
-	t->control_status_register.csr.interrupt_enable = 0;
-	t->control_status_register.csr.interrupt_clearing = 0;
-	t->control_status_register.csr.reserved = 0;
+	t->perf->counters.dly_cycles += cycles;
 
-	/* Clear & disable all interrupts by default */
-	t->interrupt_enable_register.u = 0;
-	t->interrupt_queue_register.u  = 0;
-	t->interrupt_return_address.u  = 0;
-	t->interrupt_return_flags.carry   = false;
-	t->interrupt_return_flags.equals  = false;
-	t->interrupt_return_flags.less    = false;
-	t->interrupt_return_flags.greater = false;
-	/* Maybe dont memset? could simulate randomness... */
-	memset(t->interrupt_vector_table, 0, sizeof(t->interrupt_vector_table));
+	return;
+}
 
-	/*
-	 * Initialize each teenyat with a unique random number stream
-	 */
-	static uint64_t stream = 1;  // start at >=1 for increment constant to be unique
+#else
 
-	/*
-	 * find a random seed
-	 */
-	uint64_t seed = (intptr_t)&time << 32;
-	seed ^= (intptr_t)&printf;
-	seed ^= time(NULL);
-	/* make seed "more" random w/ /dev/urandom if there */
-	FILE *f = fopen("/dev/urandom", "rb");
-	if(f != NULL) {
-		uint64_t entropy_bits;
-		if(fread(&entropy_bits, sizeof(entropy_bits), 1, f) == sizeof(entropy_bits)) {
-			seed ^= entropy_bits;
-		}
-		fclose(f);
-	}
+/* Without TNY_PERF_COUNTERS, counting compiles away to nothing */
+static inline void perf_start(teenyat *t, const tny_decoded *d) { (void)t; (void)d; }
+static inline void perf_block_start(teenyat *t) { (void)t; }
+static inline void perf_block_instruction(teenyat *t, const tny_decoded *d) { (void)t; (void)d; }
+static inline void perf_read(teenyat *t, bool external) { (void)t; (void)external; }
+static inline void perf_write(teenyat *t, bool external) { (void)t; (void)external; }
+static inline void perf_interrupt(teenyat *t) { (void)t; }
+static inline void perf_dly(teenyat *t, uint64_t cycles) { (void)t; (void)cycles; }
 
-	/* Set increment to arbitrary odd constant that goes up by stream */
-	t->random.increment = ((intptr_t)&tny_reset + stream) | 1ULL;
-	stream++;
+#endif /* TNY_PERF_COUNTERS */
 
-	/*
-	 * Set initial state and "put it in the past"
-	 */
-	t->random.state = seed + t->random.increment;
-	(void)tny_random(t);
+struct tny_profile {
+	uint32_t period;
+	/* the cycle the next sample is due on, which is always still to come */
+	uint64_t next_sample;
+	uint64_t sample_cnt;
+	/* tallies by instruction address */
+	uint64_t samples[TNY_RAM_SIZE];
+};
 
-	/* Set up our initial calibrated cycles */
-	t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
+/* Take the sample due on the current cycle, if there is one */
+static inline void profile_sample(teenyat *t) {
+	tny_profile *p = t->profile;
+	if(t->cycle_cnt < p->next_sample) return;
 
-	t->delay_cycles = 0;
-	t->cycle_cnt = 0;
+	p->samples[t->instruction_address & TNY_MAX_RAM_ADDRESS]++;
+	p->sample_cnt++;
+	p->next_sample = t->cycle_cnt + p->period;
 
-	return true;
+	return;
 }
 
-void tny_modify_port_levels(teenyat *t, bool is_system_request, tny_word data, bool is_port_a) {
-	tny_word *port = (is_port_a ? &(t->port_a) : &(t->port_b));
-	tny_word dir = (is_port_a ? t->port_a_directions : t->port_b_directions);
+typedef struct tny_queued_write {
+	uint64_t cycle;
+	tny_uword addr;
+	tny_word data;
+} tny_queued_write;
 
-	/* 
-	 * For the masking below, we need a bit pattern of all 1s or 0s depending
-	 * on whether this is a system request (1s) or not (0s).
-	 */
-	tny_word src;
-	src.u = ~0 * is_system_request;
+/*
+ * A single-producer, single-consumer ring of writes.  tail is only advanced
+ * by the thread running the TeenyAT and head only by the worker, and both
+ * only ever count up, wrapping into the ring by mask.  Each side sleeps on
+ * its own condition when it can't go on, and says so first, so the other
+ * side only takes the lock when someone is actually asleep.
+ */
+struct tny_write_queue {
+	tny_queued_write *ring;
+	size_t mask;
+	TNY_QUEUED_WRITE_FNPTR write;
+	void *ctx;
 
-	/*
-	 * We must know for which bits the source of the request and direction
-	 * bits match.  Eg, if the system wants to modify the port levels,
-	 * it can only do that for port bits with their direction set for input.
-	 */
-	tny_word src_dir_matches;
-	src_dir_matches.u = src.u ^ dir.u;
+	/* the producer's side, with its last look at head (atomic) */
+	size_t tail;
+	size_t head_seen;
+	/* keeps the two sides' counters out of the same cache line */
+	char producer_pad[64];
 
-	/* Save a copy of the port bits to determine whether any change */
-	tny_word old_port = *port;
+	/* the worker's side (atomic) */
+	size_t head;
+	char worker_pad[64];
 
-	/* Modify only those bits which should change */
-	port->u = (port->u & src_dir_matches.u) + (data.u & ~src_dir_matches.u);
+	/* atomic */
+	bool producer_waiting;
+	bool worker_sleeping;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t drained;
+	pthread_cond_t filled;
+	pthread_t worker;
+};
 
-	/* Launch the port change callback if any port bits were modify */
-	if((t->port_change != NULL) && (~src.u & ~dir.u & (old_port.u ^ port->u))) {
-		t->port_change(t, is_port_a, *port);
+/* Sleep until the worker has taken everything before the given tail */
+static void write_queue_wait(tny_write_queue *q, size_t tail) {
+	/* writes that may still be queued, which keeps clear of wrapping */
+	size_t allowed = q->tail - tail;
+
+	pthread_mutex_lock(&q->lock);
+	__atomic_store_n(&q->producer_waiting, true, __ATOMIC_SEQ_CST);
+	while(q->tail - __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) > allowed) {
+		pthread_cond_wait(&q->drained, &q->lock);
 	}
+	__atomic_store_n(&q->producer_waiting, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->lock);
 
 	return;
 }
 
-void tny_port_change(teenyat *t, TNY_PORT_CHANGE_FNPTR port_change) {
-	t->port_change = port_change;
-
-	return;
+static inline bool write_queue_empty(tny_write_queue *q) {
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail;
 }
 
-void tny_get_ports(teenyat *t, tny_word *a, tny_word *b) {
-	if(a != NULL) {
-		*a = t->port_a;
+static void write_queue_push(tny_write_queue *q, tny_uword addr, tny_word data, uint64_t cycle) {
+	size_t tail = q->tail;
+	if(tail - q->head_seen > q->mask) {
+		q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if(tail - q->head_seen > q->mask) {
+			/* full, so wait for room rather than lose the write */
+			write_queue_wait(q, tail - q->mask);
+			q->head_seen = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		}
 	}
 
-	if(b != NULL) {
-		*b = t->port_b;
+	tny_queued_write *w = &(q->ring[tail & q->mask]);
+	w->cycle = cycle;
+	w->addr = addr;
+	w->data = data;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&q->worker_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->filled);
+		pthread_mutex_unlock(&q->lock);
 	}
 
 	return;
 }
 
-void tny_set_ports(teenyat *t, tny_word *a, tny_word *b) {
-	if(a != NULL) {
-		tny_modify_port_levels(t, true, *a, true);
-	}
+/*
+ * Peripherals registered with tny_register_peripheral() are found through a
+ * table of every TNY_PERIPHERAL_PAGE_SIZE words of peripheral address space,
+ * which names the one peripheral covering the whole page.  Only pages split
+ * between peripherals need to search the list.
+ */
+#define TNY_PERIPHERAL_NONE  0     /* the instance's own bus callbacks */
+#define TNY_PERIPHERAL_MIXED 0xFF  /* more than one, so search the list */
+#define TNY_PERIPHERAL_MAX   (TNY_PERIPHERAL_MIXED - 1)
 
-	if(b != NULL) {
-		tny_modify_port_levels(t, true, *b, false);
+typedef struct tny_peripheral {
+	tny_uword first;
+	tny_uword last;
+	TNY_PERIPHERAL_READ_FNPTR read;
+	TNY_PERIPHERAL_WRITE_FNPTR write;
+	void *ctx;
+	/* writes go through a queue to its worker thread, in place of write */
+	tny_write_queue *queue;
+	/* a window is a host buffer accessed directly, in place of read/write */
+	tny_word *window;
+	uint64_t *dirty;
+	TNY_WINDOW_WRITTEN_FNPTR written;
+	/* the span written since the written callback was last made */
+	bool pending;
+	tny_uword written_first;
+	tny_uword written_last;
+} tny_peripheral;
+
+struct tny_peripheral_map {
+	/* one plus the list index of the page's peripheral, or one of the above */
+	uint8_t page[TNY_PERIPHERAL_PAGE_CNT];
+	/* in order of registration, so the latest covering an address wins */
+	tny_peripheral list[TNY_PERIPHERAL_MAX];
+	unsigned cnt;
+	/* some window has a written callback pending */
+	bool pending;
+};
+
+/*
+ * Find the peripheral at an address the slow way.  NULL means the address is
+ * left to the bus callbacks.
+ */
+static tny_peripheral *find_peripheral(tny_peripheral_map *map, tny_uword addr) {
+	for(unsigned i = map->cnt; i-- > 0;) {
+		tny_peripheral *p = &(map->list[i]);
+		if(addr >= p->first && addr <= p->last) {
+			/* with neither handler, the range was handed back */
+			return (p->read || p->write || p->queue || p->window) ? p : NULL;
+		}
 	}
 
-	return;
+	return NULL;
 }
 
-void tny_external_interrupt(teenyat* t, tny_uword external_interrupt) {
-	/*
-	 * Make a mask with a 1 in the position of the external interrupt number
-	 * offset so external interrupt 0..7 is mapped to bits 8..15 as the
-	 * external eight interrupts are mapped to the interrupt vector table
-	 * as ints 8..15.
-	 * 
-	 * external_interrupt > 7 are wrapped
-	 */
-	tny_uword iqr_mask = 1U << ((external_interrupt % 8) + 8);
-	/* mask in the interrupt into the upper half of our iqr */
-	t->interrupt_queue_register.u |= iqr_mask;
+static inline tny_peripheral *lookup_peripheral(const teenyat *t, tny_uword addr) {
+	tny_peripheral_map *map = t->peripherals;
+	if(!map) return NULL;
 
-	return;
+	uint8_t entry = map->page[(addr - TNY_PERIPHERAL_BASE_ADDRESS) / TNY_PERIPHERAL_PAGE_SIZE];
+	switch(entry) {
+	case TNY_PERIPHERAL_NONE:
+		return NULL;
+	case TNY_PERIPHERAL_MIXED:
+		return find_peripheral(map, addr);
+	default:
+		return &(map->list[entry - 1]);
+	}
 }
 
-/* Assumes that bits is non-zero */
-tny_uword tny_get_interrupt_index(tny_uword bits) {
-	tny_uword n = 0;
-	if (!(bits & 0x000000FF)) { n +=  8; bits >>=  8; }
-	if (!(bits & 0x0000000F)) { n +=  4; bits >>=  4; }
-	if (!(bits & 0x00000003)) { n +=  2; bits >>=  2; }
-	if (!(bits & 0x00000001))   n +=  1;
+static inline void peripheral_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay) {
+	const tny_peripheral *p = lookup_peripheral(t, addr);
+	if(!p) {
+		t->bus_read(t, addr, data, delay);
+	}
+	else if(p->window) {
+		*data = p->window[addr - p->first];
+	}
+	else if(p->read) {
+		/* reads see the effects of every write made before them */
+		if(p->queue && !write_queue_empty(p->queue)) {
+			write_queue_wait(p->queue, p->queue->tail);
+		}
+		p->read(t, p->ctx, addr, data, delay);
+	}
 
-	return n;
+	return;
 }
 
-void handle_interrupts(teenyat *t) {
-	bool      IE  = t->control_status_register.csr.interrupt_enable;
+/* Note a write to a window for whoever wants to know */
+static void window_written(teenyat *t, tny_peripheral *p, tny_uword addr) {
+	tny_uword offset = addr - p->first;
+	if(p->dirty) {
+		unsigned page = offset / TNY_PERIPHERAL_PAGE_SIZE;
+		p->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+	}
+
+	if(p->written) {
+		if(!p->pending) {
+			p->pending = true;
+			p->written_first = addr;
+			p->written_last = addr;
+			t->peripherals->pending = true;
+		}
+		else if(addr < p->written_first) {
+			p->written_first = addr;
+		}
+		else if(addr > p->written_last) {
+			p->written_last = addr;
+		}
+	}
+
+	return;
+}
+
+static inline void peripheral_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay) {
+	tny_peripheral *p = lookup_peripheral(t, addr);
+	if(!p) {
+		t->bus_write(t, addr, data, delay);
+	}
+	else if(p->window) {
+		p->window[addr - p->first] = data;
+		if(p->dirty || p->written) {
+			window_written(t, p, addr);
+		}
+	}
+	else if(p->queue) {
+		write_queue_push(p->queue, addr, data, t->cycle_cnt);
+	}
+	else if(p->write) {
+		p->write(t, p->ctx, addr, data, delay);
+	}
+
+	return;
+}
+
+/*
+ * Make the written callbacks of any windows written since last time, once
+ * for each window covering everything written to it
+ */
+static void notify_windows(teenyat *t) {
+	tny_peripheral_map *map = t->peripherals;
+	map->pending = false;
+
+	for(unsigned i = 0; i < map->cnt; i++) {
+		tny_peripheral *p = &(map->list[i]);
+		if(p->pending) {
+			p->pending = false;
+			p->written(t, p->ctx, p->written_first, p->written_last);
+		}
+	}
+
+	return;
+}
+
+static inline void finish_windows(teenyat *t) {
+	if(t->peripherals && t->peripherals->pending) {
+		notify_windows(t);
+	}
+
+	return;
+}
+
+static inline tny_word ram_read(const teenyat *t, tny_uword addr) {
+	return t->ram[addr / TNY_RAM_PAGE_SIZE]->words[addr % TNY_RAM_PAGE_SIZE];
+}
+
+static inline tny_word image_read(const tny_image *image, tny_uword addr) {
+	return image->pages[addr / TNY_RAM_PAGE_SIZE].words[addr % TNY_RAM_PAGE_SIZE];
+}
+
+static void release_page(tny_ram_page *page) {
+	if(__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(page);
+	}
+
+	return;
+}
+
+/*
+ * Get a page the instance can write in place of one shared with the image or
+ * other instances.  A shared page whose other holders have all let go is
+ * simply taken over, otherwise a copy is made.  Returns false, leaving the
+ * page shared, if there's no memory for the copy.
+ */
+static bool own_page(teenyat *t, uint32_t page) {
+	uint32_t bit = (uint32_t)1 << page;
+	tny_ram_page *shared = t->ram[page];
+
+	if((t->dirty_pages & bit) && __atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE) == 1) {
+		t->private_pages |= bit;
+		return true;
+	}
+
+	tny_ram_page *copy = malloc(sizeof(tny_ram_page));
+	if(!copy) return false;
+	copy->refs = 1;
+	memcpy(copy->words, shared->words, sizeof(copy->words));
+
+	if(t->dirty_pages & bit) {
+		release_page(shared);
+	}
+	t->ram[page] = copy;
+	t->dirty_pages |= bit;
+	t->private_pages |= bit;
+
+	return true;
+}
+
+static void decode_instruction(teenyat *t, tny_uword addr, tny_decoded *d) {
+	tny_word IR = ram_read(t, addr);
+
+	d->opcode = IR.instruction.opcode;
+	d->reg1 = IR.instruction.reg1;
+	d->reg2 = IR.instruction.reg2;
+	d->cond = IR.u & 0xF;
+	d->cycles = 1;
+	d->block_len = TNY_BLOCK_UNKNOWN;
+
+	if(IR.instruction.teeny) {
+		/*
+		 * This is a single word instruction encoding
+		 */
+		d->length = 1;
+		d->immed = IR.instruction.immed4;
+	}
+	else {
+		d->length = 2;
+		d->immed = ram_read(t, (addr + 1) & TNY_MAX_RAM_ADDRESS).s;
+		/* double word instructions cost one extra cycle */
+		d->cycles++;
+	}
+
+	switch(d->opcode) {
+	case TNY_OPCODE_LOD:
+	case TNY_OPCODE_STR:
+	case TNY_OPCODE_PSH:
+	case TNY_OPCODE_POP:
+	case TNY_OPCODE_CAL:
+		/*
+		 * To promote student use of registers, all bus operations,
+		 * including RAM access comes with an extra penalty.
+		 */
+		d->cycles += TNY_BUS_DELAY;
+		break;
+	default:
+		break;
+	}
+
+	return;
+}
+
+/*
+ * Get the decoded instruction at addr, from the decode cache if there is one.
+ * Otherwise, the instruction is decoded into scratch.
+ */
+static inline const tny_decoded *fetch_instruction(teenyat *t, tny_uword addr, tny_decoded *scratch) {
+	if(t->decode_cache) {
+		tny_decoded *d = &(t->decode_cache[addr]);
+		if(d->length == 0) {
+			decode_instruction(t, addr, d);
+		}
+		return d;
+	}
+
+	decode_instruction(t, addr, scratch);
+	return scratch;
+}
+
+#define TNY_TRACE_MAGIC "TNYT"
+#define TNY_TRACE_VERSION 1
+/* bytes per record in a dumped trace */
+#define TNY_TRACE_RECORD_SIZE 14
+
+struct tny_trace {
+	size_t mask;
+	/* records made since tracing began, so the next goes at recorded & mask */
+	uint64_t recorded;
+	/* the latest record's register value is still to be filled in */
+	bool pending;
+	/* flags for the next record, from what happened before it started */
+	uint8_t next_flags;
+	tny_trace_record records[];
+};
+
+/*
+ * Fill in what the latest record's instruction left in its register.
+ * Instructions do all their work on their first cycle, so anything after
+ * that, up to the start of the next one, will do.
+ */
+static inline void trace_settle(teenyat *t) {
+	tny_trace *tr = t->trace;
+	if(!tr->pending) return;
+
+	tny_trace_record *r = &tr->records[(tr->recorded - 1) & tr->mask];
+	if(r->reg != TNY_TRACE_NO_REG) {
+		r->reg_value = t->reg[r->reg].u;
+	}
+	tr->pending = false;
+
+	return;
+}
+
+/* The one register an instruction writes, not counting the PC */
+static uint8_t trace_written_reg(const tny_decoded *d) {
+	switch(d->opcode) {
+	case TNY_OPCODE_SET:
+	case TNY_OPCODE_LOD:
+	case TNY_OPCODE_POP:
+	case TNY_OPCODE_BTS:
+	case TNY_OPCODE_BTC:
+	case TNY_OPCODE_BTF:
+	case TNY_OPCODE_ADD:
+	case TNY_OPCODE_SUB:
+	case TNY_OPCODE_MPY:
+	case TNY_OPCODE_DIV:
+	case TNY_OPCODE_MOD:
+	case TNY_OPCODE_AND:
+	case TNY_OPCODE_OR:
+	case TNY_OPCODE_XOR:
+	case TNY_OPCODE_SHF:
+	case TNY_OPCODE_ROT:
+	case TNY_OPCODE_NEG:
+	case TNY_OPCODE_LUP:
+		return d->reg1;
+	case TNY_OPCODE_PSH:
+	case TNY_OPCODE_CAL:
+		return TNY_REG_SP;
+	default:
+		return TNY_TRACE_NO_REG;
+	}
+}
+
+static inline void trace_record(teenyat *t, const tny_decoded *d, tny_uword addr) {
+	tny_trace *tr = t->trace;
+	trace_settle(t);
+
+	tny_trace_record *r = &tr->records[tr->recorded & tr->mask];
+	r->pc = addr;
+	/* the decoded fields are the whole first word, so RAM needn't be read again */
+	r->instruction = (tny_uword)((d->opcode << 11) | ((d->length == 1) << 10) |
+	                             (d->reg1 << 7) | (d->reg2 << 4) | d->cond);
+	r->immediate = (tny_uword)d->immed;
+	r->reg_value = 0;
+	r->bus_address = 0;
+	r->bus_data = 0;
+	r->reg = trace_written_reg(d);
+	r->flags = tr->next_flags;
+
+	tr->next_flags = 0;
+	tr->recorded++;
+	tr->pending = true;
+
+	return;
+}
+
+/* An instruction starting at addr */
+static inline void trace_start(teenyat *t, const tny_decoded *d, tny_uword addr) {
+	if(!t->trace) return;
+
+	trace_record(t, d, addr);
+
+	return;
+}
+
+/* The bus access of the instruction in progress */
+static inline void trace_bus(teenyat *t, tny_uword addr, tny_word data, uint8_t kind) {
+	if(!t->trace || !t->trace->pending) return;
+
+	tny_trace_record *r = &t->trace->records[(t->trace->recorded - 1) & t->trace->mask];
+	r->bus_address = addr;
+	r->bus_data = data.u;
+	r->flags |= kind;
+
+	return;
+}
+
+static inline void trace_interrupt(teenyat *t) {
+	if(!t->trace) return;
+
+	t->trace->next_flags |= TNY_TRACE_INTERRUPTED;
+
+	return;
+}
+
+/* clocked instances skip at most this long in one go, so posts aren't kept waiting */
+#define TNY_SPIN_CLOCKED_SKIP_US 1000
+
+struct tny_spin {
+	tny_spin_stats stats;
+	/* the run under way ends on this cycle, and no skip may go past it */
+	uint64_t run_end;
+	/*
+	 * Where the last backward jump went and everything the loop could
+	 * depend on then, valid until anything else might have changed
+	 */
+	bool valid;
+	tny_word reg[8];
+	alu_flags flags;
+	/* the cycle that jump finished on */
+	uint64_t mark;
+	/* the skip most recently made, as the cycles between passes it covers */
+	uint64_t skip_from;
+	uint64_t skip_to;
+	uint64_t period;
+};
+
+/*
+ * Something outside of the registers and flags may have changed, so the
+ * loop has to be seen to repeat all over again before it can be skipped.
+ * A skip still under way, only possible when the change comes from the
+ * system, is cut short at the first pass through the top of the loop that
+ * could have seen it.
+ */
+static void spin_cut(teenyat *t) {
+	tny_spin *s = t->spin;
+	s->valid = false;
+
+	uint64_t now = t->cycle_cnt;
+	if(now >= s->skip_to || now + t->delay_cycles != s->skip_to) return;
+
+	uint64_t passed = (now > s->skip_from) ? now - s->skip_from : 0;
+	uint64_t end = s->skip_from + (passed + s->period - 1) / s->period * s->period;
+	s->stats.cycles_skipped -= s->skip_to - end;
+	t->delay_cycles = end - now;
+	s->skip_to = end;
+
+	return;
+}
+
+static inline void spin_disturb(teenyat *t) {
+	if(!t->spin) return;
+
+	spin_cut(t);
+
+	return;
+}
+
+/*
+ * A backward jump was just taken.  If the instance is right back where it
+ * was after the last one and nothing else has changed since, then every
+ * pass around the loop from here on will be the same, so as many whole
+ * passes as the run has room for are added to the jump's delay.
+ */
+static void spin_check(teenyat *t) {
+	tny_spin *s = t->spin;
+	uint64_t mark = t->cycle_cnt + t->delay_cycles;
+
+	if(s->valid &&
+	   memcmp(s->reg, t->reg, sizeof(s->reg)) == 0 &&
+	   s->flags.carry == t->flags.carry && s->flags.equals == t->flags.equals &&
+	   s->flags.less == t->flags.less && s->flags.greater == t->flags.greater &&
+	   /* an interrupt about to be taken, or anything posted, ends the loop */
+	   __atomic_load_n(&t->mailbox, __ATOMIC_RELAXED) == 0 &&
+	   !t->perf && !t->profile && !t->trace &&
+	   s->run_end > mark) {
+		uint64_t period = mark - s->mark;
+		uint64_t room = s->run_end - mark;
+		if(t->clock_manager.cycles_until_calibrate >= 0) {
+			uint64_t most = (uint64_t)TNY_SPIN_CLOCKED_SKIP_US * t->clock_manager.target_mhz;
+			if(room > most) {
+				room = most;
+			}
+		}
+
+		uint64_t cycles = room / period * period;
+		if(cycles > 0) {
+			t->delay_cycles += cycles;
+			s->skip_from = mark;
+			s->skip_to = mark + cycles;
+			s->period = period;
+			s->stats.skips++;
+			s->stats.cycles_skipped += cycles;
+			mark += cycles;
+		}
+	}
+
+	s->valid = true;
+	memcpy(s->reg, t->reg, sizeof(s->reg));
+	s->flags = t->flags;
+	s->mark = mark;
+
+	return;
+}
+
+/* Nothing seen so far holds any more, after the instance was set anew */
+static inline void spin_forget(teenyat *t) {
+	if(!t->spin) return;
+
+	t->spin->valid = false;
+	t->spin->skip_to = 0;
+
+	return;
+}
+
+typedef struct tny_event {
+	uint64_t cycle;
+	/* the order events were scheduled in, which settles ties */
+	uint64_t seq;
+	TNY_EVENT_FNPTR fn;
+	void *ctx;
+} tny_event;
+
+/* A binary min-heap of pending events, soonest first */
+struct tny_event_queue {
+	size_t cnt;
+	size_t capacity;
+	uint64_t next_seq;
+	tny_event *heap;
+};
+
+static inline bool event_before(const tny_event *a, const tny_event *b) {
+	return a->cycle < b->cycle || (a->cycle == b->cycle && a->seq < b->seq);
+}
+
+static void event_sift_up(tny_event_queue *q, size_t i) {
+	tny_event e = q->heap[i];
+	while(i > 0) {
+		size_t parent = (i - 1) / 2;
+		if(!event_before(&e, &q->heap[parent])) break;
+		q->heap[i] = q->heap[parent];
+		i = parent;
+	}
+	q->heap[i] = e;
+
+	return;
+}
+
+static void event_sift_down(tny_event_queue *q, size_t i) {
+	tny_event e = q->heap[i];
+	for(;;) {
+		size_t child = 2 * i + 1;
+		if(child >= q->cnt) break;
+		if(child + 1 < q->cnt && event_before(&q->heap[child + 1], &q->heap[child])) {
+			child++;
+		}
+		if(!event_before(&q->heap[child], &e)) break;
+		q->heap[i] = q->heap[child];
+		i = child;
+	}
+	q->heap[i] = e;
+
+	return;
+}
+
+/* Put the heap back in order after its events were changed wholesale */
+static void event_heapify(tny_event_queue *q) {
+	for(size_t i = q->cnt / 2; i > 0; i--) {
+		event_sift_down(q, i - 1);
+	}
+
+	return;
+}
+
+/* The cycle the next event is due on, or UINT64_MAX */
+static inline uint64_t next_event_cycle(const teenyat *t) {
+	if(!t->events || t->events->cnt == 0) return UINT64_MAX;
+
+	return t->events->heap[0].cycle;
+}
+
+/*
+ * The most cycles a run can go before stopping for the next event, which
+ * is always at least one.  Events already due are made after the next cycle.
+ */
+static inline uint64_t cycles_to_event(const teenyat *t, uint64_t cycles) {
+	uint64_t due = next_event_cycle(t);
+	if(due <= t->cycle_cnt) return 1;
+
+	return (due - t->cycle_cnt < cycles) ? due - t->cycle_cnt : cycles;
+}
+
+static void events_free(teenyat *t) {
+	if(!t->events) return;
+
+	free(t->events->heap);
+	free(t->events);
+	t->events = NULL;
+
+	return;
+}
+
+/* Make every event that has come due, in order */
+static void fire_events(teenyat *t) {
+	tny_event_queue *q = t->events;
+	while(q->cnt > 0 && q->heap[0].cycle <= t->cycle_cnt) {
+		tny_event e = q->heap[0];
+		q->heap[0] = q->heap[--q->cnt];
+		if(q->cnt > 0) {
+			event_sift_down(q, 0);
+		}
+
+		/* the callback may schedule or cancel events itself */
+		e.fn(t, e.ctx, e.cycle);
+	}
+
+	return;
+}
+
+/*
+ * A clocked instance waiting for an interrupt sleeps on this, and posting
+ * an interrupt wakes it.  The sleeping flag is raised before the mailbox is
+ * looked at and looked at after the mailbox is posted to, so either the
+ * sleeper sees the interrupt or the poster sees the sleeper.
+ */
+struct tny_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool sleeping;
+};
+
+static bool waiter_create(teenyat *t) {
+	tny_waiter *w = malloc(sizeof(tny_waiter));
+	if(!w) return false;
+
+	pthread_mutex_init(&w->lock, NULL);
+#if defined(__APPLE__) || defined(_WIN64) || defined(_WIN32)
+	pthread_cond_init(&w->wake, NULL);
+#else
+	/* time out by the same clock us_clock() reads */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->wake, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+	w->sleeping = false;
+
+	/* posting threads may look for it from here on */
+	__atomic_store_n(&t->waiter, w, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static void waiter_destroy(teenyat *t) {
+	if(!t->waiter) return;
+
+	pthread_cond_destroy(&t->waiter->wake);
+	pthread_mutex_destroy(&t->waiter->lock);
+	free(t->waiter);
+	t->waiter = NULL;
+
+	return;
+}
+
+/* Let no skip go past the given cycle */
+static inline void spin_run_end(teenyat *t, uint64_t cycle) {
+	if(!t->spin) return;
+
+	t->spin->run_end = cycle;
+
+	return;
+}
+
+/*
+ * All instruction writes to RAM go through here so any decoded instruction
+ * that included the word at addr is thrown out of the decode cache.
+ */
+static inline void ram_write(teenyat *t, tny_uword addr, tny_word data) {
+	spin_disturb(t);
+
+	uint32_t page = addr / TNY_RAM_PAGE_SIZE;
+	if(!((t->private_pages >> page) & 1) && !own_page(t, page)) {
+		/* the write is lost, so the run goes no further, much like tny_stop() */
+		fprintf(stderr, "Out of memory copying RAM page %" PRIu32 " for a write to 0x%04X on cycle %" PRIu64 "\n",
+		        page, addr, t->cycle_cnt);
+		t->stop_requested = true;
+		return;
+	}
+	t->ram[page]->words[addr % TNY_RAM_PAGE_SIZE] = data;
+
+	if(t->decode_cache) {
+		tny_decoded *cache = t->decode_cache;
+		tny_uword prev = (addr - 1) & TNY_MAX_RAM_ADDRESS;
+
+		/*
+		 * Every instruction in a block is decoded, so a word that is neither
+		 * decoded itself nor possibly the immediate of the decoded instruction
+		 * before it can't be part of any block.  Data and the stack take this
+		 * fast path.
+		 */
+		if(cache[addr].length == 0 && cache[prev].length == 0) return;
+
+		cache[addr].length = 0;
+		/* the word may also have been the immediate of a two word instruction */
+		cache[prev].length = 0;
+
+		/* forget any block that may have run over the word */
+		for(int i = 0; i <= TNY_BLOCK_MAX_SPAN; i++) {
+			cache[(addr - i) & TNY_MAX_RAM_ADDRESS].block_len = TNY_BLOCK_UNKNOWN;
+		}
+		jit_forget(t, addr, 1);
+	}
+
+	return;
+}
+
+static void default_bus_read(teenyat *t, tny_uword addr, tny_word *data, uint16_t *delay) {
+	/* all parameters unused */
+	(void)t;
+	(void)addr;
+	(void)data;
+	(void)delay;
+
+	return;
+}
+
+static void default_bus_write(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay) {
+	/* all parameters unused */
+	(void)t;
+	(void)addr;
+	(void)data;
+	(void)delay;
+
+	return;
+}
+
+tny_image *tny_image_load(FILE *bin_file) {
+	if(!bin_file) return NULL;
+
+	tny_image *image = calloc(1, sizeof(tny_image));
+	if(!image) return NULL;
+
+	size_t words_read = 0;
+	for(int i = 0; i < TNY_RAM_PAGE_CNT; i++) {
+		size_t n = fread(image->pages[i].words, sizeof(tny_word), TNY_RAM_PAGE_SIZE, bin_file);
+		words_read += n;
+		if(n < TNY_RAM_PAGE_SIZE) break;
+	}
+	if((words_read <= 0) || ferror(bin_file)) {
+		free(image);
+		return NULL;
+	}
+
+	/* 64-bit FNV-1a */
+	image->hash = 0xCBF29CE484222325ULL;
+	for(int i = 0; i < TNY_RAM_SIZE; i++) {
+		image->hash = (image->hash ^ image_read(image, i).u) * 0x100000001B3ULL;
+	}
+
+	image->refs = 1;
+
+	return image;
+}
+
+tny_image *tny_image_retain(tny_image *image) {
+	if(!image) return NULL;
+
+	/* atomic, so instances sharing an image can come and go on any thread */
+	__atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+
+	return image;
+}
+
+void tny_image_release(tny_image *image) {
+	if(!image) return;
+
+	if(__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(image);
+	}
+
+	return;
+}
+
+bool tny_init_from_file(teenyat *t, FILE *bin_file,
+                        TNY_READ_FROM_BUS_FNPTR bus_read,
+                        TNY_WRITE_TO_BUS_FNPTR bus_write) {
+
+	if(!t) {
+		return false;
+	}
+	t->initialized = false;
+	if(!bin_file) return false;
+
+	/* the instance keeps the only reference to an image of its own */
+	tny_image *image = tny_image_load(bin_file);
+	if(!image) return false;
+
+	bool result = tny_init_from_image(t, image, bus_read, bus_write);
+	tny_image_release(image);
+
+	return result;
+}
+
+/*
+ * The busy loop's measure of a microsecond, taken just once per process
+ * rather than for every instance.  Each clocked instance refines its own
+ * copy as it runs anyway.
+ */
+static uint64_t busy_loop_1_MHZ;
+static pthread_once_t busy_loop_once = PTHREAD_ONCE_INIT;
+
+static void measure_busy_loop(void) {
+	busy_loop_1_MHZ = tny_calibrate_1_MHZ();
+
+	return;
+}
+
+bool tny_init_from_image(teenyat *t, tny_image *image,
+                         TNY_READ_FROM_BUS_FNPTR bus_read,
+                         TNY_WRITE_TO_BUS_FNPTR bus_write) {
+
+	if(!t) {
+		return false;
+	}
+	t->initialized = false;
+	if(!image) return false;
+
+	/* Clear the entire instance */
+	memset(t, 0, sizeof(teenyat));
+
+	t->image = tny_image_retain(image);
+	/* RAM starts out as the image itself */
+	for(int i = 0; i < TNY_RAM_PAGE_CNT; i++) {
+		t->ram[i] = &image->pages[i];
+	}
+
+	/* store bus callbacks */
+	t->bus_read = bus_read ? bus_read : default_bus_read;
+	t->bus_write = bus_write ? bus_write : default_bus_write;
+
+	t->clock_manager.calibrate_cycles = TNY_DEFAULT_CALIBRATE_CYCLES;
+	pthread_once(&busy_loop_once, measure_busy_loop);
+	t->clock_manager.busy_loop_cnt = busy_loop_1_MHZ;
+	t->clock_manager.target_mhz = 1;
+	t->clock_manager.pacing = TNY_PACING_BUSY;
+	t->clock_manager.quantum_us = TNY_DEFAULT_PACING_QUANTUM_US;
+
+	if(!tny_reset(t)) {
+		tny_image_release(t->image);
+		t->image = NULL;
+		return false;
+	}
+
+	t->initialized = true;
+
+	return true;
+}
+
+bool tny_init_clocked(teenyat *t, FILE *bin_file,
+                      TNY_READ_FROM_BUS_FNPTR bus_read,
+                      TNY_WRITE_TO_BUS_FNPTR bus_write,
+                      uint16_t MHz){
+
+	if(!t) return false;
+	/* Cannot have negative or zero target mhz */
+	if(MHz == 0 ) return false;
+
+	bool result = tny_init_from_file(t,bin_file,bus_read,bus_write);
+	t->clock_manager.target_mhz = MHz;
+
+	return result;
+}
+
+bool tny_init_unclocked(teenyat *t, FILE *bin_file,
+                        TNY_READ_FROM_BUS_FNPTR bus_read,
+                        TNY_WRITE_TO_BUS_FNPTR bus_write){
+
+	if(!t) return false;
+
+	bool result = tny_init_from_file(t,bin_file,bus_read,bus_write);
+	tny_set_calibration_window(t,-1);
+	
+	return result;
+}
+
+bool tny_set_calibration_window(teenyat *t,int16_t calibrate_cycles){
+	if(!t) return false;
+	t->clock_manager.calibrate_cycles = calibrate_cycles;
+	t->clock_manager.cycles_until_calibrate = calibrate_cycles;
+	return true;
+}
+
+bool tny_set_pacing(teenyat *t, uint8_t pacing, uint32_t quantum_us) {
+	if(!t) return false;
+	if(pacing != TNY_PACING_BUSY && pacing != TNY_PACING_HYBRID) return false;
+
+	t->clock_manager.pacing = pacing;
+	t->clock_manager.quantum_us = quantum_us ? quantum_us : TNY_DEFAULT_PACING_QUANTUM_US;
+
+	/* check the time at the very next cycle */
+	t->clock_manager.sync_cycle = t->cycle_cnt;
+
+	return true;
+}
+
+bool tny_set_decode_cache(teenyat *t, bool enable) {
+	if(!t) return false;
+
+	if(!enable) {
+		jit_destroy(t);
+		free(t->decode_cache);
+		t->decode_cache = NULL;
+		/* the other engines can't go without it */
+		t->engine = TNY_ENGINE_SWITCH;
+		return true;
+	}
+
+	if(!t->decode_cache) {
+		/* zeroed entries have a length of 0 and will be decoded on first use */
+		t->decode_cache = calloc(TNY_RAM_SIZE, sizeof(tny_decoded));
+		if(!t->decode_cache) return false;
+	}
+
+	return true;
+}
+
+bool tny_set_engine(teenyat *t, uint8_t engine) {
+	if(!t) return false;
+
+	switch(engine) {
+	case TNY_ENGINE_SWITCH:
+		break;
+	case TNY_ENGINE_THREADED:
+	case TNY_ENGINE_BLOCK:
+	case TNY_ENGINE_JIT:
+		/* all work from predecoded instructions */
+		if(!tny_set_decode_cache(t, true)) return false;
+		break;
+	default:
+		return false;
+	}
+
+	/* without a JIT for the host, or the memory for one, it's the block engine */
+	if(engine == TNY_ENGINE_JIT) {
+		jit_create(t);
+	}
+	else {
+		jit_destroy(t);
+	}
+
+	t->engine = engine;
+
+	return true;
+}
+
+void tny_flush_decode_cache(teenyat *t) {
+	if(!t || !t->decode_cache) return;
+
+	memset(t->decode_cache, 0, TNY_RAM_SIZE * sizeof(tny_decoded));
+	jit_forget_all(t);
+
+	return;
+}
+
+#ifdef TNY_PERF_COUNTERS
+
+static const char *const opcode_names[TNY_OPCODE_CNT] = {
+	[TNY_OPCODE_SET] = "SET",
+	[TNY_OPCODE_LOD] = "LOD",
+	[TNY_OPCODE_STR] = "STR",
+	[TNY_OPCODE_PSH] = "PSH",
+	[TNY_OPCODE_POP] = "POP",
+	[TNY_OPCODE_BTS] = "BTS",
+	[TNY_OPCODE_BTC] = "BTC",
+	[TNY_OPCODE_BTF] = "BTF",
+	[TNY_OPCODE_CAL] = "CAL",
+	[TNY_OPCODE_ADD] = "ADD",
+	[TNY_OPCODE_SUB] = "SUB",
+	[TNY_OPCODE_MPY] = "MPY",
+	[TNY_OPCODE_DIV] = "DIV",
+	[TNY_OPCODE_MOD] = "MOD",
+	[TNY_OPCODE_AND] = "AND",
+	[TNY_OPCODE_OR]  = "OR",
+	[TNY_OPCODE_XOR] = "XOR",
+	[TNY_OPCODE_SHF] = "SHF",
+	[TNY_OPCODE_ROT] = "ROT",
+	[TNY_OPCODE_NEG] = "NEG",
+	[TNY_OPCODE_CMP] = "CMP",
+	[TNY_OPCODE_JMP] = "JMP",
+	[TNY_OPCODE_LUP] = "LUP",
+	[TNY_OPCODE_DLY] = "DLY",
+	[TNY_OPCODE_INT] = "INT",
+	[TNY_OPCODE_RTI] = "RTI",
+};
+
+bool tny_set_perf_counters(teenyat *t, bool enable) {
+	if(!t) return false;
+
+	free(t->perf);
+	t->perf = NULL;
+	if(!enable) return true;
+
+	t->perf = calloc(1, sizeof(tny_perf));
+	if(!t->perf) return false;
+	perf_restart(t->perf, t->cycle_cnt);
+
+	return true;
+}
+
+bool tny_get_perf_counters(teenyat *t, tny_perf_counters *counters) {
+	if(!t || !t->perf || !counters) return false;
+
+	/* the instruction in progress has had every cycle so far */
+	perf_charge(t->perf, t->cycle_cnt);
+	*counters = t->perf->counters;
+
+	return true;
+}
+
+void tny_reset_perf_counters(teenyat *t) {
+	if(!t || !t->perf) return;
+
+	memset(&(t->perf->counters), 0, sizeof(tny_perf_counters));
+	t->perf->charged_cycle = t->cycle_cnt;
+
+	return;
+}
+
+bool tny_dump_perf_counters(teenyat *t, FILE *out, uint8_t format) {
+	tny_perf_counters c;
+	if(!out || !tny_get_perf_counters(t, &c)) return false;
+
+	const char *sep = "";
+	char unknown[8];
+
+	switch(format) {
+	case TNY_PERF_DUMP_TEXT:
+		fprintf(out, "%-8s %20s %20s\n", "opcode", "retired", "cycles");
+		for(int op = 0; op < TNY_OPCODE_CNT; op++) {
+			if(!c.retired[op] && !c.cycles[op]) continue;
+			snprintf(unknown, sizeof(unknown), "op%d", op);
+			fprintf(out, "%-8s %20" PRIu64 " %20" PRIu64 "\n",
+			        opcode_names[op] ? opcode_names[op] : unknown, c.retired[op], c.cycles[op]);
+		}
+		fprintf(out, "internal reads:  %" PRIu64 "\n", c.internal_reads);
+		fprintf(out, "internal writes: %" PRIu64 "\n", c.internal_writes);
+		fprintf(out, "external reads:  %" PRIu64 "\n", c.external_reads);
+		fprintf(out, "external writes: %" PRIu64 "\n", c.external_writes);
+		fprintf(out, "interrupts:      %" PRIu64 "\n", c.interrupts);
+		fprintf(out, "DLY cycles:      %" PRIu64 "\n", c.dly_cycles);
+		break;
+	case TNY_PERF_DUMP_JSON:
+		fprintf(out, "{\"opcodes\":{");
+		for(int op = 0; op < TNY_OPCODE_CNT; op++) {
+			if(!c.retired[op] && !c.cycles[op]) continue;
+			snprintf(unknown, sizeof(unknown), "op%d", op);
+			fprintf(out, "%s\"%s\":{\"retired\":%" PRIu64 ",\"cycles\":%" PRIu64 "}", sep,
+			        opcode_names[op] ? opcode_names[op] : unknown, c.retired[op], c.cycles[op]);
+			sep = ",";
+		}
+		fprintf(out, "},\"internal_reads\":%" PRIu64 ",\"internal_writes\":%" PRIu64
+		        ",\"external_reads\":%" PRIu64 ",\"external_writes\":%" PRIu64
+		        ",\"interrupts\":%" PRIu64 ",\"dly_cycles\":%" PRIu64 "}\n",
+		        c.internal_reads, c.internal_writes, c.external_reads, c.external_writes,
+		        c.interrupts, c.dly_cycles);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+#else
+
+bool tny_set_perf_counters(teenyat *t, bool enable) {
+	/* turning off what was never built in always works */
+	return t && !enable;
+}
+
+bool tny_get_perf_counters(teenyat *t, tny_perf_counters *counters) {
+	(void)t;
+	(void)counters;
+
+	return false;
+}
+
+void tny_reset_perf_counters(teenyat *t) {
+	(void)t;
+
+	return;
+}
+
+bool tny_dump_perf_counters(teenyat *t, FILE *out, uint8_t format) {
+	(void)t;
+	(void)out;
+	(void)format;
+
+	return false;
+}
+
+#endif /* TNY_PERF_COUNTERS */
+
+bool tny_set_profiler(teenyat *t, uint32_t period) {
+	if(!t) return false;
+
+	free(t->profile);
+	t->profile = NULL;
+	if(period == 0) return true;
+
+	t->profile = calloc(1, sizeof(tny_profile));
+	if(!t->profile) return false;
+	t->profile->period = period;
+	t->profile->next_sample = t->cycle_cnt + period;
+
+	return true;
+}
+
+bool tny_get_profile(teenyat *t, uint64_t *samples) {
+	if(!t || !t->profile || !samples) return false;
+
+	memcpy(samples, t->profile->samples, sizeof(t->profile->samples));
+
+	return true;
+}
+
+void tny_reset_profile(teenyat *t) {
+	if(!t || !t->profile) return;
+
+	memset(t->profile->samples, 0, sizeof(t->profile->samples));
+	t->profile->sample_cnt = 0;
+
+	return;
+}
+
+bool tny_set_trace(teenyat *t, size_t capacity) {
+	if(!t) return false;
+
+	free(t->trace);
+	t->trace = NULL;
+	if(capacity == 0) return true;
+
+	size_t size = 1;
+	while(size < capacity) size *= 2;
+
+	t->trace = calloc(1, sizeof(tny_trace) + size * sizeof(tny_trace_record));
+	if(!t->trace) return false;
+	t->trace->mask = size - 1;
+
+	return true;
+}
+
+/* The number of records held, which are the last that many made */
+static uint64_t trace_held(const tny_trace *tr) {
+	return (tr->recorded <= tr->mask) ? tr->recorded : tr->mask + 1;
+}
+
+size_t tny_get_trace(teenyat *t, tny_trace_record *records, size_t max) {
+	if(!t || !t->trace || !records) return 0;
+
+	tny_trace *tr = t->trace;
+	trace_settle(t);
+
+	uint64_t cnt = trace_held(tr);
+	if(cnt > max) {
+		cnt = max;
+	}
+	for(uint64_t i = tr->recorded - cnt; i < tr->recorded; i++) {
+		*records++ = tr->records[i & tr->mask];
+	}
+
+	return (size_t)cnt;
+}
+
+static void trace_put_u16(FILE *out, uint16_t v) {
+	fputc(v & 0xFF, out);
+	fputc(v >> 8, out);
+
+	return;
+}
+
+static void trace_put_u64(FILE *out, uint64_t v) {
+	for(int i = 0; i < 4; i++) {
+		trace_put_u16(out, (uint16_t)(v >> (16 * i)));
+	}
+
+	return;
+}
+
+bool tny_dump_trace(teenyat *t, FILE *out) {
+	if(!t || !t->trace || !out) return false;
+
+	tny_trace *tr = t->trace;
+	trace_settle(t);
+
+	uint64_t cnt = trace_held(tr);
+	fwrite(TNY_TRACE_MAGIC, 1, 4, out);
+	trace_put_u16(out, TNY_TRACE_VERSION);
+	trace_put_u16(out, TNY_TRACE_RECORD_SIZE);
+	trace_put_u64(out, tr->recorded);
+	trace_put_u64(out, cnt);
+	for(uint64_t i = tr->recorded - cnt; i < tr->recorded; i++) {
+		const tny_trace_record *r = &tr->records[i & tr->mask];
+		trace_put_u16(out, r->pc);
+		trace_put_u16(out, r->instruction);
+		trace_put_u16(out, r->immediate);
+		trace_put_u16(out, r->reg_value);
+		trace_put_u16(out, r->bus_address);
+		trace_put_u16(out, r->bus_data);
+		fputc(r->reg, out);
+		fputc(r->flags, out);
+	}
+
+	return !ferror(out);
+}
+
+bool tny_dump_profile(teenyat *t, FILE *out) {
+	if(!t || !t->profile || !out) return false;
+
+	const tny_profile *p = t->profile;
+	fprintf(out, "# period %" PRIu32 " cycles, %" PRIu64 " samples\n", p->period, p->sample_cnt);
+	for(uint32_t addr = 0; addr < TNY_RAM_SIZE; addr++) {
+		if(p->samples[addr]) {
+			fprintf(out, "0x%04" PRIX32 " %" PRIu64 "\n", addr, p->samples[addr]);
+		}
+	}
+
+	return true;
+}
+
+bool tny_set_spin_skip(teenyat *t, bool enable) {
+	if(!t) return false;
+
+	free(t->spin);
+	t->spin = NULL;
+	if(!enable) return true;
+
+	t->spin = calloc(1, sizeof(tny_spin));
+
+	return t->spin != NULL;
+}
+
+bool tny_get_spin_stats(teenyat *t, tny_spin_stats *stats) {
+	if(!t || !t->spin || !stats) return false;
+
+	*stats = t->spin->stats;
+
+	return true;
+}
+
+/*
+ * Throw out any decoded instructions that may have come from the given RAM
+ * pages, after they were changed wholesale.
+ */
+static void forget_decoded_pages(teenyat *t, uint32_t pages) {
+	if(!t->decode_cache) return;
+
+	tny_decoded *cache = t->decode_cache;
+	while(pages) {
+		tny_uword start = (tny_uword)__builtin_ctz(pages) * TNY_RAM_PAGE_SIZE;
+		pages &= pages - 1;
+
+		memset(&cache[start], 0, TNY_RAM_PAGE_SIZE * sizeof(tny_decoded));
+
+		/*
+		 * Just like a single write, the page may hold the immediate of
+		 * the instruction before it or the tail of a block.
+		 */
+		cache[(start - 1) & TNY_MAX_RAM_ADDRESS].length = 0;
+		for(int i = 1; i <= TNY_BLOCK_MAX_SPAN; i++) {
+			cache[(start - i) & TNY_MAX_RAM_ADDRESS].block_len = TNY_BLOCK_UNKNOWN;
+		}
+		jit_forget(t, start, TNY_RAM_PAGE_SIZE);
+	}
+
+	return;
+}
+
+/*
+ * Put back the image's own pages in place of any written since the last reset
+ */
+static void restore_dirty_pages(teenyat *t) {
+	uint32_t dirty = t->dirty_pages;
+
+	while(dirty) {
+		uint32_t page = __builtin_ctz(dirty);
+		dirty &= dirty - 1;
+
+		release_page(t->ram[page]);
+		t->ram[page] = &t->image->pages[page];
+	}
+
+	forget_decoded_pages(t, t->dirty_pages);
+	t->dirty_pages = 0;
+	t->private_pages = 0;
+
+	return;
+}
+
+void tny_destroy(teenyat *t) {
+	if(!t) return;
+
+	if(t->image) {
+		restore_dirty_pages(t);
+	}
+	tny_set_decode_cache(t, false);
+	tny_set_perf_counters(t, false);
+	tny_set_profiler(t, 0);
+	tny_set_trace(t, 0);
+	tny_set_spin_skip(t, false);
+	events_free(t);
+	waiter_destroy(t);
+	free(t->peripherals);
+	t->peripherals = NULL;
+	tny_image_release(t->image);
+	t->image = NULL;
+	t->initialized = false;
+
+	return;
+}
+
+/*
+ * Everything posted from other threads shares the one mailbox word, so it is
+ * all taken at once by a single atomic operation.  Each port's latest level
+ * sits in its own 16 bits with a flag saying it was posted, and external
+ * interrupts are kept just as they go in the IQR.  The instance itself keeps
+ * the attention bit set whenever its CSR, IER and IQR give
+ * handle_interrupts() something to do, so the word is zero, and the check
+ * before each instruction falls straight through, nearly all of the time.
+ */
+#define TNY_MAILBOX_PORT_A_SHIFT    0
+#define TNY_MAILBOX_PORT_B_SHIFT    16
+#define TNY_MAILBOX_INTERRUPT_SHIFT 32
+#define TNY_MAILBOX_PORT_A_POSTED   ((uint64_t)1 << 48)
+#define TNY_MAILBOX_PORT_B_POSTED   ((uint64_t)1 << 49)
+#define TNY_MAILBOX_ATTENTION       ((uint64_t)1 << 63)
+
+/*
+ * Bring the attention bit up to date.  Anything changing the CSR, IER or
+ * IQR must call this afterward.
+ */
+static inline void update_interrupt_attention(teenyat *t) {
+	tny_uword IER = t->interrupt_enable_register.u;
+	tny_uword IQR = t->interrupt_queue_register.u;
+	bool ready = (t->control_status_register.csr.interrupt_enable && (IQR & IER)) ||
+	             (t->control_status_register.csr.interrupt_clearing && (IQR & ~IER));
+
+	/* other threads may be posting, but only this one touches the bit */
+	bool set = __atomic_load_n(&t->mailbox, __ATOMIC_RELAXED) & TNY_MAILBOX_ATTENTION;
+	if(ready && !set) {
+		__atomic_fetch_or(&t->mailbox, TNY_MAILBOX_ATTENTION, __ATOMIC_RELAXED);
+	}
+	else if(!ready && set) {
+		__atomic_fetch_and(&t->mailbox, ~TNY_MAILBOX_ATTENTION, __ATOMIC_RELAXED);
+	}
+
+	return;
+}
+
+/*
+ * Waiting for an interrupt is a delay with no end of its own, long enough
+ * that no run gets to the end of it.  Every run loop already lets delay
+ * cycles go by in bulk, so they need only look for the wait ending.  The
+ * wait goes on top of what's left of the store that started it, and only
+ * the wait is cut short when it ends, so the store costs what any other
+ * store would.
+ */
+#define TNY_WAIT_CYCLES ((uint64_t)1 << 62)
+
+static inline bool waiting(const teenyat *t) {
+	return t->control_status_register.csr.wait_for_interrupt;
+}
+
+/* Whether an interrupt enabled in the IER is queued or has been posted */
+static inline bool wait_over(const teenyat *t) {
+	uint64_t posted = __atomic_load_n(&t->mailbox, __ATOMIC_SEQ_CST) >> TNY_MAILBOX_INTERRUPT_SHIFT;
+	tny_uword queued = t->interrupt_queue_register.u | (tny_uword)posted;
+
+	return (queued & t->interrupt_enable_register.u) != 0;
+}
+
+/* The CSR was just stored, perhaps asking to wait */
+static inline void start_wait(teenyat *t) {
+	if(!waiting(t)) return;
+
+	if(wait_over(t)) {
+		t->control_status_register.csr.wait_for_interrupt = 0;
+	}
+	else {
+		t->delay_cycles += TNY_WAIT_CYCLES;
+	}
+
+	return;
+}
+
+/* Whatever is left of the store still goes by before the next instruction */
+static inline void end_wait(teenyat *t) {
+	t->control_status_register.csr.wait_for_interrupt = 0;
+	t->delay_cycles = (t->delay_cycles > TNY_WAIT_CYCLES) ? t->delay_cycles - TNY_WAIT_CYCLES : 0;
+
+	return;
+}
+
+static void wake_waiter(teenyat *t) {
+	tny_waiter *w = __atomic_load_n(&t->waiter, __ATOMIC_ACQUIRE);
+	if(!w || !__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) return;
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+
+	return;
+}
+
+static bool reset_instance(teenyat *t, uint64_t seed, uint64_t increment) {
+	if(!t || !t->image) return false;
+
+	/* the trace carries on through the reset, too */
+	if(t->trace) {
+		trace_settle(t);
+	}
+
+#ifdef TNY_PERF_COUNTERS
+	/* counts carry on through the reset, though the cycle count doesn't */
+	if(t->perf) {
+		perf_charge(t->perf, t->cycle_cnt);
+		perf_restart(t->perf, 0);
+	}
+#endif
+
+	/* restore ram to it's initial post-bin-load state */
+	restore_dirty_pages(t);
+
+	t->reg[TNY_REG_PC].u = 0x0;
+	t->reg[TNY_REG_SP].u = 0x7FFF;
+	t->reg[TNY_REG_ZERO].u = 0;
+	t->reg[TNY_REG_A].u = 0;
+	t->reg[TNY_REG_B].u = 0;
+	t->reg[TNY_REG_C].u = 0;
+	t->reg[TNY_REG_D].u = 0;
+	t->reg[TNY_REG_E].u = 0;
+
+	t->flags.carry   = false;
+	t->flags.equals  = false;
+	t->flags.less    = false;
+	t->flags.greater = false;
+
+	/* "instruction" and "immediate" members do not need initialization */
+
+	/* Initialize ports to output w/ all 0s */
+	t->port_a.u = 0;
+	t->port_a_directions.u = 0;
+	t->port_b.u = 0;
+	t->port_b_directions.u = 0;
+
+	t->port_change = NULL;
+
+	/* Disable all architectural features */
+	t->control_status_register.csr.interrupt_enable = 0;
+	t->control_status_register.csr.interrupt_clearing = 0;
+	t->control_status_register.csr.wait_for_interrupt = 0;
+	t->control_status_register.csr.reserved = 0;
+
+	/* Clear & disable all interrupts by default */
+	t->interrupt_enable_register.u = 0;
+	t->interrupt_queue_register.u  = 0;
+	t->interrupt_return_address.u  = 0;
+	t->interrupt_return_flags.carry   = false;
+	t->interrupt_return_flags.equals  = false;
+	t->interrupt_return_flags.less    = false;
+	t->interrupt_return_flags.greater = false;
+	/* anything posted before the reset goes with it */
+	__atomic_store_n(&t->mailbox, 0, __ATOMIC_RELAXED);
+	/* Maybe dont memset? could simulate randomness... */
+	memset(t->interrupt_vector_table, 0, sizeof(t->interrupt_vector_table));
+
+	t->random.increment = increment;
+
+	/*
+	 * Set initial state and "put it in the past"
+	 */
+	t->random.state = seed + t->random.increment;
+	(void)tny_random(t);
+
+	/* Set up our initial calibrated cycles */
+	t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
+
+	t->delay_cycles = 0;
+	t->instruction_address = 0;
+	/* pending events stay just as far off as they were */
+	if(t->events) {
+		tny_event_queue *q = t->events;
+		for(size_t i = 0; i < q->cnt; i++) {
+			q->heap[i].cycle = (q->heap[i].cycle > t->cycle_cnt) ? q->heap[i].cycle - t->cycle_cnt : 0;
+		}
+		event_heapify(q);
+	}
+	t->cycle_cnt = 0;
+	/* samples carry on through the reset, though the cycle count doesn't */
+	if(t->profile) {
+		t->profile->next_sample = t->profile->period;
+	}
+	spin_forget(t);
+
+	return true;
+}
+
+/*
+ * Entropy for seeding random number generators, gathered just once per
+ * process rather than on every reset
+ */
+static uint64_t entropy_pool;
+static pthread_once_t entropy_once = PTHREAD_ONCE_INIT;
+
+static void fill_entropy_pool(void) {
+	uint64_t seed = (uint64_t)(uintptr_t)&time << 32;
+	seed ^= (uint64_t)(uintptr_t)&printf;
+	seed ^= (uint64_t)time(NULL);
+	seed ^= us_clock();
+	/* make seed "more" random w/ /dev/urandom if there */
+	FILE *f = fopen("/dev/urandom", "rb");
+	if(f != NULL) {
+		uint64_t entropy_bits;
+		if(fread(&entropy_bits, sizeof(entropy_bits), 1, f) == 1) {
+			seed ^= entropy_bits;
+		}
+		fclose(f);
+	}
+
+	entropy_pool = seed;
+
+	return;
+}
+
+/* The SplitMix64 finalizer, so nearby inputs give unrelated outputs */
+static inline uint64_t mix64(uint64_t x) {
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+bool tny_reset(teenyat *t) {
+	/*
+	 * Initialize each teenyat with a unique random number stream
+	 */
+	static uint64_t stream = 1;  // start at >=1 for increment constant to be unique
+	/* atomic, so instances can be reset on any number of threads at once */
+	uint64_t my_stream = __atomic_fetch_add(&stream, 1, __ATOMIC_RELAXED);
+
+	pthread_once(&entropy_once, fill_entropy_pool);
+
+	/* Set increment to arbitrary odd constant that goes up by stream */
+	uint64_t increment = ((uintptr_t)&tny_reset + my_stream) | 1ULL;
+
+	return reset_instance(t, mix64(entropy_pool + my_stream), increment);
+}
+
+bool tny_reset_with_seed(teenyat *t, uint64_t seed) {
+	/* the seed picks the stream as well, so the same seed always repeats */
+	return reset_instance(t, seed, mix64(seed) | 1ULL);
+}
+
+void tny_modify_port_levels(teenyat *t, bool is_system_request, tny_word data, bool is_port_a) {
+	tny_word *port = (is_port_a ? &(t->port_a) : &(t->port_b));
+	tny_word dir = (is_port_a ? t->port_a_directions : t->port_b_directions);
+
+	/* 
+	 * For the masking below, we need a bit pattern of all 1s or 0s depending
+	 * on whether this is a system request (1s) or not (0s).
+	 */
+	tny_word src;
+	src.u = ~0 * is_system_request;
+
+	/*
+	 * We must know for which bits the source of the request and direction
+	 * bits match.  Eg, if the system wants to modify the port levels,
+	 * it can only do that for port bits with their direction set for input.
+	 */
+	tny_word src_dir_matches;
+	src_dir_matches.u = src.u ^ dir.u;
+
+	/* Save a copy of the port bits to determine whether any change */
+	tny_word old_port = *port;
+
+	/* Modify only those bits which should change */
+	port->u = (port->u & src_dir_matches.u) + (data.u & ~src_dir_matches.u);
+	if(port->u != old_port.u) {
+		spin_disturb(t);
+	}
+
+	/* Launch the port change callback if any port bits were modify */
+	if((t->port_change != NULL) && (~src.u & ~dir.u & (old_port.u ^ port->u))) {
+		t->port_change(t, is_port_a, *port);
+	}
+
+	return;
+}
+
+void tny_port_change(teenyat *t, TNY_PORT_CHANGE_FNPTR port_change) {
+	t->port_change = port_change;
+
+	return;
+}
+
+/*
+ * Add a peripheral to the instance's map and work out the pages its range
+ * touches all over again
+ */
+static bool add_peripheral(teenyat *t, const tny_peripheral *peripheral) {
+	if(peripheral->first < TNY_PERIPHERAL_BASE_ADDRESS) return false;
+	if(peripheral->first > peripheral->last) return false;
+
+	if(!t->peripherals) {
+		/* zeroed pages all belong to the bus callbacks */
+		t->peripherals = calloc(1, sizeof(tny_peripheral_map));
+		if(!t->peripherals) return false;
+	}
+
+	tny_peripheral_map *map = t->peripherals;
+	if(map->cnt == TNY_PERIPHERAL_MAX) return false;
+
+	map->list[map->cnt++] = *peripheral;
+
+	unsigned first_page = (peripheral->first - TNY_PERIPHERAL_BASE_ADDRESS) / TNY_PERIPHERAL_PAGE_SIZE;
+	unsigned last_page = (peripheral->last - TNY_PERIPHERAL_BASE_ADDRESS) / TNY_PERIPHERAL_PAGE_SIZE;
+	for(unsigned page = first_page; page <= last_page; page++) {
+		uint32_t start = TNY_PERIPHERAL_BASE_ADDRESS + page * TNY_PERIPHERAL_PAGE_SIZE;
+		const tny_peripheral *p = find_peripheral(map, start);
+
+		uint8_t entry = p ? (uint8_t)(p - map->list + 1) : TNY_PERIPHERAL_NONE;
+		for(uint32_t addr = start + 1; addr < start + TNY_PERIPHERAL_PAGE_SIZE; addr++) {
+			if(find_peripheral(map, addr) != p) {
+				entry = TNY_PERIPHERAL_MIXED;
+				break;
+			}
+		}
+		map->page[page] = entry;
+	}
+
+	return true;
+}
+
+bool tny_register_peripheral(teenyat *t, tny_uword first, tny_uword last,
+                             TNY_PERIPHERAL_READ_FNPTR read,
+                             TNY_PERIPHERAL_WRITE_FNPTR write,
+                             void *ctx) {
+	if(!t) return false;
+
+	tny_peripheral p = { .first = first, .last = last, .read = read, .write = write, .ctx = ctx };
+
+	return add_peripheral(t, &p);
+}
+
+bool tny_map_window(teenyat *t, tny_uword first, tny_uword last, tny_word *buffer,
+                    uint64_t *dirty, TNY_WINDOW_WRITTEN_FNPTR written, void *ctx) {
+	if(!t || !buffer) return false;
+
+	tny_peripheral p = {
+		.first = first,
+		.last = last,
+		.ctx = ctx,
+		.window = buffer,
+		.dirty = dirty,
+		.written = written
+	};
+
+	return add_peripheral(t, &p);
+}
+
+bool tny_schedule_event(teenyat *t, uint64_t cycle, TNY_EVENT_FNPTR event, void *ctx) {
+	if(!t || !event) return false;
+
+	if(!t->events) {
+		t->events = calloc(1, sizeof(tny_event_queue));
+		if(!t->events) return false;
+	}
+
+	tny_event_queue *q = t->events;
+	if(q->cnt == q->capacity) {
+		size_t capacity = q->capacity ? q->capacity * 2 : 16;
+		tny_event *heap = realloc(q->heap, capacity * sizeof(tny_event));
+		if(!heap) return false;
+		q->heap = heap;
+		q->capacity = capacity;
+	}
+
+	q->heap[q->cnt] = (tny_event){ .cycle = cycle, .seq = q->next_seq++, .fn = event, .ctx = ctx };
+	event_sift_up(q, q->cnt++);
+
+	/*
+	 * Scheduled from a callback, a run under way stops for it, and no idle
+	 * loop skip may go past it.  One already due is made after this cycle.
+	 */
+	uint64_t due = (cycle > t->cycle_cnt) ? cycle : t->cycle_cnt;
+	if(due < t->run_end) {
+		t->run_end = due;
+	}
+	if(t->spin && due < t->spin->run_end) {
+		spin_run_end(t, due);
+	}
+
+	return true;
+}
+
+size_t tny_cancel_events(teenyat *t, TNY_EVENT_FNPTR event, void *ctx) {
+	if(!t || !t->events) return 0;
+
+	tny_event_queue *q = t->events;
+	size_t kept = 0;
+	for(size_t i = 0; i < q->cnt; i++) {
+		if(q->heap[i].fn != event || q->heap[i].ctx != ctx) {
+			q->heap[kept++] = q->heap[i];
+		}
+	}
+
+	size_t cancelled = q->cnt - kept;
+	q->cnt = kept;
+	event_heapify(q);
+
+	return cancelled;
+}
+
+uint64_t tny_next_event(const teenyat *t) {
+	if(!t) return UINT64_MAX;
+
+	return next_event_cycle(t);
+}
+
+static void *write_queue_worker(void *arg) {
+	tny_write_queue *q = arg;
+	size_t head = q->head;
+
+	for(;;) {
+		size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if(tail == head) {
+			/* anything queued before stopping is still applied */
+			if(__atomic_load_n(&q->stopping, __ATOMIC_ACQUIRE)) break;
+
+			pthread_mutex_lock(&q->lock);
+			__atomic_store_n(&q->worker_sleeping, true, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == head &&
+			      !__atomic_load_n(&q->stopping, __ATOMIC_ACQUIRE)) {
+				pthread_cond_wait(&q->filled, &q->lock);
+			}
+			__atomic_store_n(&q->worker_sleeping, false, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&q->lock);
+			continue;
+		}
+
+		while(head != tail) {
+			tny_queued_write w = q->ring[head & q->mask];
+			q->write(q->ctx, w.addr, w.data, w.cycle);
+			head++;
+			/* hand the slot back, and the producer may be waiting on it */
+			__atomic_store_n(&q->head, head, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&q->producer_waiting, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&q->lock);
+				pthread_cond_broadcast(&q->drained);
+				pthread_mutex_unlock(&q->lock);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+tny_write_queue *tny_write_queue_create(size_t capacity, TNY_QUEUED_WRITE_FNPTR write, void *ctx) {
+	if(!write || capacity == 0) return NULL;
+
+	size_t size = 1;
+	while(size < capacity) size *= 2;
+
+	tny_write_queue *q = calloc(1, sizeof(tny_write_queue));
+	if(!q) return NULL;
+
+	q->ring = malloc(size * sizeof(tny_queued_write));
+	if(!q->ring) {
+		free(q);
+		return NULL;
+	}
+	q->mask = size - 1;
+	q->write = write;
+	q->ctx = ctx;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->drained, NULL);
+	pthread_cond_init(&q->filled, NULL);
+	if(pthread_create(&q->worker, NULL, write_queue_worker, q) != 0) {
+		pthread_cond_destroy(&q->filled);
+		pthread_cond_destroy(&q->drained);
+		pthread_mutex_destroy(&q->lock);
+		free(q->ring);
+		free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+void tny_write_queue_destroy(tny_write_queue *q) {
+	if(!q) return;
+
+	pthread_mutex_lock(&q->lock);
+	__atomic_store_n(&q->stopping, true, __ATOMIC_RELEASE);
+	pthread_cond_signal(&q->filled);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->worker, NULL);
+
+	pthread_cond_destroy(&q->filled);
+	pthread_cond_destroy(&q->drained);
+	pthread_mutex_destroy(&q->lock);
+	free(q->ring);
+	free(q);
+
+	return;
+}
+
+void tny_write_queue_flush(tny_write_queue *q) {
+	if(!q) return;
+
+	if(!write_queue_empty(q)) {
+		write_queue_wait(q, q->tail);
+	}
+
+	return;
+}
+
+bool tny_register_queued_peripheral(teenyat *t, tny_uword first, tny_uword last,
+                                    TNY_PERIPHERAL_READ_FNPTR read,
+                                    tny_write_queue *queue,
+                                    void *ctx) {
+	if(!t || !queue) return false;
+
+	tny_peripheral p = { .first = first, .last = last, .read = read, .queue = queue, .ctx = ctx };
+
+	return add_peripheral(t, &p);
+}
+
+tny_word tny_get_ram(const teenyat *t, tny_uword addr) {
+	return ram_read(t, addr & TNY_MAX_RAM_ADDRESS);
+}
+
+void tny_set_ram(teenyat *t, tny_uword addr, tny_word data) {
+	ram_write(t, addr & TNY_MAX_RAM_ADDRESS, data);
+
+	return;
+}
+
+void tny_get_ports(teenyat *t, tny_word *a, tny_word *b) {
+	if(a != NULL) {
+		*a = t->port_a;
+	}
+
+	if(b != NULL) {
+		*b = t->port_b;
+	}
+
+	return;
+}
+
+void tny_set_ports(teenyat *t, tny_word *a, tny_word *b) {
+	if(a != NULL) {
+		tny_modify_port_levels(t, true, *a, true);
+	}
+
+	if(b != NULL) {
+		tny_modify_port_levels(t, true, *b, false);
+	}
+
+	return;
+}
+
+void tny_external_interrupt(teenyat* t, tny_uword external_interrupt) {
+	/*
+	 * Make a mask with a 1 in the position of the external interrupt number
+	 * offset so external interrupt 0..7 is mapped to bits 8..15 as the
+	 * external eight interrupts are mapped to the interrupt vector table
+	 * as ints 8..15.
+	 * 
+	 * external_interrupt > 7 are wrapped
+	 */
+	tny_uword iqr_mask = 1U << ((external_interrupt % 8) + 8);
+	/* mask in the interrupt into the upper half of our iqr */
+	t->interrupt_queue_register.u |= iqr_mask;
+	update_interrupt_attention(t);
+	if(waiting(t) && wait_over(t)) {
+		end_wait(t);
+	}
+	spin_disturb(t);
+
+	return;
+}
+
+void tny_post_ports(teenyat *t, tny_word *a, tny_word *b) {
+	uint64_t keep = ~(uint64_t)0;
+	uint64_t post = 0;
+
+	if(a != NULL) {
+		keep &= ~(((uint64_t)0xFFFF << TNY_MAILBOX_PORT_A_SHIFT) | TNY_MAILBOX_PORT_A_POSTED);
+		post |= ((uint64_t)a->u << TNY_MAILBOX_PORT_A_SHIFT) | TNY_MAILBOX_PORT_A_POSTED;
+	}
+
+	if(b != NULL) {
+		keep &= ~(((uint64_t)0xFFFF << TNY_MAILBOX_PORT_B_SHIFT) | TNY_MAILBOX_PORT_B_POSTED);
+		post |= ((uint64_t)b->u << TNY_MAILBOX_PORT_B_SHIFT) | TNY_MAILBOX_PORT_B_POSTED;
+	}
+
+	uint64_t mail = __atomic_load_n(&t->mailbox, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&t->mailbox, &mail, (mail & keep) | post, true,
+	                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return;
+}
+
+void tny_post_external_interrupt(teenyat *t, tny_uword external_interrupt) {
+	/* the same mask tny_external_interrupt() puts in the IQR */
+	uint64_t iqr_mask = 1U << ((external_interrupt % 8) + 8);
+	__atomic_fetch_or(&t->mailbox, iqr_mask << TNY_MAILBOX_INTERRUPT_SHIFT, __ATOMIC_SEQ_CST);
+	wake_waiter(t);
+
+	return;
+}
+
+/* Take up everything posted to the mailbox, ports first */
+static void take_mailbox(teenyat *t) {
+	uint64_t mail = __atomic_fetch_and(&t->mailbox, TNY_MAILBOX_ATTENTION, __ATOMIC_ACQUIRE);
+
+	if(mail & TNY_MAILBOX_PORT_A_POSTED) {
+		tny_word a = { .u = (tny_uword)(mail >> TNY_MAILBOX_PORT_A_SHIFT) };
+		tny_modify_port_levels(t, true, a, true);
+	}
+
+	if(mail & TNY_MAILBOX_PORT_B_POSTED) {
+		tny_word b = { .u = (tny_uword)(mail >> TNY_MAILBOX_PORT_B_SHIFT) };
+		tny_modify_port_levels(t, true, b, false);
+	}
+
+	t->interrupt_queue_register.u |= (tny_uword)(mail >> TNY_MAILBOX_INTERRUPT_SHIFT);
+
+	return;
+}
+
+/* Assumes that bits is non-zero */
+tny_uword tny_get_interrupt_index(tny_uword bits) {
+	tny_uword n = 0;
+	if (!(bits & 0x000000FF)) { n +=  8; bits >>=  8; }
+	if (!(bits & 0x0000000F)) { n +=  4; bits >>=  4; }
+	if (!(bits & 0x00000003)) { n +=  2; bits >>=  2; }
+	if (!(bits & 0x00000001))   n +=  1;
+
+	return n;
+}
+
+static void deliver_interrupts(teenyat *t) {
+	spin_disturb(t);
+
+	if(__atomic_load_n(&t->mailbox, __ATOMIC_RELAXED) & ~TNY_MAILBOX_ATTENTION) {
+		take_mailbox(t);
+	}
+
+	bool      IE  = t->control_status_register.csr.interrupt_enable;
 	bool      IC  = t->control_status_register.csr.interrupt_clearing;
 	tny_uword IER = t->interrupt_enable_register.u;
 	tny_uword IQR = t->interrupt_queue_register.u & IER;  //mask our queue register with enabled interrupts
@@ -356,538 +2399,3344 @@ void handle_interrupts(teenyat *t) {
 		t->reg[TNY_REG_PC].u = t->interrupt_vector_table[ivt_index].u;
 		t->control_status_register.csr.interrupt_enable = 0;  // disable interrupts
 		t->interrupt_queue_register.u  &= ~INT;  // clear the request
+		perf_interrupt(t);
+		trace_interrupt(t);
+	}
+
+	/* clear interrupts if interrupt clearing is enabled */
+	if(IC) {
+		t->interrupt_queue_register.u &= IER;
+	}
+
+	update_interrupt_attention(t);
+
+	return;
+}
+
+void handle_interrupts(teenyat *t) {
+	/* nothing posted and nothing ready is nearly always the case */
+	if(__builtin_expect(__atomic_load_n(&t->mailbox, __ATOMIC_RELAXED) != 0, 0)) {
+		deliver_interrupts(t);
+	}
+
+	return;
+}
+
+static void start_clock(teenyat *t) {
+	t->clock_manager.epoch = us_clock();
+	t->clock_manager.last_calibration_time = t->clock_manager.epoch;
+	t->clock_manager.sync_cycle = 0;
+
+	return;
+}
+
+/*
+ * Have a clocked instance carry on pacing from right now, wherever its
+ * cycle_cnt may be
+ */
+static void resume_clock(teenyat *t) {
+	uint64_t now = us_clock();
+	t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
+	t->clock_manager.epoch = now - t->cycle_cnt / t->clock_manager.target_mhz;
+	t->clock_manager.last_calibration_time = now;
+	t->clock_manager.sync_cycle = t->cycle_cnt;
+
+	return;
+}
+
+/*
+ * Hybrid pacing lets cycles run unhindered until a quantum's worth of them
+ * have gone by, then sleeps until the wall clock catches up.  Falling behind
+ * simply means there is nothing to sleep off.
+ */
+static void pace_hybrid(teenyat *t) {
+	if(t->cycle_cnt < t->clock_manager.sync_cycle) return;
+
+	uint64_t mhz = t->clock_manager.target_mhz;
+	uint64_t deadline = t->clock_manager.epoch + t->cycle_cnt / mhz;
+
+	if(deadline > us_clock() + TNY_PACING_SPIN_US) {
+		sleep_until_us(deadline - TNY_PACING_SPIN_US);
+	}
+	while(us_clock() < deadline);
+
+	t->clock_manager.sync_cycle = t->cycle_cnt + t->clock_manager.quantum_us * mhz;
+
+	return;
+}
+
+/*
+ * Pace a clocked instance for the given number of cycles, which have already
+ * been accounted for in cycle_cnt.  Recalibration still happens exactly once
+ * per calibration window, no matter how many cycles are paced at once.
+ */
+static void pace_cycles(teenyat *t, uint64_t cycles) {
+	/* Jump out if unclocked instance of the TeenyAT */
+	if(t->clock_manager.cycles_until_calibrate < 0) return;
+
+	if(t->clock_manager.pacing == TNY_PACING_HYBRID) {
+		pace_hybrid(t);
+		return;
+	}
+
+	while(cycles > 0) {
+		uint64_t n = (uint64_t)t->clock_manager.cycles_until_calibrate;
+		if(n == 0 || n > cycles) {
+			n = cycles;
+		}
+		cycles -= n;
+
+		/*
+		 * Busy wait to fix the cycle rate, before any recalibration, so the
+		 * time it measures is that of the window just paced
+		 */
+		uint64_t busy_loop_cnt = n * t->clock_manager.busy_loop_cnt;
+		for(volatile uint64_t i = 0; i < busy_loop_cnt; i++);
+
+		t->clock_manager.cycles_until_calibrate -= n;
+
+		if(t->clock_manager.cycles_until_calibrate == 0) {
+			/* Time to recalibrate our busy loop count */
+			uint64_t cycle_cnt = t->cycle_cnt - cycles;  // cycle at the window's end
+			uint64_t now_us = us_clock();
+			uint64_t us_elapsed = now_us - t->clock_manager.last_calibration_time;
+			/* a window paced in one go can pass in under a microsecond */
+			if(us_elapsed == 0) {
+				us_elapsed = 1;
+			}
+			uint64_t mhz_loop_count = t->clock_manager.busy_loop_cnt * t->clock_manager.calibrate_cycles / t->clock_manager.target_mhz;
+			t->clock_manager.busy_loop_cnt = mhz_loop_count / us_elapsed;
+
+			uint64_t time_since_epoch_us = now_us - t->clock_manager.epoch;
+			if(time_since_epoch_us > cycle_cnt) {
+				/* too slow, speed up by busy looping 5% less */
+				t->clock_manager.busy_loop_cnt = (t->clock_manager.busy_loop_cnt * 95) / 100;
+			}
+			else if(time_since_epoch_us < cycle_cnt) {
+				/* too fast, slow down by busy looping 5% more*/
+				/* NOTE: 1+ ensures even tiny busy_loop_count will at least go up by 1 */
+				t->clock_manager.busy_loop_cnt = 1 + (t->clock_manager.busy_loop_cnt * 105) / 100;
+			}
+
+			t->clock_manager.last_calibration_time = now_us;
+			t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
+		}
+	}
+
+	return;
+}
+
+/* Block until a us_clock() time, or until an interrupt is posted */
+static void block_until_us(teenyat *t, uint64_t deadline) {
+	if(!t->waiter && !waiter_create(t)) {
+		/* posted interrupts are only seen at the deadline, then */
+		sleep_until_us(deadline);
+		return;
+	}
+
+	struct timespec ts;
+#if defined(__APPLE__) || defined(_WIN64) || defined(_WIN32)
+	/* these time out by the realtime clock, so go by what's left instead */
+	uint64_t now = us_clock();
+	uint64_t left = (deadline > now) ? deadline - now : 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	left += ts.tv_nsec / 1000;
+	ts.tv_sec += left / 1000000;
+	ts.tv_nsec = (left % 1000000) * 1000;
+#else
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+#endif
+
+	tny_waiter *w = t->waiter;
+	pthread_mutex_lock(&w->lock);
+	__atomic_store_n(&w->sleeping, true, __ATOMIC_SEQ_CST);
+	while(!wait_over(t) && us_clock() < deadline) {
+		if(pthread_cond_timedwait(&w->wake, &w->lock, &ts) == ETIMEDOUT) break;
+	}
+	__atomic_store_n(&w->sleeping, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+
+	return;
+}
+
+/*
+ * Let up to the given number of cycles go by waiting for an interrupt, and
+ * return how many did.  A clocked instance sleeps through them rather than
+ * pacing, and once woken has its cycle count caught up to the wall clock.
+ */
+static uint64_t wait_cycles(teenyat *t, uint64_t cycles) {
+	if(wait_over(t)) {
+		end_wait(t);
+		return 0;
+	}
+
+	bool clocked = (t->clock_manager.cycles_until_calibrate >= 0);
+	if(clocked) {
+		uint64_t mhz = t->clock_manager.target_mhz;
+		uint64_t end = t->cycle_cnt + cycles;
+		block_until_us(t, t->clock_manager.epoch + (end + mhz - 1) / mhz);
+
+		/* woken early, only the cycles the wall clock has reached went by */
+		uint64_t reached = (us_clock() - t->clock_manager.epoch) * mhz;
+		if(reached < end) {
+			cycles = (reached > t->cycle_cnt) ? reached - t->cycle_cnt : 0;
+		}
+	}
+
+	t->delay_cycles -= cycles;
+	t->cycle_cnt += cycles;
+
+	if(clocked) {
+		/*
+		 * The epoch still holds, so oversleeping is made up for, but the
+		 * busy loop's measure of a cycle has to start over.
+		 */
+		t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
+		t->clock_manager.last_calibration_time = us_clock();
+		t->clock_manager.sync_cycle = t->cycle_cnt;
+	}
+
+	return cycles;
+}
+
+/*
+ * The semantics of each opcode, shared by every execution engine.  Each is
+ * handed its decoded instruction after the PC has already been advanced past
+ * it and the instruction's known cycle cost added to delay_cycles.
+ */
+
+static inline void exec_set(teenyat *t, const tny_decoded *d) {
+	t->reg[d->reg1].s = t->reg[d->reg2].s + d->immed;
+
+	return;
+}
+
+/*
+ * Read one of the on-board registers, other than the random number
+ * generator, into data.  Anything else in the on-board space reads as
+ * nothing at all, leaving data alone.
+ */
+static inline void read_onboard(const teenyat *t, tny_uword addr, tny_word *data) {
+	switch(addr) {
+	case TNY_PORTA_ADDRESS:
+		*data = t->port_a;
+		break;
+	case TNY_PORTB_ADDRESS:
+		*data = t->port_b;
+		break;
+	case TNY_PORTA_DIR_ADDRESS:
+		*data = t->port_a_directions;
+		break;
+	case TNY_PORTB_DIR_ADDRESS:
+		*data = t->port_b_directions;
+		break;
+	case TNY_CONTROL_STATUS_REGISTER:
+		*data = t->control_status_register;
+		break;
+	case TNY_INTERRUPT_ENABLE_REGISTER:
+		*data = t->interrupt_enable_register;
+		break;
+	case TNY_INTERRUPT_QUEUE_REGISTER:
+		*data = t->interrupt_queue_register;
+		break;
+	default:
+		/* Check if reading from interrupt service */
+		if(addr >= TNY_INTERRUPT_VECTOR_TABLE_START &&
+		   addr <= TNY_INTERRUPT_VECTOR_TABLE_END
+		  ) {
+			*data = t->interrupt_vector_table[addr - TNY_INTERRUPT_VECTOR_TABLE_START];
+		}
+		else {
+			/* 
+			 * This is an attempt to access an unaccounted for
+			 * address in the "Microcontroller Device Space".
+			 */
+		}
+		break;
+	}
+
+	return;
+}
+
+static inline void exec_lod(teenyat *t, const tny_decoded *d) {
+	tny_uword addr = t->reg[d->reg2].s + d->immed;
+	switch(addr) {
+	case TNY_RANDOM_ADDRESS:
+		perf_read(t, false);
+		spin_disturb(t);
+		t->reg[d->reg1].u = tny_random(t) & ((1 << 15) - 1);
+		break;
+	case TNY_RANDOM_BITS_ADDRESS:
+		perf_read(t, false);
+		spin_disturb(t);
+		t->reg[d->reg1].u = tny_random(t);
+		break;
+	default:
+		if(addr >= TNY_PERIPHERAL_BASE_ADDRESS) {
+			/* read from peripheral address */
+			t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+			perf_read(t, true);
+			spin_disturb(t);
+
+			tny_word data = {.u = 0};
+			uint16_t delay = 0;
+			peripheral_read(t, addr, &data, &delay);
+			t->reg[d->reg1] = data;
+			t->delay_cycles += delay;
+		}
+		else if(addr <= TNY_MAX_RAM_ADDRESS) {
+			/* read from RAM */
+			t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+			perf_read(t, false);
+
+			t->reg[d->reg1] = ram_read(t, addr);
+		}
+		else {
+			perf_read(t, false);
+			read_onboard(t, addr, &(t->reg[d->reg1]));
+		}
+		break;
+	}
+	trace_bus(t, addr, t->reg[d->reg1], TNY_TRACE_BUS_READ);
+
+	return;
+}
+
+static inline void exec_str(teenyat *t, const tny_decoded *d) {
+	tny_uword addr = t->reg[d->reg1].s + d->immed;
+	perf_write(t, addr >= TNY_PERIPHERAL_BASE_ADDRESS);
+	trace_bus(t, addr, t->reg[d->reg2], TNY_TRACE_BUS_WRITE);
+	spin_disturb(t);
+	switch(addr) {
+	case TNY_PORTA_ADDRESS:
+		tny_modify_port_levels(t, false, t->reg[d->reg2], true);
+		break;
+	case TNY_PORTB_ADDRESS:
+		tny_modify_port_levels(t, false, t->reg[d->reg2], false);
+		break;
+	case TNY_PORTA_DIR_ADDRESS:
+		t->port_a_directions = t->reg[d->reg2];
+		break;
+	case TNY_PORTB_DIR_ADDRESS:
+		t->port_b_directions = t->reg[d->reg2];
+		break;
+	case TNY_RANDOM_ADDRESS:
+		/* Do nothing */
+		break;
+	case TNY_RANDOM_BITS_ADDRESS:
+		/* Do nothing */
+		break;
+	case TNY_CONTROL_STATUS_REGISTER:
+		t->control_status_register = t->reg[d->reg2];
+		update_interrupt_attention(t);
+		start_wait(t);
+		break;
+	case TNY_INTERRUPT_ENABLE_REGISTER:
+		t->interrupt_enable_register = t->reg[d->reg2];
+		update_interrupt_attention(t);
+		break;
+	case TNY_INTERRUPT_QUEUE_REGISTER:
+		t->interrupt_queue_register = t->reg[d->reg2];
+		update_interrupt_attention(t);
+		break;
+	default:
+		/* Check if writing to interrupt service */
+		if(addr >= TNY_INTERRUPT_VECTOR_TABLE_START &&
+		   addr <= TNY_INTERRUPT_VECTOR_TABLE_END
+		  ) {
+			t->interrupt_vector_table[addr - TNY_INTERRUPT_VECTOR_TABLE_START] = t->reg[d->reg2];
+		}
+		else if(addr >= TNY_PERIPHERAL_BASE_ADDRESS) {
+			/* write to peripheral address */
+			t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+
+			uint16_t delay = 0;
+			peripheral_write(t, addr, t->reg[d->reg2], &delay);
+			t->delay_cycles += delay;
+		}
+		else if(addr <= TNY_MAX_RAM_ADDRESS) {
+			/* write to RAM */
+			t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+
+			ram_write(t, addr, t->reg[d->reg2]);
+		}
+		else {
+			/* 
+			 * This is an attempt to access an unaccounted for
+			 * address in the "Microcontroller Device Space".
+			 */
+		}
+		break;
+	}
+
+	return;
+}
+
+static inline void exec_psh(teenyat *t, const tny_decoded *d) {
+	t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
+	tny_word data = {.s = t->reg[d->reg2].s + d->immed};
+	perf_write(t, false);
+	trace_bus(t, t->reg[TNY_REG_SP].u, data, TNY_TRACE_BUS_WRITE);
+	ram_write(t, t->reg[TNY_REG_SP].u, data);
+	t->reg[TNY_REG_SP].u--;
+	t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
+
+	return;
+}
+
+static inline void exec_pop(teenyat *t, const tny_decoded *d) {
+	t->reg[TNY_REG_SP].u++;
+	t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
+	perf_read(t, false);
+	t->reg[d->reg1] = ram_read(t, t->reg[TNY_REG_SP].u);
+	trace_bus(t, t->reg[TNY_REG_SP].u, t->reg[d->reg1], TNY_TRACE_BUS_READ);
+
+	return;
+}
+
+static inline void exec_bts(teenyat *t, const tny_decoded *d) {
+	tny_sword bit = t->reg[d->reg2].s + d->immed;
+	if(bit >= 0 && bit <= 15) {
+		t->reg[d->reg1].s |= (1 << bit);
+		set_elg_flags(t, t->reg[d->reg1].s);
+	}
+
+	return;
+}
+
+static inline void exec_btc(teenyat *t, const tny_decoded *d) {
+	tny_sword bit = t->reg[d->reg2].s + d->immed;
+	if(bit >= 0 && bit <= 15) {
+		t->reg[d->reg1].s &= ~(1 << bit);
+		set_elg_flags(t, t->reg[d->reg1].s);
+	}
+
+	return;
+}
+
+static inline void exec_btf(teenyat *t, const tny_decoded *d) {
+	tny_sword bit = t->reg[d->reg2].s + d->immed;
+	if(bit >= 0 && bit <= 15) {
+		t->reg[d->reg1].s ^= (1 << bit);
+		set_elg_flags(t, t->reg[d->reg1].s);
+	}
+
+	return;
+}
+
+static inline void exec_cal(teenyat *t, const tny_decoded *d) {
+	t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
+	trace_bus(t, t->reg[TNY_REG_SP].u, t->reg[TNY_REG_PC], TNY_TRACE_BUS_WRITE);
+	ram_write(t, t->reg[TNY_REG_SP].u, t->reg[TNY_REG_PC]);
+	t->reg[TNY_REG_SP].u--;
+	t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
+	set_pc(t, t->reg[d->reg2].s + d->immed);
+
+	return;
+}
+
+static inline void exec_add(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)(t->reg[d->reg1].s) + (uint32_t)((uint32_t)(t->reg[d->reg2].s) + (uint32_t)d->immed);
+	t->flags.carry = tmp & (1 << 16);
+	t->reg[d->reg1].s = tmp;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_sub(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)(t->reg[d->reg1].s) - (uint32_t)((uint32_t)(t->reg[d->reg2].s) + (uint32_t)d->immed);
+	t->flags.carry = tmp & (1 << 16);
+	t->reg[d->reg1].s = tmp;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_mpy(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)(t->reg[d->reg1].s) * (uint32_t)((uint32_t)(t->reg[d->reg2].s) + (uint32_t)d->immed);
+	t->flags.carry = tmp & (1 << 16);
+	t->reg[d->reg1].s = tmp;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_div(teenyat *t, const tny_decoded *d) {
+	if(t->reg[d->reg2].s + d->immed != 0) {
+		t->reg[d->reg1].s /= t->reg[d->reg2].s + d->immed;
+		set_elg_flags(t, t->reg[d->reg1].s);
+	}
+	else {
+		/* No behavior defined on divide-by-zero */
+	}
+
+	return;
+}
+
+static inline void exec_mod(teenyat *t, const tny_decoded *d) {
+	if(t->reg[d->reg2].s + d->immed != 0) {
+		t->reg[d->reg1].s %= t->reg[d->reg2].s + d->immed;
+		set_elg_flags(t, t->reg[d->reg1].s);
+	}
+	else {
+		/* No behavior defined on divide-by-zero */
+	}
+
+	return;
+}
+
+static inline void exec_and(teenyat *t, const tny_decoded *d) {
+	t->reg[d->reg1].s &= t->reg[d->reg2].s + d->immed;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_or(teenyat *t, const tny_decoded *d) {
+	t->reg[d->reg1].s |= t->reg[d->reg2].s + d->immed;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_xor(teenyat *t, const tny_decoded *d) {
+	t->reg[d->reg1].s ^= t->reg[d->reg2].s + d->immed;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+/*
+ * The shift and rotate semantics, shared with the lockstep engine.  carry is
+ * left alone when there is nothing to shift or rotate.
+ */
+static inline tny_uword alu_shf(tny_uword value, tny_sword bits_to_shift, bool *carry) {
+	if(bits_to_shift < 0) {
+		/* shift left */
+		bits_to_shift *= -1;
+		if(bits_to_shift <= 15) {
+			value <<= bits_to_shift - 1;
+			*carry = (value >> 15) & 1;
+			value <<= 1;
+		}
+		else {
+			if(bits_to_shift == 16) {
+				*carry = value & (1 << 0);
+			}
+			else {
+				*carry = 0;
+			}
+			value = 0;
+		}
+	}
+	else if(bits_to_shift > 0) {
+		/* shift right */
+		if(bits_to_shift <= 15) {
+			value >>= bits_to_shift - 1;
+			*carry = value & (1 << 0);
+			value >>= 1;
+		}
+		else {
+			if(bits_to_shift == 16) {
+				*carry = (value >> 15) & 1;
+			}
+			else {
+				*carry = 0;
+			}
+			value = 0;
+		}
+	}
+
+	return value;
+}
+
+static inline tny_uword alu_rot(tny_uword value, int bits, bool *carry) {
+	/* calculate remainder as rotate could go around many times */
+	tny_sword bits_to_rotate = bits % 16;
+	if(bits_to_rotate < 0) {
+		/* rotate left */
+		bits_to_rotate *= -1;
+		tny_uword main_part = value << bits_to_rotate;
+		tny_uword wrap_part = value >> (16 - bits_to_rotate);
+		value = main_part | wrap_part;
+		*carry = value & (1 << 0);
+	}
+	else if(bits_to_rotate > 0) {
+		/* rotate right */
+		tny_uword main_part = value >> bits_to_rotate;
+		tny_uword wrap_part = value << (16 - bits_to_rotate);
+		value = main_part | wrap_part;
+		*carry = (value >> 15) & 1;
+	}
+
+	return value;
+}
+
+static inline void exec_shf(teenyat *t, const tny_decoded *d) {
+	bool carry = t->flags.carry;
+	t->reg[d->reg1].u = alu_shf(t->reg[d->reg1].u, t->reg[d->reg2].s + d->immed, &carry);
+	t->flags.carry = carry;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_rot(teenyat *t, const tny_decoded *d) {
+	bool carry = t->flags.carry;
+	t->reg[d->reg1].u = alu_rot(t->reg[d->reg1].u, t->reg[d->reg2].s + d->immed, &carry);
+	t->flags.carry = carry;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_neg(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)0 - (uint32_t)(t->reg[d->reg1].s);
+	t->flags.carry = tmp & (1 << 16);
+	t->reg[d->reg1].s = tmp;
+	set_elg_flags(t, t->reg[d->reg1].s);
+
+	return;
+}
+
+static inline void exec_cmp(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)(t->reg[d->reg1].s) - (uint32_t)((uint32_t)(t->reg[d->reg2].s) + (uint32_t)d->immed);
+	t->flags.carry = tmp & (1 << 16);
+	set_elg_flags(t, (tny_sword)tmp);
+
+	return;
+}
+
+static inline void exec_jmp(teenyat *t, const tny_decoded *d) {
+	tny_word cond = {.u = d->cond};
+	bool flags_checked = false;
+	bool condition_satisfied = false;
+	if(cond.inst_flags.carry) {
+		flags_checked = true;
+		condition_satisfied |= t->flags.carry;
+	}
+	if(cond.inst_flags.equals) {
+		flags_checked = true;
+		condition_satisfied |= t->flags.equals;
+	}
+	if(cond.inst_flags.less) {
+		flags_checked = true;
+		condition_satisfied |= t->flags.less;
+	}
+	if(cond.inst_flags.greater) {
+		flags_checked = true;
+		condition_satisfied |= t->flags.greater;
+	}
+	if(!flags_checked || condition_satisfied) {
+		set_pc(t, t->reg[d->reg1].s + d->immed);
+		if(t->spin && t->reg[TNY_REG_PC].u <= t->instruction_address) {
+			spin_check(t);
+		}
+	}
+
+	return;
+}
+
+static inline void exec_lup(teenyat *t, const tny_decoded *d) {
+	uint32_t tmp;  /* for quick use to determine carry */
+
+	tmp = (uint32_t)(t->reg[d->reg1].s) - 1;
+	t->flags.carry = tmp & (1 << 16);
+	t->reg[d->reg1].s = tmp;
+	set_elg_flags(t, (tny_sword)tmp);
+	if(tmp != 0) {
+		set_pc(t, t->reg[d->reg2].s + d->immed);
+	}
+
+	return;
+}
+
+static inline void exec_dly(teenyat *t, const tny_decoded *d) {
+	tny_uword delay_prescale = t->reg[d->reg1].u;
+	if(delay_prescale == 0) {
+		delay_prescale = 1;
+	}
+	tny_uword delay_cnt = (tny_uword)(t->reg[d->reg2].s + d->immed);
+	uint64_t prescaled_delay_cycles = delay_prescale * delay_cnt;
+	perf_dly(t, prescaled_delay_cycles);
+	if(prescaled_delay_cycles >= 1) {
+		/* current instruction already 1 cycle */
+		t->delay_cycles += prescaled_delay_cycles - 1;
+	}
+
+	return;
+}
+
+static inline void exec_int(teenyat *t, const tny_decoded *d) {
+	tny_sword interrupt_number = t->reg[d->reg2].s + d->immed;
+
+	/*
+	 * Make a mask with a 1 in the position of the interrupt number
+	 *
+	 * interrupt > 15 are wrapped
+	 */
+	tny_uword interrupt_mask = 1U << (interrupt_number % 16);
+	/* mask in the interrupt into the upper half of our iqr */
+	t->interrupt_queue_register.u |= interrupt_mask;
+	update_interrupt_attention(t);
+	spin_disturb(t);
+
+	return;
+}
+
+static inline void exec_rti(teenyat *t, const tny_decoded *d) {
+	(void)d;  // RTI has no operands
+
+	set_pc(t, t->interrupt_return_address.u);  // restore pc
+	t->flags = t->interrupt_return_flags;     // restore flags
+	t->control_status_register.csr.interrupt_enable = 1;  // reenable interrupts
+	update_interrupt_attention(t);
+	spin_disturb(t);
+
+	return;
+}
+
+static void exec_unknown(teenyat *t, const tny_decoded *d, tny_uword orig_PC) {
+	/* every pass would have been reported */
+	spin_disturb(t);
+	fprintf(stderr, "Unknown opcode (%d) encountered at 0x%04X on cycle %" PRIu64 "\n",
+			d->opcode, orig_PC, t->cycle_cnt);
+
+	return;
+}
+
+/*
+ * Fetch and decode the instruction at the PC and advance the PC past it.  The
+ * caller is responsible for having already handled interrupts and counted the
+ * cycle this happens on.
+ */
+static inline const tny_decoded *start_instruction(teenyat *t, tny_decoded *scratch, tny_uword *orig_PC) {
+	/*
+	 * All instruction fetches are limited to the range 0x0000 through 0x7FFF.
+	 * Modifications to the PC are always truncated to that range.  As such,
+	 * an unusual circumstance could arrive where a two-word instruction begins
+	 * at 0x7FFF and has its second word retrieved from 0x0000.  This almost
+	 * certainly not something anyone would want, but it's how it works :-)
+	 */
+
+	trunc_pc(t);
+
+	*orig_PC = t->reg[TNY_REG_PC].u;  // backup for error reporting
+
+	const tny_decoded *d = fetch_instruction(t, *orig_PC, scratch);
+
+	set_pc(t, *orig_PC + d->length);
+	t->instruction_address = *orig_PC;
+
+	/* the current instruction's cycle is already being counted */
+	t->delay_cycles += d->cycles - 1;
+	perf_start(t, d);
+	trace_start(t, d, *orig_PC);
+
+	return d;
+}
+
+/* As start_instruction(), but handling any interrupt first */
+static inline const tny_decoded *begin_instruction(teenyat *t, tny_decoded *scratch, tny_uword *orig_PC) {
+	handle_interrupts(t);
+
+	return start_instruction(t, scratch, orig_PC);
+}
+
+/*
+ * EXECUTE, the traditional way
+ */
+static inline void execute_decoded(teenyat *t, const tny_decoded *d, tny_uword orig_PC) {
+	switch(d->opcode) {
+	case TNY_OPCODE_SET:
+		exec_set(t, d);
+		break;
+	case TNY_OPCODE_LOD:
+		exec_lod(t, d);
+		break;
+	case TNY_OPCODE_STR:
+		exec_str(t, d);
+		break;
+	case TNY_OPCODE_PSH:
+		exec_psh(t, d);
+		break;
+	case TNY_OPCODE_POP:
+		exec_pop(t, d);
+		break;
+	case TNY_OPCODE_BTS:
+		exec_bts(t, d);
+		break;
+	case TNY_OPCODE_BTC:
+		exec_btc(t, d);
+		break;
+	case TNY_OPCODE_BTF:
+		exec_btf(t, d);
+		break;
+	case TNY_OPCODE_CAL:
+		exec_cal(t, d);
+		break;
+	case TNY_OPCODE_ADD:
+		exec_add(t, d);
+		break;
+	case TNY_OPCODE_SUB:
+		exec_sub(t, d);
+		break;
+	case TNY_OPCODE_MPY:
+		exec_mpy(t, d);
+		break;
+	case TNY_OPCODE_DIV:
+		exec_div(t, d);
+		break;
+	case TNY_OPCODE_MOD:
+		exec_mod(t, d);
+		break;
+	case TNY_OPCODE_AND:
+		exec_and(t, d);
+		break;
+	case TNY_OPCODE_OR:
+		exec_or(t, d);
+		break;
+	case TNY_OPCODE_XOR:
+		exec_xor(t, d);
+		break;
+	case TNY_OPCODE_SHF:
+		exec_shf(t, d);
+		break;
+	case TNY_OPCODE_ROT:
+		exec_rot(t, d);
+		break;
+	case TNY_OPCODE_NEG:
+		exec_neg(t, d);
+		break;
+	case TNY_OPCODE_CMP:
+		exec_cmp(t, d);
+		break;
+	case TNY_OPCODE_JMP:
+		exec_jmp(t, d);
+		break;
+	case TNY_OPCODE_LUP:
+		exec_lup(t, d);
+		break;
+	case TNY_OPCODE_DLY:
+		exec_dly(t, d);
+		break;
+	case TNY_OPCODE_INT:
+		exec_int(t, d);
+		break;
+	case TNY_OPCODE_RTI:
+		exec_rti(t, d);
+		break;
+	default:
+		exec_unknown(t, d, orig_PC);
+		break;
+	}
+
+	/* Ensure the zero register still has a zero in it */
+	t->reg[TNY_REG_ZERO].u = 0;
+
+	return;
+}
+
+static void execute_instruction(teenyat *t) {
+	tny_decoded scratch;
+	tny_uword orig_PC;
+
+	const tny_decoded *d = begin_instruction(t, &scratch, &orig_PC);
+	execute_decoded(t, d, orig_PC);
+
+	return;
+}
+
+/*
+ * Used by the run loops to let go of any delay cycles left over from the
+ * previous instruction, as many at a time as the run allows.  Returns false
+ * once the run is over.
+ */
+static inline bool run_expire_delay(teenyat *t, uint64_t *remaining) {
+	/* an event scheduled during the run may have brought its end in */
+	if(__builtin_expect(t->run_end - t->cycle_cnt < *remaining, 0)) {
+		*remaining = t->run_end - t->cycle_cnt;
+	}
+
+	while(t->delay_cycles) {
+		if(*remaining == 0 || t->stop_requested) return false;
+
+		/*
+		 * Interrupts are only ever handled on instruction boundaries, so
+		 * nothing can happen in between these cycles anyway.
+		 */
+		uint64_t n = (t->delay_cycles < *remaining) ? t->delay_cycles : *remaining;
+		if(__builtin_expect(waiting(t), 0)) {
+			*remaining -= wait_cycles(t, n);
+			continue;
+		}
+
+		t->delay_cycles -= n;
+		t->cycle_cnt += n;
+		*remaining -= n;
+		pace_cycles(t, n);
+	}
+
+	return *remaining > 0 && !t->stop_requested;
+}
+
+/*
+ * Whether an instruction can be part of a block.  These only ever touch
+ * registers, flags, and (for POP) read RAM, so nothing outside the TeenyAT
+ * can tell whether they ran one at a time, and their decoded cycles are
+ * their whole cost.
+ */
+static inline bool block_safe(const tny_decoded *d) {
+	switch(d->opcode) {
+	case TNY_OPCODE_SET:
+	case TNY_OPCODE_POP:
+	case TNY_OPCODE_BTS:
+	case TNY_OPCODE_BTC:
+	case TNY_OPCODE_BTF:
+	case TNY_OPCODE_ADD:
+	case TNY_OPCODE_SUB:
+	case TNY_OPCODE_MPY:
+	case TNY_OPCODE_DIV:
+	case TNY_OPCODE_MOD:
+	case TNY_OPCODE_AND:
+	case TNY_OPCODE_OR:
+	case TNY_OPCODE_XOR:
+	case TNY_OPCODE_SHF:
+	case TNY_OPCODE_ROT:
+	case TNY_OPCODE_NEG:
+	case TNY_OPCODE_CMP:
+	case TNY_OPCODE_JMP:
+	case TNY_OPCODE_LUP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Whether an instruction may change the PC, which ends its block */
+static inline bool block_ends(const tny_decoded *d) {
+	return d->opcode == TNY_OPCODE_JMP ||
+	       d->opcode == TNY_OPCODE_LUP ||
+	       d->reg1 == TNY_REG_PC;
+}
+
+static void build_block(teenyat *t, tny_uword start) {
+	unsigned len = 0;
+	unsigned cycles = 0;
+	tny_uword addr = start;
+
+	while(len < TNY_BLOCK_MAX_LEN) {
+		tny_decoded *d = &(t->decode_cache[addr]);
+		if(d->length == 0) {
+			decode_instruction(t, addr, d);
+		}
+
+		/* blocks never wrap around the end of RAM */
+		if(!block_safe(d) || addr + d->length > TNY_RAM_SIZE) break;
+
+		len++;
+		cycles += d->cycles;
+
+		if(block_ends(d) || addr + d->length == TNY_RAM_SIZE) break;
+		addr += d->length;
+	}
+
+	t->decode_cache[start].block_len = (len > 0) ? len : TNY_BLOCK_NONE;
+	t->decode_cache[start].block_cycles = cycles;
+
+	return;
+}
+
+/*
+ * Run the block starting at the PC, if there is one and the run has cycles
+ * enough for all of it.  This is exact because nothing in a block can raise
+ * an interrupt, make a bus request or write RAM, so nothing outside the
+ * TeenyAT can tell the instructions in it didn't run one at a time.
+ */
+static bool run_block(teenyat *t, uint64_t *remaining) {
+	trunc_pc(t);
+
+	tny_uword addr = t->reg[TNY_REG_PC].u;
+
+	tny_decoded *d = &(t->decode_cache[addr]);
+	if(d->length == 0) {
+		decode_instruction(t, addr, d);
+	}
+	if(d->block_len == TNY_BLOCK_UNKNOWN) {
+		build_block(t, addr);
+	}
+
+	if(d->block_len == TNY_BLOCK_NONE || d->block_cycles > *remaining) {
+		return false;
+	}
+
+	uint64_t block_cycles = d->block_cycles;
+	perf_block_start(t);
+	/* counted up front, so a jump ending the block sees the cycle it finishes on */
+	t->cycle_cnt += block_cycles;
+
+	for(unsigned len = d->block_len; len > 0; len--) {
+		tny_uword next = addr + d->length;
+		t->reg[TNY_REG_PC].u = next & TNY_MAX_RAM_ADDRESS;
+		t->instruction_address = addr & TNY_MAX_RAM_ADDRESS;
+		perf_block_instruction(t, d);
+		trace_start(t, d, t->instruction_address);
+		execute_decoded(t, d, addr);
+
+		addr = next;
+		d = &(t->decode_cache[addr & TNY_MAX_RAM_ADDRESS]);
+	}
+
+	*remaining -= block_cycles;
+	pace_cycles(t, block_cycles);
+
+	return true;
+}
+
+#ifdef TNY_JIT_NATIVE
+
+/*
+ * The JIT engine.  Each block run_block() would run is translated, the first
+ * time it is reached, into x86-64 code that does exactly the same to the
+ * instance, and each translation goes straight on to the translation of
+ * whichever block follows it.  Control only comes back to run_jit() at a
+ * block that isn't translated or doesn't fit in what's left of the run, or
+ * when there's an interrupt to take or the run was stopped, so everything
+ * that can't be in a block (bus accesses, 0x8000+ addresses, RAM stores, DLY,
+ * and interrupt delivery) is still carried out by the interpreter.
+ *
+ * Translations keep t in rbx, the cycles left in the run in r12, and the
+ * table of translations in r13.  Everything else lives in the instance
+ * itself, so the interpreter can take over between any two blocks.
+ */
+
+typedef uint64_t (*jit_enter_fn)(teenyat *t, uint64_t remaining, uint8_t *const *entries,
+                                 const uint8_t *code);
+
+#define JIT_EMIT(p, ...) \
+	jit_emit((p), (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+/* Where the instance's fields are, from rbx */
+#define JIT_FIELD(field) ((uint32_t)offsetof(teenyat, field))
+#define JIT_REG(r) ((uint32_t)(offsetof(teenyat, reg) + (r) * sizeof(tny_word)))
+
+/* x86 registers, as numbered in the encodings */
+#define JIT_EAX 0
+#define JIT_ECX 1
+
+/* x86 condition codes, for jcc */
+#define JIT_JMP 0x00
+#define JIT_JB  0x82
+#define JIT_JZ  0x84
+#define JIT_JNZ 0x85
+#define JIT_JA  0x87
+
+static inline void jit_emit(uint8_t **p, const uint8_t *bytes, size_t cnt) {
+	memcpy(*p, bytes, cnt);
+	*p += cnt;
+
+	return;
+}
+
+static inline void jit_emit16(uint8_t **p, uint16_t value) {
+	jit_emit(p, (const uint8_t *)&value, sizeof(value));
+
+	return;
+}
+
+static inline void jit_emit32(uint8_t **p, uint32_t value) {
+	jit_emit(p, (const uint8_t *)&value, sizeof(value));
+
+	return;
+}
+
+static inline void jit_emit64(uint8_t **p, uint64_t value) {
+	jit_emit(p, (const uint8_t *)&value, sizeof(value));
+
+	return;
+}
+
+/* A jmp or jcc with a 32-bit displacement.  Returns where that goes, for jit_patch(). */
+static uint8_t *jit_jump(uint8_t **p, uint8_t cc) {
+	if(cc == JIT_JMP) {
+		JIT_EMIT(p, 0xE9);
+	}
+	else {
+		JIT_EMIT(p, 0x0F, cc);
+	}
+	uint8_t *rel = *p;
+	jit_emit32(p, 0);
+
+	return rel;
+}
+
+static void jit_patch(uint8_t *rel, const uint8_t *target) {
+	int32_t displacement = (int32_t)(target - (rel + 4));
+	memcpy(rel, &displacement, sizeof(displacement));
+
+	return;
+}
+
+/* movsx r32, word [rbx + the register] */
+static void jit_load(uint8_t **p, int x86, uint8_t reg) {
+	JIT_EMIT(p, 0x0F, 0xBF, 0x83 | (x86 << 3));
+	jit_emit32(p, JIT_REG(reg));
+
+	return;
+}
+
+/* mov word [rbx + the register], r16 */
+static void jit_store(uint8_t **p, uint8_t reg, int x86) {
+	JIT_EMIT(p, 0x66, 0x89, 0x83 | (x86 << 3));
+	jit_emit32(p, JIT_REG(reg));
+
+	return;
+}
+
+/* mov word [rbx + offset], imm16 */
+static void jit_store_imm(uint8_t **p, uint32_t offset, tny_uword value) {
+	JIT_EMIT(p, 0x66, 0xC7, 0x83);
+	jit_emit32(p, offset);
+	jit_emit16(p, value);
+
+	return;
+}
+
+/* ecx = reg2 + immed, the second operand of every instruction */
+static void jit_operand(uint8_t **p, const tny_decoded *d) {
+	jit_load(p, JIT_ECX, d->reg2);
+	if(d->immed != 0) {
+		JIT_EMIT(p, 0x81, 0xC1);  // add ecx, imm32
+		jit_emit32(p, (uint32_t)(int32_t)d->immed);
+	}
+
+	return;
+}
+
+/*
+ * Set the flags from the result in ax, just as set_elg_flags() does, along
+ * with the carry out of the 32-bit result in eax if there is one.
+ */
+static void jit_flags(uint8_t **p, bool carry) {
+	if(carry) {
+		JIT_EMIT(p, 0x89, 0xC1,        // mov ecx, eax
+		            0xC1, 0xE9, 0x10,  // shr ecx, 16
+		            0x83, 0xE1, 0x01,  // and ecx, 1
+		            0xC1, 0xE1, 0x03); // shl ecx, 3
+	}
+	else {
+		JIT_EMIT(p, 0x31, 0xC9);       // xor ecx, ecx
+	}
+
+	JIT_EMIT(p, 0x31, 0xD2,            // xor edx, edx
+	            0x66, 0x85, 0xC0,      // test ax, ax
+	            0x0F, 0x9F, 0xC2,      // setg dl
+	            0x8D, 0x0C, 0x11,      // lea ecx, [rcx + rdx]
+	            0x0F, 0x98, 0xC2,      // sets dl
+	            0x8D, 0x0C, 0x51,      // lea ecx, [rcx + rdx*2]
+	            0x0F, 0x94, 0xC2,      // sete dl
+	            0x8D, 0x0C, 0x91);     // lea ecx, [rcx + rdx*4]
+
+	/* the reserved bits, and carry if it's left alone, are kept */
+	JIT_EMIT(p, 0x0F, 0xB6, 0x93);     // movzx edx, byte [rbx + flags]
+	jit_emit32(p, JIT_FIELD(flags));
+	JIT_EMIT(p, 0x83, 0xE2, carry ? 0xF0 : 0xF8,  // and edx, keep
+	            0x09, 0xCA,            // or edx, ecx
+	            0x88, 0x93);           // mov byte [rbx + flags], dl
+	jit_emit32(p, JIT_FIELD(flags));
+
+	return;
+}
+
+/* SHF and ROT are rare enough to be left to the interpreter's own code */
+static void jit_execute(teenyat *t, uint32_t packed) {
+	tny_decoded d = {
+		.opcode = packed & 0xFF,
+		.reg1 = (packed >> 8) & 0xF,
+		.reg2 = (packed >> 12) & 0xF,
+		.immed = (tny_sword)(packed >> 16)
+	};
+	execute_decoded(t, &d, t->instruction_address);
+
+	return;
+}
+
+static void jit_instruction(uint8_t **p, const tny_decoded *d, tny_uword next, bool last) {
+	uint8_t *skip = NULL;
+
+	/*
+	 * As far as the instruction can tell, the PC is already past it.  Only
+	 * the last instruction can change the PC, and only it leaves it behind.
+	 */
+	if(last || d->reg1 == TNY_REG_PC || d->reg2 == TNY_REG_PC ||
+	   d->opcode == TNY_OPCODE_SHF || d->opcode == TNY_OPCODE_ROT) {
+		jit_store_imm(p, JIT_REG(TNY_REG_PC), next);
+	}
+
+	switch(d->opcode) {
+	case TNY_OPCODE_SET:
+		jit_operand(p, d);
+		jit_store(p, d->reg1, JIT_ECX);
+		break;
+	case TNY_OPCODE_POP:
+		JIT_EMIT(p, 0x0F, 0xB7, 0x83);              // movzx eax, word [rbx + SP]
+		jit_emit32(p, JIT_REG(TNY_REG_SP));
+		JIT_EMIT(p, 0xFF, 0xC0,                     // inc eax
+		            0x25);                          // and eax, TNY_MAX_RAM_ADDRESS
+		jit_emit32(p, TNY_MAX_RAM_ADDRESS);
+		jit_store(p, TNY_REG_SP, JIT_EAX);
+		JIT_EMIT(p, 0x89, 0xC1,                     // mov ecx, eax
+		            0xC1, 0xE9, __builtin_ctz(TNY_RAM_PAGE_SIZE),  // shr ecx, page shift
+		            0x48, 0x8B, 0x94, 0xCB);        // mov rdx, [rbx + ram + rcx*8]
+		jit_emit32(p, JIT_FIELD(ram));
+		JIT_EMIT(p, 0x25);                          // and eax, TNY_RAM_PAGE_SIZE - 1
+		jit_emit32(p, TNY_RAM_PAGE_SIZE - 1);
+		JIT_EMIT(p, 0x0F, 0xB7, 0x84, 0x42);        // movzx eax, word [rdx + words + rax*2]
+		jit_emit32(p, (uint32_t)offsetof(tny_ram_page, words));
+		jit_store(p, d->reg1, JIT_EAX);
+		break;
+	case TNY_OPCODE_BTS:
+	case TNY_OPCODE_BTC:
+	case TNY_OPCODE_BTF:
+		jit_operand(p, d);
+		JIT_EMIT(p, 0x0F, 0xBF, 0xC9,               // movsx ecx, cx
+		            0x83, 0xF9, 0x0F);              // cmp ecx, 15
+		skip = jit_jump(p, JIT_JA);
+		JIT_EMIT(p, 0xBA, 0x01, 0x00, 0x00, 0x00,   // mov edx, 1
+		            0xD3, 0xE2);                    // shl edx, cl
+		jit_load(p, JIT_EAX, d->reg1);
+		if(d->opcode == TNY_OPCODE_BTS) {
+			JIT_EMIT(p, 0x09, 0xD0);                // or eax, edx
+		}
+		else if(d->opcode == TNY_OPCODE_BTC) {
+			JIT_EMIT(p, 0xF7, 0xD2, 0x21, 0xD0);    // not edx; and eax, edx
+		}
+		else {
+			JIT_EMIT(p, 0x31, 0xD0);                // xor eax, edx
+		}
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, false);
+		break;
+	case TNY_OPCODE_ADD:
+	case TNY_OPCODE_SUB:
+	case TNY_OPCODE_MPY:
+		jit_load(p, JIT_EAX, d->reg1);
+		jit_operand(p, d);
+		if(d->opcode == TNY_OPCODE_ADD) {
+			JIT_EMIT(p, 0x01, 0xC8);                // add eax, ecx
+		}
+		else if(d->opcode == TNY_OPCODE_SUB) {
+			JIT_EMIT(p, 0x29, 0xC8);                // sub eax, ecx
+		}
+		else {
+			JIT_EMIT(p, 0x0F, 0xAF, 0xC1);          // imul eax, ecx
+		}
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, true);
+		break;
+	case TNY_OPCODE_DIV:
+	case TNY_OPCODE_MOD:
+		jit_operand(p, d);
+		JIT_EMIT(p, 0x85, 0xC9);                    // test ecx, ecx
+		skip = jit_jump(p, JIT_JZ);
+		jit_load(p, JIT_EAX, d->reg1);
+		JIT_EMIT(p, 0x99,                           // cdq
+		            0xF7, 0xF9);                    // idiv ecx
+		if(d->opcode == TNY_OPCODE_MOD) {
+			JIT_EMIT(p, 0x89, 0xD0);                // mov eax, edx
+		}
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, false);
+		break;
+	case TNY_OPCODE_AND:
+	case TNY_OPCODE_OR:
+	case TNY_OPCODE_XOR:
+		jit_load(p, JIT_EAX, d->reg1);
+		jit_operand(p, d);
+		if(d->opcode == TNY_OPCODE_AND) {
+			JIT_EMIT(p, 0x21, 0xC8);                // and eax, ecx
+		}
+		else if(d->opcode == TNY_OPCODE_OR) {
+			JIT_EMIT(p, 0x09, 0xC8);                // or eax, ecx
+		}
+		else {
+			JIT_EMIT(p, 0x31, 0xC8);                // xor eax, ecx
+		}
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, false);
+		break;
+	case TNY_OPCODE_NEG:
+		jit_load(p, JIT_EAX, d->reg1);
+		JIT_EMIT(p, 0xF7, 0xD8);                    // neg eax
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, true);
+		break;
+	case TNY_OPCODE_CMP:
+		jit_load(p, JIT_EAX, d->reg1);
+		jit_operand(p, d);
+		JIT_EMIT(p, 0x29, 0xC8);                    // sub eax, ecx
+		jit_flags(p, true);
+		break;
+	case TNY_OPCODE_JMP:
+		if(d->cond) {
+			/* the condition bits line up with the flags' own */
+			JIT_EMIT(p, 0x0F, 0xB6, 0x83);          // movzx eax, byte [rbx + flags]
+			jit_emit32(p, JIT_FIELD(flags));
+			JIT_EMIT(p, 0xA8, d->cond);             // test al, cond
+			skip = jit_jump(p, JIT_JZ);
+		}
+		jit_load(p, JIT_EAX, d->reg1);
+		JIT_EMIT(p, 0x05);                          // add eax, immed
+		jit_emit32(p, (uint32_t)(int32_t)d->immed);
+		JIT_EMIT(p, 0x25);                          // and eax, TNY_MAX_RAM_ADDRESS
+		jit_emit32(p, TNY_MAX_RAM_ADDRESS);
+		jit_store(p, TNY_REG_PC, JIT_EAX);
+		break;
+	case TNY_OPCODE_LUP:
+		jit_load(p, JIT_EAX, d->reg1);
+		JIT_EMIT(p, 0x83, 0xE8, 0x01);              // sub eax, 1
+		jit_store(p, d->reg1, JIT_EAX);
+		jit_flags(p, true);
+		/* only a count of exactly 1 leaves 0 in all 32 bits too */
+		JIT_EMIT(p, 0x66, 0x85, 0xC0);              // test ax, ax
+		skip = jit_jump(p, JIT_JZ);
+		/* reg2 is read after reg1 was written, as in exec_lup() */
+		jit_operand(p, d);
+		JIT_EMIT(p, 0x89, 0xC8,                     // mov eax, ecx
+		            0x25);                          // and eax, TNY_MAX_RAM_ADDRESS
+		jit_emit32(p, TNY_MAX_RAM_ADDRESS);
+		jit_store(p, TNY_REG_PC, JIT_EAX);
+		break;
+	default:
+		JIT_EMIT(p, 0x48, 0x89, 0xDF,               // mov rdi, rbx
+		            0xBE);                          // mov esi, packed
+		jit_emit32(p, d->opcode | (d->reg1 << 8) | (d->reg2 << 12) | ((uint32_t)(tny_uword)d->immed << 16));
+		JIT_EMIT(p, 0x48, 0xB8);                    // mov rax, jit_execute
+		jit_emit64(p, (uint64_t)(uintptr_t)&jit_execute);
+		JIT_EMIT(p, 0xFF, 0xD0);                    // call rax
+		break;
+	}
+
+	if(skip) {
+		jit_patch(skip, *p);
+	}
+
+	return;
+}
+
+/* Translate the block starting at start.  Returns NULL if it can't be done. */
+static uint8_t *jit_translate(teenyat *t, tny_uword start) {
+	tny_jit *j = t->jit;
+	const tny_decoded *first = &(t->decode_cache[start]);
+
+	if(TNY_JIT_CODE_SIZE - j->used < TNY_JIT_BLOCK_ROOM) {
+		/* full up, so everything is translated all over again */
+		jit_forget_all(t);
+		j->used = j->stubs;
+	}
+
+	if(mprotect(j->code, TNY_JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) return NULL;
+
+	uint8_t *entry = j->code + j->used;
+	uint8_t *p = entry;
+
+	/* the whole block has to fit in what's left of the run */
+	JIT_EMIT(&p, 0x49, 0x81, 0xFC);                 // cmp r12, cycles
+	jit_emit32(&p, first->block_cycles);
+	jit_patch(jit_jump(&p, JIT_JB), j->exit);
+
+	/* counted up front, just as run_block() does */
+	JIT_EMIT(&p, 0x49, 0x81, 0xEC);                 // sub r12, cycles
+	jit_emit32(&p, first->block_cycles);
+	JIT_EMIT(&p, 0x48, 0x81, 0x83);                 // add qword [rbx + cycle_cnt], cycles
+	jit_emit32(&p, JIT_FIELD(cycle_cnt));
+	jit_emit32(&p, first->block_cycles);
+
+	tny_uword addr = start;
+	for(unsigned i = 0; i < first->block_len; i++) {
+		const tny_decoded *d = &(t->decode_cache[addr]);
+		bool last = (i + 1 == first->block_len);
+
+		jit_instruction(&p, d, (addr + d->length) & TNY_MAX_RAM_ADDRESS, last);
+
+		/* Ensure the zero register still has a zero in it */
+		if(i == 0 || d->reg1 == TNY_REG_ZERO) {
+			jit_store_imm(&p, JIT_REG(TNY_REG_ZERO), 0);
+		}
+
+		if(last) {
+			jit_store_imm(&p, JIT_FIELD(instruction_address), addr);
+		}
+		addr += d->length;
+	}
+
+	/* on to the next block, unless there's an interrupt to take or the run was stopped */
+	JIT_EMIT(&p, 0x48, 0x83, 0xBB);                 // cmp qword [rbx + mailbox], 0
+	jit_emit32(&p, JIT_FIELD(mailbox));
+	JIT_EMIT(&p, 0x00);
+	jit_patch(jit_jump(&p, JIT_JNZ), j->exit);
+	JIT_EMIT(&p, 0x80, 0xBB);                       // cmp byte [rbx + stop_requested], 0
+	jit_emit32(&p, JIT_FIELD(stop_requested));
+	JIT_EMIT(&p, 0x00);
+	jit_patch(jit_jump(&p, JIT_JNZ), j->exit);
+	JIT_EMIT(&p, 0x0F, 0xB7, 0x83);                 // movzx eax, word [rbx + PC]
+	jit_emit32(&p, JIT_REG(TNY_REG_PC));
+	JIT_EMIT(&p, 0x25);                             // and eax, TNY_MAX_RAM_ADDRESS
+	jit_emit32(&p, TNY_MAX_RAM_ADDRESS);
+	JIT_EMIT(&p, 0x49, 0x8B, 0x4C, 0xC5, 0x00,      // mov rcx, [r13 + rax*8]
+	             0x48, 0x85, 0xC9);                 // test rcx, rcx
+	jit_patch(jit_jump(&p, JIT_JZ), j->exit);
+	JIT_EMIT(&p, 0xFF, 0xE1);                       // jmp rcx
+
+	assert(p - entry <= TNY_JIT_BLOCK_ROOM);
+	j->used = p - j->code;
+
+	if(mprotect(j->code, TNY_JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) return NULL;
+
+	j->entries[start] = entry;
+
+	return entry;
+}
+
+static bool jit_create(teenyat *t) {
+	if(t->jit) return true;
+
+	/* translations test JMP's condition bits against the flags' own */
+	static const alu_flags probe[4] = {
+		{ .greater = 1 }, { .less = 1 }, { .equals = 1 }, { .carry = 1 }
+	};
+	for(int i = 0; i < 4; i++) {
+		uint8_t bits;
+		memcpy(&bits, &probe[i], 1);
+		tny_word cond = { .u = 1 << i };
+		if(bits != (1 << i) || !(cond.inst_flags.greater << 0 | cond.inst_flags.less << 1 |
+		                         cond.inst_flags.equals << 2 | cond.inst_flags.carry << 3)) {
+			return false;
+		}
+	}
+
+	tny_jit *j = calloc(1, sizeof(tny_jit));
+	if(!j) return false;
+	j->code = mmap(NULL, TNY_JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(j->code == MAP_FAILED) {
+		free(j);
+		return false;
+	}
+
+	/* jit_enter_fn: save what translations keep in callee-saved registers */
+	uint8_t *p = j->code;
+	JIT_EMIT(&p, 0x53,                              // push rbx
+	             0x41, 0x54,                        // push r12
+	             0x41, 0x55,                        // push r13
+	             0x48, 0x89, 0xFB,                  // mov rbx, rdi
+	             0x49, 0x89, 0xF4,                  // mov r12, rsi
+	             0x49, 0x89, 0xD5,                  // mov r13, rdx
+	             0xFF, 0xE1);                       // jmp rcx
+
+	/* and hand back the cycles left in the run */
+	j->exit = p;
+	JIT_EMIT(&p, 0x4C, 0x89, 0xE0,                  // mov rax, r12
+	             0x41, 0x5D,                        // pop r13
+	             0x41, 0x5C,                        // pop r12
+	             0x5B,                              // pop rbx
+	             0xC3);                             // ret
+	j->stubs = p - j->code;
+	j->used = j->stubs;
+
+	if(mprotect(j->code, TNY_JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+		munmap(j->code, TNY_JIT_CODE_SIZE);
+		free(j);
+		return false;
+	}
+
+	t->jit = j;
+
+	return true;
+}
+
+/*
+ * Run as many blocks as the run has room for, starting at the PC, from
+ * their translations.  Anything counting, tracing or skipping idle loops
+ * needs to see each instruction, so it gets run_block() instead.
+ */
+static bool run_jit(teenyat *t, uint64_t *remaining) {
+	if(t->perf || t->trace || t->spin) return run_block(t, remaining);
+
+	trunc_pc(t);
+
+	tny_uword addr = t->reg[TNY_REG_PC].u;
+
+	uint8_t *code = t->jit->entries[addr];
+	if(!code) {
+		tny_decoded *d = &(t->decode_cache[addr]);
+		if(d->length == 0) {
+			decode_instruction(t, addr, d);
+		}
+		if(d->block_len == TNY_BLOCK_UNKNOWN) {
+			build_block(t, addr);
+		}
+		if(d->block_len == TNY_BLOCK_NONE) return false;
+
+		code = jit_translate(t, addr);
+		if(!code) return run_block(t, remaining);
+	}
+
+	/* clocked instances are still paced after every block */
+	uint64_t budget = *remaining;
+	uint8_t block_cycles = t->decode_cache[addr].block_cycles;
+	if(t->clock_manager.cycles_until_calibrate >= 0 && budget > block_cycles) {
+		budget = block_cycles;
+	}
+
+	jit_enter_fn enter = (jit_enter_fn)(uintptr_t)t->jit->code;
+	uint64_t ran = budget - enter(t, budget, t->jit->entries, code);
+	if(ran == 0) return false;
+
+	*remaining -= ran;
+	pace_cycles(t, ran);
+
+	return true;
+}
+
+#else
+
+static inline bool run_jit(teenyat *t, uint64_t *remaining) {
+	return run_block(t, remaining);
+}
+
+#endif /* TNY_JIT_NATIVE */
+
+/*
+ * Used by the run loops to get to the next instruction of a run.  Returns
+ * NULL once the run is over.  With blocks, any straight-line run of
+ * instructions starting here is done in one go first (see run_block()), and
+ * only what's left is handed back to be executed one at a time.
+ */
+static inline const tny_decoded *run_next_instruction(teenyat *t, uint64_t *remaining,
+                                                      tny_decoded *scratch, tny_uword *orig_PC,
+                                                      bool blocks) {
+	if(!run_expire_delay(t, remaining)) return NULL;
+
+	if(!blocks) {
+		t->cycle_cnt++;
+		(*remaining)--;
+
+		return begin_instruction(t, scratch, orig_PC);
+	}
+
+	/* a block can never change interrupt state, so once per boundary is enough */
+	handle_interrupts(t);
+	while(t->jit ? run_jit(t, remaining) : run_block(t, remaining)) {
+		if(!run_expire_delay(t, remaining)) return NULL;
+		handle_interrupts(t);
+	}
+
+	t->cycle_cnt++;
+	(*remaining)--;
+
+	return start_instruction(t, scratch, orig_PC);
+}
+
+static uint64_t run_switched(teenyat *t, uint64_t cycles, bool blocks) {
+	uint64_t remaining = cycles;
+	tny_decoded scratch;
+	tny_uword orig_PC;
+	const tny_decoded *d;
+
+	while((d = run_next_instruction(t, &remaining, &scratch, &orig_PC, blocks)) != NULL) {
+		execute_decoded(t, d, orig_PC);
+		pace_cycles(t, 1);
+	}
+
+	return cycles - remaining;
+}
+
+/*
+ * The threaded engine.  Rather than funneling every instruction through the
+ * single indirect branch of a switch, each opcode's handler ends with its own
+ * jump straight to the handler of the next instruction, which gives the host's
+ * branch predictor far more to work with.  Computed goto is a GCC/Clang
+ * extension, so other compilers get the same loop with a switch instead.
+ * The block and JIT engines are this same loop with blocks turned on.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(TNY_NO_COMPUTED_GOTO)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+static uint64_t run_threaded(teenyat *t, uint64_t cycles, bool blocks) {
+	static const void *const handlers[32] = {
+		[TNY_OPCODE_SET] = &&op_set,
+		[TNY_OPCODE_LOD] = &&op_lod,
+		[TNY_OPCODE_STR] = &&op_str,
+		[TNY_OPCODE_PSH] = &&op_psh,
+		[TNY_OPCODE_POP] = &&op_pop,
+		[TNY_OPCODE_BTS] = &&op_bts,
+		[TNY_OPCODE_BTC] = &&op_btc,
+		[TNY_OPCODE_BTF] = &&op_btf,
+		[TNY_OPCODE_CAL] = &&op_cal,
+		[TNY_OPCODE_ADD] = &&op_add,
+		[TNY_OPCODE_SUB] = &&op_sub,
+		[TNY_OPCODE_MPY] = &&op_mpy,
+		[TNY_OPCODE_DIV] = &&op_div,
+		[TNY_OPCODE_MOD] = &&op_mod,
+		[TNY_OPCODE_AND] = &&op_and,
+		[TNY_OPCODE_OR] = &&op_or,
+		[TNY_OPCODE_XOR] = &&op_xor,
+		[TNY_OPCODE_SHF] = &&op_shf,
+		[TNY_OPCODE_ROT] = &&op_rot,
+		[TNY_OPCODE_NEG] = &&op_neg,
+		[TNY_OPCODE_CMP] = &&op_cmp,
+		[TNY_OPCODE_JMP] = &&op_jmp,
+		[TNY_OPCODE_LUP] = &&op_lup,
+		[TNY_OPCODE_DLY] = &&op_dly,
+		[TNY_OPCODE_INT] = &&op_int,
+		[TNY_OPCODE_RTI] = &&op_rti,
+		[26] = &&op_unknown,
+		[27] = &&op_unknown,
+		[28] = &&op_unknown,
+		[29] = &&op_unknown,
+		[30] = &&op_unknown,
+		[31] = &&op_unknown,
+	};
+
+	uint64_t remaining = cycles;
+	tny_decoded scratch;
+	tny_uword orig_PC;
+	const tny_decoded *d;
+
+#define TNY_DISPATCH()                                                  \
+	do {                                                                \
+		d = run_next_instruction(t, &remaining, &scratch, &orig_PC, blocks); \
+		if(d == NULL) goto done;                                        \
+		goto *handlers[d->opcode];                                      \
+	} while(0)
+
+#define TNY_END_INSTRUCTION()                                           \
+	do {                                                                \
+		/* Ensure the zero register still has a zero in it */           \
+		t->reg[TNY_REG_ZERO].u = 0;                                     \
+		pace_cycles(t, 1);                                              \
+		TNY_DISPATCH();                                                 \
+	} while(0)
+
+	TNY_DISPATCH();
+
+	op_set: exec_set(t, d); TNY_END_INSTRUCTION();
+	op_lod: exec_lod(t, d); TNY_END_INSTRUCTION();
+	op_str: exec_str(t, d); TNY_END_INSTRUCTION();
+	op_psh: exec_psh(t, d); TNY_END_INSTRUCTION();
+	op_pop: exec_pop(t, d); TNY_END_INSTRUCTION();
+	op_bts: exec_bts(t, d); TNY_END_INSTRUCTION();
+	op_btc: exec_btc(t, d); TNY_END_INSTRUCTION();
+	op_btf: exec_btf(t, d); TNY_END_INSTRUCTION();
+	op_cal: exec_cal(t, d); TNY_END_INSTRUCTION();
+	op_add: exec_add(t, d); TNY_END_INSTRUCTION();
+	op_sub: exec_sub(t, d); TNY_END_INSTRUCTION();
+	op_mpy: exec_mpy(t, d); TNY_END_INSTRUCTION();
+	op_div: exec_div(t, d); TNY_END_INSTRUCTION();
+	op_mod: exec_mod(t, d); TNY_END_INSTRUCTION();
+	op_and: exec_and(t, d); TNY_END_INSTRUCTION();
+	op_or: exec_or(t, d); TNY_END_INSTRUCTION();
+	op_xor: exec_xor(t, d); TNY_END_INSTRUCTION();
+	op_shf: exec_shf(t, d); TNY_END_INSTRUCTION();
+	op_rot: exec_rot(t, d); TNY_END_INSTRUCTION();
+	op_neg: exec_neg(t, d); TNY_END_INSTRUCTION();
+	op_cmp: exec_cmp(t, d); TNY_END_INSTRUCTION();
+	op_jmp: exec_jmp(t, d); TNY_END_INSTRUCTION();
+	op_lup: exec_lup(t, d); TNY_END_INSTRUCTION();
+	op_dly: exec_dly(t, d); TNY_END_INSTRUCTION();
+	op_int: exec_int(t, d); TNY_END_INSTRUCTION();
+	op_rti: exec_rti(t, d); TNY_END_INSTRUCTION();
+	op_unknown: exec_unknown(t, d, orig_PC); TNY_END_INSTRUCTION();
+
+#undef TNY_END_INSTRUCTION
+#undef TNY_DISPATCH
+
+done:
+	return cycles - remaining;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+static uint64_t run_threaded(teenyat *t, uint64_t cycles, bool blocks) {
+	return run_switched(t, cycles, blocks);
+}
+
+#endif
+
+/* One cycle of tny_clock(), with the caller having bounded any idle loop skip */
+static void clock_cycle(teenyat *t) {
+	/* Setup clock timing on first cycle */
+	if(t->cycle_cnt == 0){
+		start_clock(t);
+	}
+
+	t->cycle_cnt++;
+
+	/* one cycle at a time is paced as usual, even waiting for an interrupt */
+	if(waiting(t) && wait_over(t)) {
+		end_wait(t);
+	}
+
+	/*
+	 * If there were still cycles left on the previous instruction, skip
+	 * everything else for now, and let those expire.
+	 */
+	if(t->delay_cycles) {
+		t->delay_cycles--;
+	}else{
+		execute_instruction(t);
+	}
+
+	if(t->profile) {
+		profile_sample(t);
+	}
+
+	pace_cycles(t, 1);
+	finish_windows(t);
+
+	if(t->events) {
+		fire_events(t);
+	}
+
+	return;
+}
+
+void tny_clock(teenyat *t) {
+	spin_run_end(t, t->cycle_cnt);
+	clock_cycle(t);
+
+	return;
+}
+
+static uint64_t run_engine(teenyat *t, uint64_t cycles) {
+	switch(t->engine) {
+	case TNY_ENGINE_THREADED:
+		return run_threaded(t, cycles, false);
+	case TNY_ENGINE_BLOCK:
+	case TNY_ENGINE_JIT:
+		return run_threaded(t, cycles, true);
+	default:
+		return run_switched(t, cycles, false);
+	}
+}
+
+uint64_t tny_run(teenyat *t, uint64_t cycles) {
+	if(!t) return 0;
+
+	/* Setup clock timing on first cycle */
+	if(t->cycle_cnt == 0 && cycles > 0) {
+		start_clock(t);
+	}
+
+	t->stop_requested = false;
+
+	/*
+	 * The run is cut short at each sample and each event, which are taken
+	 * in between, so the engines never need to look for them.  An event
+	 * scheduled along the way brings the end of the part under way in.
+	 */
+	uint64_t cycles_run = 0;
+	while(cycles_run < cycles) {
+		uint64_t slice = cycles - cycles_run;
+		if(t->profile && t->profile->next_sample - t->cycle_cnt < slice) {
+			slice = t->profile->next_sample - t->cycle_cnt;
+		}
+		slice = cycles_to_event(t, slice);
+
+		uint64_t end = t->cycle_cnt + slice;
+		t->run_end = end;
+		spin_run_end(t, end);
+		/* the engines count whatever an event cut off as run */
+		cycles_run += run_engine(t, slice) - (end - t->run_end);
+		if(t->profile) {
+			profile_sample(t);
+		}
+		if(t->events) {
+			fire_events(t);
+		}
+		if(t->stop_requested) break;
+	}
+
+	/* window writes are told of once per run */
+	finish_windows(t);
+
+	return cycles_run;
+}
+
+uint64_t tny_fast_forward(teenyat *t, uint64_t max_cycles) {
+	if(!t || max_cycles == 0) return 0;
+
+	if(waiting(t) && wait_over(t)) {
+		end_wait(t);
+	}
+
+	if(t->delay_cycles == 0) {
+		/* the instruction may skip an idle loop as far as max_cycles allows */
+		spin_run_end(t, t->cycle_cnt + cycles_to_event(t, max_cycles));
+		clock_cycle(t);
+		return 1;
+	}
+
+	/* events along the way may cut the delay short, so it's looked at each time */
+	uint64_t skipped = 0;
+	while(skipped < max_cycles && t->delay_cycles) {
+		/* stop at each profiler sample along the way, just as tny_clock() would */
+		uint64_t n = max_cycles - skipped;
+		if(n > t->delay_cycles) {
+			n = t->delay_cycles;
+		}
+		n = cycles_to_event(t, n);
+		if(t->profile && t->profile->next_sample > t->cycle_cnt &&
+		   t->profile->next_sample - t->cycle_cnt < n) {
+			n = t->profile->next_sample - t->cycle_cnt;
+		}
+
+		if(waiting(t)) {
+			n = wait_cycles(t, n);
+			if(n == 0) break;  // woken
+		}
+		else {
+			t->delay_cycles -= n;
+			t->cycle_cnt += n;
+			pace_cycles(t, n);
+		}
+		skipped += n;
+
+		if(t->profile) {
+			profile_sample(t);
+		}
+
+		if(t->events) {
+			fire_events(t);
+		}
+	}
+
+	/* woken before a cycle went by, so on with the next instruction */
+	if(skipped == 0) {
+		return tny_fast_forward(t, max_cycles);
+	}
+
+	return skipped;
+}
+
+void tny_stop(teenyat *t) {
+	if(!t) return;
+	t->stop_requested = true;
+
+	return;
+}
+
+/*
+ * Snapshots are a stream of little endian values, so they can move between
+ * hosts:
+ *
+ *   "TNYS", version (u16), mode (u16), image hash (u64)
+ *   TNY_SNAPSHOT_STATE_SIZE bytes of registers, flags, ports, interrupt
+ *       state, random number generator and cycle counters
+ *   runs of RAM words that differ from the base: start (u16), count (u16),
+ *       then the words themselves
+ *   an empty run to finish
+ *
+ * The base is the program image for TNY_SNAPSHOT_DELTA and all zeros for
+ * TNY_SNAPSHOT_FULL, so only delta snapshots need the image to load.
+ */
+#define TNY_SNAPSHOT_MAGIC "TNYS"
+#define TNY_SNAPSHOT_HEADER_SIZE 16
+#define TNY_SNAPSHOT_STATE_SIZE 100
+/* run header costs two words, so differences this close are kept as one run */
+#define TNY_SNAPSHOT_RUN_GAP 2
+
+typedef struct snapshot_writer {
+	uint8_t *buf;
+	size_t size;
+	size_t pos;  /* keeps counting past size */
+} snapshot_writer;
+
+typedef struct snapshot_reader {
+	const uint8_t *buf;
+	size_t size;
+	size_t pos;
+	bool ok;     /* cleared on reading past the end */
+} snapshot_reader;
+
+static void put_u16(snapshot_writer *w, uint16_t v) {
+	if(w->pos + 2 <= w->size) {
+		w->buf[w->pos] = v & 0xFF;
+		w->buf[w->pos + 1] = v >> 8;
+	}
+	w->pos += 2;
+
+	return;
+}
+
+static void put_u64(snapshot_writer *w, uint64_t v) {
+	for(int i = 0; i < 4; i++) {
+		put_u16(w, (uint16_t)(v >> (16 * i)));
+	}
+
+	return;
+}
+
+static uint16_t get_u16(snapshot_reader *r) {
+	if(r->pos + 2 > r->size) {
+		r->ok = false;
+		return 0;
+	}
+	uint16_t v = r->buf[r->pos] | (uint16_t)(r->buf[r->pos + 1] << 8);
+	r->pos += 2;
+
+	return v;
+}
+
+static uint64_t get_u64(snapshot_reader *r) {
+	uint64_t v = 0;
+	for(int i = 0; i < 4; i++) {
+		v |= (uint64_t)get_u16(r) << (16 * i);
+	}
+
+	return v;
+}
+
+static uint16_t pack_flags(alu_flags f) {
+	return f.carry << 3 | f.equals << 2 | f.less << 1 | f.greater;
+}
+
+static alu_flags unpack_flags(uint16_t v) {
+	alu_flags f = {0};
+	f.carry   = (v >> 3) & 1;
+	f.equals  = (v >> 2) & 1;
+	f.less    = (v >> 1) & 1;
+	f.greater = v & 1;
+
+	return f;
+}
+
+static void put_state(snapshot_writer *w, const teenyat *t) {
+	for(int i = 0; i < 8; i++) {
+		put_u16(w, t->reg[i].u);
+	}
+	put_u16(w, pack_flags(t->flags));
+	put_u16(w, t->port_a.u);
+	put_u16(w, t->port_b.u);
+	put_u16(w, t->port_a_directions.u);
+	put_u16(w, t->port_b_directions.u);
+	put_u16(w, t->control_status_register.u);
+	put_u16(w, t->interrupt_enable_register.u);
+	put_u16(w, t->interrupt_queue_register.u);
+	put_u16(w, t->interrupt_return_address.u);
+	put_u16(w, pack_flags(t->interrupt_return_flags));
+	for(int i = 0; i < TNY_INTERRUPT_CNT; i++) {
+		put_u16(w, t->interrupt_vector_table[i].u);
+	}
+	put_u64(w, t->random.state);
+	put_u64(w, t->random.increment);
+	put_u64(w, t->delay_cycles);
+	put_u64(w, t->cycle_cnt);
+
+	return;
+}
+
+static void get_state(snapshot_reader *r, teenyat *t) {
+	/* whatever was traced finished before the state changed under it */
+	if(t->trace) {
+		trace_settle(t);
+	}
+
+	for(int i = 0; i < 8; i++) {
+		t->reg[i].u = get_u16(r);
+	}
+	t->reg[TNY_REG_ZERO].u = 0;
+	t->flags = unpack_flags(get_u16(r));
+	t->port_a.u = get_u16(r);
+	t->port_b.u = get_u16(r);
+	t->port_a_directions.u = get_u16(r);
+	t->port_b_directions.u = get_u16(r);
+	t->control_status_register.u = get_u16(r);
+	t->interrupt_enable_register.u = get_u16(r);
+	t->interrupt_queue_register.u = get_u16(r);
+	t->interrupt_return_address.u = get_u16(r);
+	t->interrupt_return_flags = unpack_flags(get_u16(r));
+	for(int i = 0; i < TNY_INTERRUPT_CNT; i++) {
+		t->interrupt_vector_table[i].u = get_u16(r);
+	}
+	t->random.state = get_u64(r);
+	t->random.increment = get_u64(r);
+	t->delay_cycles = get_u64(r);
+	t->cycle_cnt = get_u64(r);
+	update_interrupt_attention(t);
+#ifdef TNY_PERF_COUNTERS
+	if(t->perf) {
+		perf_restart(t->perf, t->cycle_cnt);
+	}
+#endif
+	if(t->profile) {
+		t->profile->next_sample = t->cycle_cnt + t->profile->period;
+	}
+	spin_forget(t);
+
+	return;
+}
+
+/* Does the word at addr differ from the snapshot's base? */
+static inline bool snapshot_differs(const teenyat *t, const tny_image *base, uint32_t pages, uint32_t addr) {
+	if(!((pages >> (addr / TNY_RAM_PAGE_SIZE)) & 1)) return false;
+
+	return ram_read(t, addr).u != (base ? image_read(base, addr).u : 0);
+}
+
+size_t tny_snapshot_save(const teenyat *t, uint8_t mode, void *buf, size_t size) {
+	if(!t || !t->initialized) return 0;
+	if(mode != TNY_SNAPSHOT_FULL && mode != TNY_SNAPSHOT_DELTA) return 0;
+
+	snapshot_writer w = { buf, buf ? size : 0, 0 };
+	bool delta = (mode == TNY_SNAPSHOT_DELTA);
+
+	put_u16(&w, TNY_SNAPSHOT_MAGIC[0] | TNY_SNAPSHOT_MAGIC[1] << 8);
+	put_u16(&w, TNY_SNAPSHOT_MAGIC[2] | TNY_SNAPSHOT_MAGIC[3] << 8);
+	put_u16(&w, TNY_SNAPSHOT_VERSION);
+	put_u16(&w, mode);
+	put_u64(&w, delta ? t->image->hash : 0);
+
+	put_state(&w, t);
+	assert(w.pos == TNY_SNAPSHOT_HEADER_SIZE + TNY_SNAPSHOT_STATE_SIZE);
+
+	/* only pages written since the last reset can differ from the image */
+	const tny_image *base = delta ? t->image : NULL;
+	uint32_t pages = delta ? t->dirty_pages : TNY_ALL_RAM_PAGES;
+
+	uint32_t addr = 0;
+	while(addr < TNY_RAM_SIZE) {
+		if(!snapshot_differs(t, base, pages, addr)) {
+			addr++;
+			continue;
+		}
+
+		/* extend the run over any small gaps */
+		uint32_t start = addr;
+		uint32_t end = addr + 1;
+		for(addr = end; addr < TNY_RAM_SIZE && addr - end <= TNY_SNAPSHOT_RUN_GAP; addr++) {
+			if(snapshot_differs(t, base, pages, addr)) {
+				end = addr + 1;
+			}
+		}
+
+		put_u16(&w, start);
+		put_u16(&w, end - start);
+		for(uint32_t i = start; i < end; i++) {
+			put_u16(&w, ram_read(t, i).u);
+		}
+	}
+	put_u16(&w, 0);
+	put_u16(&w, 0);
+
+	return w.pos;
+}
+
+bool tny_snapshot_load(teenyat *t, const void *buf, size_t size) {
+	if(!t || !t->initialized || !buf) return false;
+
+	snapshot_reader r = { buf, size, 0, true };
+
+	/*
+	 * Check over the whole snapshot before touching the instance, so a bad
+	 * one leaves it as it was.
+	 */
+	bool magic = get_u16(&r) == (TNY_SNAPSHOT_MAGIC[0] | TNY_SNAPSHOT_MAGIC[1] << 8);
+	magic = magic && get_u16(&r) == (TNY_SNAPSHOT_MAGIC[2] | TNY_SNAPSHOT_MAGIC[3] << 8);
+	if(!magic || get_u16(&r) != TNY_SNAPSHOT_VERSION) return false;
+
+	uint16_t mode = get_u16(&r);
+	uint64_t hash = get_u64(&r);
+	if(mode == TNY_SNAPSHOT_DELTA) {
+		if(hash != t->image->hash) return false;
+	}
+	else if(mode != TNY_SNAPSHOT_FULL) {
+		return false;
+	}
+
+	r.pos += TNY_SNAPSHOT_STATE_SIZE;
+	for(;;) {
+		uint32_t start = get_u16(&r);
+		uint32_t cnt = get_u16(&r);
+		if(!r.ok || cnt == 0) break;
+		if(start + cnt > TNY_RAM_SIZE) return false;
+		r.pos += 2 * (size_t)cnt;
+	}
+	if(!r.ok || r.pos > size) return false;
+
+	/*
+	 * Now for real.  RAM starts over from the base and the runs go on top.
+	 */
+	r.pos = TNY_SNAPSHOT_HEADER_SIZE;
+	get_state(&r, t);
+
+	restore_dirty_pages(t);
+
+	uint32_t written = 0;
+	if(mode == TNY_SNAPSHOT_FULL) {
+		/* clear whatever the image has in RAM to get an all zero base */
+		for(uint32_t page = 0; page < TNY_RAM_PAGE_CNT; page++) {
+			tny_uword start = page * TNY_RAM_PAGE_SIZE;
+			for(tny_uword i = start; i < start + TNY_RAM_PAGE_SIZE; i++) {
+				if(ram_read(t, i).u != 0) {
+					if(!own_page(t, page)) return false;
+					memset(t->ram[page]->words, 0, sizeof(t->ram[page]->words));
+					written |= (uint32_t)1 << page;
+					break;
+				}
+			}
+		}
+	}
+
+	for(;;) {
+		uint32_t start = get_u16(&r);
+		uint32_t cnt = get_u16(&r);
+		if(cnt == 0) break;
+		for(uint32_t i = start; i < start + cnt; i++) {
+			uint32_t page = i / TNY_RAM_PAGE_SIZE;
+			if(!((t->private_pages >> page) & 1) && !own_page(t, page)) return false;
+			t->ram[page]->words[i % TNY_RAM_PAGE_SIZE].u = get_u16(&r);
+			written |= (uint32_t)1 << page;
+		}
+	}
+
+	forget_decoded_pages(t, written);
+
+	/* a clocked instance picks up its pace from the loaded cycle */
+	if(t->clock_manager.cycles_until_calibrate >= 0) {
+		resume_clock(t);
+	}
+
+	return true;
+}
+
+bool tny_fork(teenyat *parent, teenyat *child) {
+	if(!parent || !child || parent == child || !parent->initialized) return false;
+
+	*child = *parent;
+
+	/*
+	 * Nothing the parent owns is the child's until it's been copied or
+	 * referenced below, so a failed fork leaves a child tny_destroy() can
+	 * still be handed without it touching the parent.
+	 */
+	child->initialized = false;
+	child->image = NULL;
+	child->dirty_pages = 0;
+	child->private_pages = 0;
+	child->peripherals = NULL;
+	child->decode_cache = NULL;
+	child->perf = NULL;
+	child->profile = NULL;
+	child->trace = NULL;
+	child->spin = NULL;
+	child->events = NULL;
+	child->waiter = NULL;
+	child->jit = NULL;
+
+	/* the child decodes for itself, if the parent did */
+	if(parent->decode_cache && !tny_set_decode_cache(child, true)) goto fail;
+
+	/* and translates for itself, falling back on the block engine if it can't */
+	if(parent->jit) {
+		jit_create(child);
+	}
+
+	/* the child counts for itself, starting from the parent's counts */
+#ifdef TNY_PERF_COUNTERS
+	if(parent->perf) {
+		child->perf = malloc(sizeof(tny_perf));
+		if(!child->perf) goto fail;
+		memcpy(child->perf, parent->perf, sizeof(tny_perf));
+	}
+#endif
+
+	/* and samples for itself, starting from the parent's samples */
+	if(parent->profile) {
+		child->profile = malloc(sizeof(tny_profile));
+		if(!child->profile) goto fail;
+		memcpy(child->profile, parent->profile, sizeof(tny_profile));
+	}
+
+	/* and traces for itself, following on from the parent's trace */
+	if(parent->trace) {
+		trace_settle(parent);
+		size_t size = sizeof(tny_trace) + (parent->trace->mask + 1) * sizeof(tny_trace_record);
+		child->trace = malloc(size);
+		if(!child->trace) goto fail;
+		memcpy(child->trace, parent->trace, size);
+	}
+
+	/* and skips idle loops for itself, starting from the parent's statistics */
+	if(parent->spin) {
+		child->spin = malloc(sizeof(tny_spin));
+		if(!child->spin) goto fail;
+		memcpy(child->spin, parent->spin, sizeof(tny_spin));
+	}
+
+	/* and has the parent's pending events to make for itself */
+	if(parent->events && parent->events->cnt) {
+		tny_event_queue *q = parent->events;
+		child->events = calloc(1, sizeof(tny_event_queue));
+		if(!child->events) goto fail;
+		child->events->heap = malloc(q->cnt * sizeof(tny_event));
+		if(!child->events->heap) goto fail;
+		child->events->cnt = q->cnt;
+		child->events->capacity = q->cnt;
+		child->events->next_seq = q->next_seq;
+		memcpy(child->events->heap, q->heap, q->cnt * sizeof(tny_event));
+	}
+
+	if(parent->peripherals) {
+		child->peripherals = malloc(sizeof(tny_peripheral_map));
+		if(!child->peripherals) goto fail;
+		memcpy(child->peripherals, parent->peripherals, sizeof(tny_peripheral_map));
+	}
+
+	child->image = parent->image;
+	tny_image_retain(child->image);
+
+	/*
+	 * Every written page is now shared between the two, and whichever
+	 * writes to one first gets a copy of its own.
+	 */
+	uint32_t dirty = parent->dirty_pages;
+	while(dirty) {
+		uint32_t page = __builtin_ctz(dirty);
+		dirty &= dirty - 1;
+		__atomic_add_fetch(&parent->ram[page]->refs, 1, __ATOMIC_RELAXED);
+	}
+	child->dirty_pages = parent->dirty_pages;
+	parent->private_pages = 0;
+
+	child->initialized = true;
+	child->stop_requested = false;
+	/* whatever was posted is still the parent's to take */
+	child->mailbox = 0;
+	update_interrupt_attention(child);
+
+	/* the child keeps its own pace, even if the parent's is kept by a pacer */
+	if(child->clock_manager.calibrate_cycles >= 0) {
+		resume_clock(child);
+	}
+
+	return true;
+
+fail:
+	tny_destroy(child);
+	return false;
+}
+
+/*
+ * Each attached instance joins the pacer's timeline at the time and cycle it
+ * was attached, so the cycle it is due to reach is always
+ * base_cycle + (now - joined_us) * mhz.
+ */
+typedef struct tny_pacer_member {
+	teenyat *t;
+	uint64_t base_cycle;
+	uint64_t joined_us;
+	uint64_t mhz;
+} tny_pacer_member;
+
+struct tny_pacer {
+	tny_pacer_member *members;
+	size_t member_cnt;
+	size_t member_capacity;
+	/* Length of a step, in microseconds */
+	uint64_t quantum_us;
+	/* The timeline time at which the next step is due */
+	uint64_t next_step_us;
+	/* How early to wake from sleep and spin the rest of the way */
+	uint64_t spin_us;
+	/* Aggregate lag as of the end of the last step */
+	uint64_t lag_us;
+};
+
+/*
+ * Find out how late this host tends to wake from a short sleep, so the
+ * pacer spins for no longer than it has to.
+ */
+static uint64_t calibrate_sleep_overshoot(void) {
+	const int TRIAL_CNT = 5;
+	uint64_t worst = 0;
+
+	for(int i = 0; i < TRIAL_CNT; i++) {
+		uint64_t deadline = us_clock() + 200;
+		sleep_until_us(deadline);
+		uint64_t now = us_clock();
+		if(now > deadline && now - deadline > worst) {
+			worst = now - deadline;
+		}
+	}
+
+	/* a little extra for wakeups later than any seen here */
+	return worst + worst / 2 + 10;
+}
+
+tny_pacer *tny_pacer_create(uint32_t quantum_us) {
+	tny_pacer *p = calloc(1, sizeof(tny_pacer));
+	if(!p) return NULL;
+
+	p->quantum_us = quantum_us ? quantum_us : TNY_DEFAULT_PACING_QUANTUM_US;
+	p->spin_us = calibrate_sleep_overshoot();
+	if(p->spin_us > p->quantum_us) {
+		p->spin_us = p->quantum_us;
+	}
+
+	return p;
+}
+
+void tny_pacer_destroy(tny_pacer *p) {
+	if(!p) return;
+
+	while(p->member_cnt > 0) {
+		tny_pacer_detach(p, p->members[p->member_cnt - 1].t);
+	}
+	free(p->members);
+	free(p);
+
+	return;
+}
+
+bool tny_pacer_attach(tny_pacer *p, teenyat *t, uint16_t MHz) {
+	if(!p || !t) return false;
+
+	for(size_t i = 0; i < p->member_cnt; i++) {
+		if(p->members[i].t == t) return false;
+	}
+
+	if(p->member_cnt == p->member_capacity) {
+		size_t capacity = p->member_capacity ? 2 * p->member_capacity : 8;
+		tny_pacer_member *members = realloc(p->members, capacity * sizeof(tny_pacer_member));
+		if(!members) return false;
+		p->members = members;
+		p->member_capacity = capacity;
+	}
+
+	if(MHz != 0) {
+		t->clock_manager.target_mhz = MHz;
+	}
+	if(t->clock_manager.target_mhz == 0) return false;
+
+	/* the pacer does all the waiting from here on */
+	t->clock_manager.cycles_until_calibrate = -1;
+
+	tny_pacer_member *m = &(p->members[p->member_cnt++]);
+	m->t = t;
+	m->base_cycle = t->cycle_cnt;
+	m->joined_us = us_clock();
+	m->mhz = t->clock_manager.target_mhz;
+
+	return true;
+}
+
+bool tny_pacer_detach(tny_pacer *p, teenyat *t) {
+	if(!p || !t) return false;
+
+	for(size_t i = 0; i < p->member_cnt; i++) {
+		if(p->members[i].t != t) continue;
+
+		p->members[i] = p->members[--p->member_cnt];
+
+		/* Clocked instances pick their own pacing back up from right now */
+		if(t->clock_manager.calibrate_cycles >= 0) {
+			resume_clock(t);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+uint64_t tny_pacer_step(tny_pacer *p) {
+	if(!p) return 0;
+
+	/* wait out the rest of the quantum */
+	if(p->next_step_us > us_clock() + p->spin_us) {
+		sleep_until_us(p->next_step_us - p->spin_us);
+	}
+	while(us_clock() < p->next_step_us);
+
+	uint64_t now = us_clock();
+	uint64_t cycles_run = 0;
+
+	/* A step starting late leaves everyone behind by that much to begin with */
+	uint64_t late_us = (p->next_step_us > 0) ? now - p->next_step_us : 0;
+
+	p->lag_us = 0;
+	for(size_t i = 0; i < p->member_cnt; i++) {
+		tny_pacer_member *m = &(p->members[i]);
+		uint64_t due = m->base_cycle + (now - m->joined_us) * m->mhz;
+		if(m->t->cycle_cnt < due) {
+			cycles_run += tny_run(m->t, due - m->t->cycle_cnt);
+		}
+
+		p->lag_us += late_us;
+		if(m->t->cycle_cnt < due) {
+			p->lag_us += (due - m->t->cycle_cnt) / m->mhz;
+		}
+	}
+
+	/*
+	 * Keep to the quantum grid, unless the host has fallen more than a whole
+	 * quantum behind, in which case the next step is simply a quantum away.
+	 * Instances still make up any cycles they're owed, since what they're
+	 * due is always worked out from the timeline itself.
+	 */
+	uint64_t end = us_clock();
+	p->next_step_us = ((p->next_step_us > 0) ? p->next_step_us : now) + p->quantum_us;
+	if(p->next_step_us < end) {
+		p->next_step_us = end + p->quantum_us;
+	}
+
+	return cycles_run;
+}
+
+uint64_t tny_pacer_lag_us(const tny_pacer *p) {
+	if(!p) return 0;
+	return p->lag_us;
+}
+
+/*
+ * How many cycles a cluster worker runs an instance for before checking its
+ * queue again.  Long enough that queue traffic is negligible, short enough
+ * that idle workers find something to steal.
+ */
+#define TNY_CLUSTER_SLICE_CYCLES 100000
+
+typedef struct tny_cluster_job {
+	teenyat *t;
+	/* cycles left in the instance's budget */
+	uint64_t budget;
+	TNY_CLUSTER_DONE_FNPTR done;
+} tny_cluster_job;
+
+/*
+ * Each worker's queue of jobs.  The owner works from the newest end and
+ * thieves take from the oldest, so a job in progress stays put while jobs
+ * nobody has started yet get shared around.  head and tail only ever count
+ * up, and wrap into the ring of jobs by capacity.
+ */
+typedef struct tny_cluster_deque {
+	pthread_mutex_t lock;
+	tny_cluster_job *jobs;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+} tny_cluster_deque;
+
+struct tny_cluster {
+	unsigned worker_cnt;
+	tny_cluster_deque *deques;
+	/* the deque the next added job goes in */
+	unsigned next_deque;
+	/* jobs not yet complete (atomic while running) */
+	size_t pending;
+	/* atomic while running */
+	uint64_t cycles_run;
+};
+
+typedef struct tny_cluster_worker {
+	tny_cluster *c;
+	unsigned id;
+} tny_cluster_worker;
+
+static void deque_push_newest(tny_cluster_deque *q, tny_cluster_job job) {
+	pthread_mutex_lock(&q->lock);
+	q->jobs[q->tail % q->capacity] = job;
+	q->tail++;
+	pthread_mutex_unlock(&q->lock);
+
+	return;
+}
+
+static bool deque_pop_newest(tny_cluster_deque *q, tny_cluster_job *job) {
+	bool found = false;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail != q->head) {
+		q->tail--;
+		*job = q->jobs[q->tail % q->capacity];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+static bool deque_pop_oldest(tny_cluster_deque *q, tny_cluster_job *job) {
+	bool found = false;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail != q->head) {
+		*job = q->jobs[q->head % q->capacity];
+		q->head++;
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+/*
+ * Make sure every deque can hold every job at once, so a worker putting a
+ * job back, wherever it came from, never needs to allocate
+ */
+static bool cluster_reserve(tny_cluster *c, size_t job_cnt) {
+	for(unsigned i = 0; i < c->worker_cnt; i++) {
+		tny_cluster_deque *q = &(c->deques[i]);
+		if(q->capacity >= job_cnt) continue;
+
+		size_t capacity = q->capacity ? q->capacity : 16;
+		while(capacity < job_cnt) capacity *= 2;
+
+		tny_cluster_job *jobs = malloc(capacity * sizeof(tny_cluster_job));
+		if(!jobs) return false;
+
+		size_t cnt = q->tail - q->head;
+		for(size_t j = 0; j < cnt; j++) {
+			jobs[j] = q->jobs[(q->head + j) % q->capacity];
+		}
+		free(q->jobs);
+		q->jobs = jobs;
+		q->head = 0;
+		q->tail = cnt;
+		q->capacity = capacity;
+	}
+
+	return true;
+}
+
+static unsigned online_cpu_cnt(void) {
+#if defined(_WIN64) || defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cnt = (long)info.dwNumberOfProcessors;
+#else
+	long cnt = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return (cnt > 0) ? (unsigned)cnt : 1;
+}
+
+tny_cluster *tny_cluster_create(unsigned thread_cnt) {
+	tny_cluster *c = calloc(1, sizeof(tny_cluster));
+	if(!c) return NULL;
+
+	c->worker_cnt = thread_cnt ? thread_cnt : online_cpu_cnt();
+	c->deques = calloc(c->worker_cnt, sizeof(tny_cluster_deque));
+	if(!c->deques) {
+		free(c);
+		return NULL;
+	}
+
+	for(unsigned i = 0; i < c->worker_cnt; i++) {
+		pthread_mutex_init(&(c->deques[i].lock), NULL);
+	}
+
+	return c;
+}
+
+void tny_cluster_destroy(tny_cluster *c) {
+	if(!c) return;
+
+	for(unsigned i = 0; i < c->worker_cnt; i++) {
+		pthread_mutex_destroy(&(c->deques[i].lock));
+		free(c->deques[i].jobs);
+	}
+	free(c->deques);
+	free(c);
+
+	return;
+}
+
+bool tny_cluster_add(tny_cluster *c, teenyat *t, uint64_t cycle_budget,
+                     TNY_CLUSTER_DONE_FNPTR done) {
+	if(!c || !t) return false;
+
+	if(!cluster_reserve(c, c->pending + 1)) return false;
+
+	tny_cluster_job job = { .t = t, .budget = cycle_budget, .done = done };
+	deque_push_newest(&(c->deques[c->next_deque]), job);
+	c->next_deque = (c->next_deque + 1) % c->worker_cnt;
+	c->pending++;
+
+	return true;
+}
+
+/* Look through the other workers' deques for a job nobody has started */
+static bool cluster_steal(tny_cluster *c, unsigned thief, tny_cluster_job *job) {
+	for(unsigned i = 1; i < c->worker_cnt; i++) {
+		if(deque_pop_oldest(&(c->deques[(thief + i) % c->worker_cnt]), job)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void *cluster_work(void *arg) {
+	tny_cluster_worker *w = arg;
+	tny_cluster *c = w->c;
+	tny_cluster_deque *own = &(c->deques[w->id]);
+
+	while(__atomic_load_n(&c->pending, __ATOMIC_ACQUIRE) > 0) {
+		tny_cluster_job job;
+		if(!deque_pop_newest(own, &job) && !cluster_steal(c, w->id, &job)) {
+			/* whatever is left is already being run, so wait for it */
+			sleep_until_us(us_clock() + 100);
+			continue;
+		}
+
+		uint64_t slice = (job.budget < TNY_CLUSTER_SLICE_CYCLES) ? job.budget : TNY_CLUSTER_SLICE_CYCLES;
+		uint64_t ran = tny_run(job.t, slice);
+		job.budget -= ran;
+		__atomic_add_fetch(&c->cycles_run, ran, __ATOMIC_RELAXED);
+
+		/* tny_run() leaves the stop request in place when it ends a run early */
+		bool halted = job.t->stop_requested;
+		if(halted || job.budget == 0) {
+			if(job.done) {
+				job.done(job.t, halted);
+			}
+			__atomic_sub_fetch(&c->pending, 1, __ATOMIC_RELEASE);
+		}
+		else {
+			deque_push_newest(own, job);
+		}
+	}
+
+	return NULL;
+}
+
+uint64_t tny_cluster_run(tny_cluster *c) {
+	if(!c) return 0;
+
+	tny_cluster_worker *workers = calloc(c->worker_cnt, sizeof(tny_cluster_worker));
+	pthread_t *threads = calloc(c->worker_cnt, sizeof(pthread_t));
+	bool *started = calloc(c->worker_cnt, sizeof(bool));
+	if(!workers || !threads || !started) {
+		free(workers);
+		free(threads);
+		free(started);
+		return 0;
+	}
+
+	c->cycles_run = 0;
+
+	/*
+	 * The caller is worker 0.  Should any other thread fail to start, its
+	 * jobs simply get stolen by those that did.
+	 */
+	for(unsigned i = 0; i < c->worker_cnt; i++) {
+		workers[i].c = c;
+		workers[i].id = i;
+		if(i > 0) {
+			started[i] = (pthread_create(&threads[i], NULL, cluster_work, &workers[i]) == 0);
+		}
+	}
+
+	cluster_work(&workers[0]);
+
+	for(unsigned i = 1; i < c->worker_cnt; i++) {
+		if(started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	free(workers);
+	free(threads);
+	free(started);
+
+	return c->cycles_run;
+}
+
+/*
+ * One step of the PCG-XSH-RR generator behind tny_random(), on a bare state
+ * so the lockstep engine can step many at once.
+ */
+static inline tny_uword pcg_next(uint64_t *state, uint64_t increment) {
+	uint64_t tmp = *state;
+
+	/*
+	 * Find the next state in the sequence.  The weird large immediate value
+	 * is a special constant chosen by the world at large to do great
+	 * things for the random number. ... We don't really know about it,
+	 * but it seems to work ;-)
+	 */
+	*state = tmp * 6364136223846793005ULL + increment;
+
+	/*
+	 * The code below involves some shifts of seemingly random amounts.
+	 * They determine the amounts of manipulation of 64 and 16 bit values.
+	 * 27 = 32 - 5
+	 * 18 = floor((64 - 27) / 2)
+	 * 59 = 64 - 5
+	 */
+
+	/* use top 5 bits of previous state to "randomly" rotate */
+	unsigned bitcnt_to_rotate = tmp >> 59;
+
+	/* scramble the previous state and truncate to 16 bits */
+	uint32_t to_rotate = (tmp >> 18 ^ tmp) >> 27;
+
+	/* return the right-rotated the scrambled previous state */
+	uint32_t result = to_rotate >> bitcnt_to_rotate;
+	/* the bitmask below ensures the left shift is fewer than 32 bits */
+	result |= to_rotate << (-bitcnt_to_rotate & ~(~0U << 5));
+
+	/* truncate result and return as 16-bit tny_uword */
+	return (tny_uword)result;
+}
+
+tny_uword tny_random(teenyat *t) {
+	return pcg_next(&(t->random.state), t->random.increment);
+}
+
+/*
+ * The lockstep engine.  Lanes that are at the same PC, with the same delay
+ * left and the same code in front of them, form the group.  The group's
+ * registers, flags and random number states are kept structure-of-arrays
+ * style, one entry per lane, so every instruction is decoded once and then
+ * carried out for all lanes by a tight loop the compiler can vectorize.
+ * Shared delay cycles are let go for the whole group at once.  Anything the
+ * group can't do together (CAL, DLY, INT, RTI, on-board and peripheral
+ * accesses, interrupts) breaks the group up, and every lane runs one cycle on
+ * its own.  Lanes whose branches go another way leave the group and run on
+ * their own cycle for cycle with it, rejoining whenever they line up again.
+ */
+
+/* The most cycles lanes run on their own between checks for a new group */
+#define TNY_LOCKSTEP_MAX_CHUNK 256
+
+struct tny_lockstep {
+	unsigned lane_cnt;
+	teenyat **lanes;
+	/*
+	 * The state of the lanes in the group.  Entries of lanes outside the
+	 * group are leftovers the loops are free to compute on, as nothing ever
+	 * reads them back.
+	 */
+	tny_sword *reg[TNY_REG_E + 1];
+	bool *carry;
+	bool *equals;
+	bool *less;
+	bool *greater;
+	uint64_t *random_state;
+	uint64_t *random_increment;
+	/* each lane's effective address for the instruction at hand */
+	tny_uword *addr;
+	bool *in_group;
+	/* lanes that have stopped for the rest of this run */
+	bool *done;
+	/* cycles each lane outside the group has run this run */
+	uint64_t *ran;
+	/* the value of now when each lane in the group joined it */
+	uint64_t *joined;
+	unsigned group_cnt;
+	/* the lane in the group whose code and PC the others follow */
+	unsigned leader;
+	uint64_t group_delay;
+	/* cycles the group has run this run */
+	uint64_t now;
+};
+
+tny_lockstep *tny_lockstep_create(teenyat **lanes, unsigned lane_cnt) {
+	if(!lanes || lane_cnt == 0) return NULL;
+	for(unsigned i = 0; i < lane_cnt; i++) {
+		if(!lanes[i]) return NULL;
 	}
 
-	/* clear interrupts if interrupt clearing is enabled */
-	if(IC) {
-		t->interrupt_queue_register.u &= IER;
+	tny_lockstep *ls = calloc(1, sizeof(tny_lockstep));
+	if(!ls) return NULL;
+
+	ls->lane_cnt = lane_cnt;
+	ls->lanes = malloc(lane_cnt * sizeof(teenyat *));
+	bool ok = (ls->lanes != NULL);
+	for(unsigned r = 0; r <= TNY_REG_E; r++) {
+		ok = ok && (ls->reg[r] = calloc(lane_cnt, sizeof(tny_sword))) != NULL;
+	}
+	ok = ok && (ls->carry = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->equals = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->less = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->greater = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->random_state = calloc(lane_cnt, sizeof(uint64_t))) != NULL;
+	ok = ok && (ls->random_increment = calloc(lane_cnt, sizeof(uint64_t))) != NULL;
+	ok = ok && (ls->addr = calloc(lane_cnt, sizeof(tny_uword))) != NULL;
+	ok = ok && (ls->in_group = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->done = calloc(lane_cnt, sizeof(bool))) != NULL;
+	ok = ok && (ls->ran = calloc(lane_cnt, sizeof(uint64_t))) != NULL;
+	ok = ok && (ls->joined = calloc(lane_cnt, sizeof(uint64_t))) != NULL;
+	if(!ok) {
+		tny_lockstep_destroy(ls);
+		return NULL;
+	}
+
+	memcpy(ls->lanes, lanes, lane_cnt * sizeof(teenyat *));
+
+	return ls;
+}
+
+void tny_lockstep_destroy(tny_lockstep *ls) {
+	if(!ls) return;
+
+	free(ls->lanes);
+	for(unsigned r = 0; r <= TNY_REG_E; r++) {
+		free(ls->reg[r]);
 	}
+	free(ls->carry);
+	free(ls->equals);
+	free(ls->less);
+	free(ls->greater);
+	free(ls->random_state);
+	free(ls->random_increment);
+	free(ls->addr);
+	free(ls->in_group);
+	free(ls->done);
+	free(ls->ran);
+	free(ls->joined);
+	free(ls);
 
 	return;
 }
 
-void tny_clock(teenyat *t) {
-	/* Setup clock timing on first cycle */
-	if(t->cycle_cnt == 0){
-		t->clock_manager.epoch = us_clock();
-		t->clock_manager.last_calibration_time = t->clock_manager.epoch;
+static void lockstep_gather(tny_lockstep *ls, unsigned i) {
+	teenyat *t = ls->lanes[i];
+
+	for(unsigned r = 0; r <= TNY_REG_E; r++) {
+		ls->reg[r][i] = t->reg[r].s;
 	}
+	ls->carry[i] = t->flags.carry;
+	ls->equals[i] = t->flags.equals;
+	ls->less[i] = t->flags.less;
+	ls->greater[i] = t->flags.greater;
+	ls->random_state[i] = t->random.state;
+	ls->random_increment[i] = t->random.increment;
 
-	t->cycle_cnt++;
+	ls->joined[i] = ls->now;
+	ls->in_group[i] = true;
+	ls->group_cnt++;
 
-	/*
-	 * If there were still cycles left on the previous instruction, skip
-	 * everything else for now, and let those expire.
-	 */
-	if(t->delay_cycles) {
-		t->delay_cycles--;
-	}else{
-		/*
-		 * All instruction fetches are limited to the range 0x0000 through 0x7FFF.
-		 * Modifications to the PC are always truncated to that range.  As such,
-		 * an unusual circumstance could arrive where a two-word instruction begins
-		 * at 0x7FFF and has its second word retrieved from 0x0000.  This almost
-		 * certainly not something anyone would want, but it's how it works :-)
-		 */
+	return;
+}
 
-		handle_interrupts(t);
+static void lockstep_scatter(tny_lockstep *ls, unsigned i) {
+	teenyat *t = ls->lanes[i];
+
+	for(unsigned r = 0; r <= TNY_REG_E; r++) {
+		t->reg[r].s = ls->reg[r][i];
+	}
+	t->flags.carry = ls->carry[i];
+	t->flags.equals = ls->equals[i];
+	t->flags.less = ls->less[i];
+	t->flags.greater = ls->greater[i];
+	t->random.state = ls->random_state[i];
+
+	t->delay_cycles = ls->group_delay;
+	t->cycle_cnt += ls->now - ls->joined[i];
+	ls->ran[i] = ls->now;
+	ls->in_group[i] = false;
+	ls->group_cnt--;
+
+	/* hand the lead to whoever is left */
+	if(i == ls->leader) {
+		for(unsigned j = 0; j < ls->lane_cnt; j++) {
+			if(ls->in_group[j]) {
+				ls->leader = j;
+				break;
+			}
+		}
+	}
+
+	return;
+}
+
+static void lockstep_dissolve(tny_lockstep *ls) {
+	for(unsigned i = 0; i < ls->lane_cnt && ls->group_cnt > 0; i++) {
+		if(ls->in_group[i]) {
+			lockstep_scatter(ls, i);
+		}
+	}
 
-		trunc_pc(t);
+	return;
+}
+
+static bool lockstep_all_done(const tny_lockstep *ls) {
+	for(unsigned i = 0; i < ls->lane_cnt; i++) {
+		if(!ls->done[i]) return false;
+	}
 
-		tny_uword orig_PC = t->reg[TNY_REG_PC].u;  // backup for error reporting
+	return true;
+}
 
-		tny_word IR = t->ram[t->reg[TNY_REG_PC].u];
-		inc_pc(t);
-		tny_sword immed = t->ram[t->reg[TNY_REG_PC].u].s;
-		inc_pc(t);
+/* Bring every lane that has lined up with the group into it */
+static void lockstep_merge(tny_lockstep *ls) {
+	for(unsigned i = 0; i < ls->lane_cnt; i++) {
+		if(ls->in_group[i] || ls->done[i]) continue;
 
-		tny_uword opcode = IR.instruction.opcode;
-		bool teeny = IR.instruction.teeny;
-		tny_uword reg1 = IR.instruction.reg1;
-		tny_uword reg2 = IR.instruction.reg2;
-		bool carry = IR.inst_flags.carry;
-		bool equals = IR.inst_flags.equals;
-		bool less = IR.inst_flags.less;
-		bool greater = IR.inst_flags.greater;
+		teenyat *t = ls->lanes[i];
+		/* counting, profiled and traced lanes run on their own, so nothing is missed */
+		if(t->perf || t->profile || t->trace) continue;
+		/* as do those skipping idle loops, which only tny_run() can bound */
+		if(t->spin) continue;
+		/* and those with events to make between cycles */
+		if(t->events && t->events->cnt) continue;
+		/* and those waiting for an interrupt, which the group can't look for */
+		if(waiting(t)) continue;
 
-		if(teeny) {
-			/*
-			 * This is a single word instruction encoding
-			 */
-			dec_pc(t);
-			immed = IR.instruction.immed4;
+		if(ls->group_cnt == 0) {
+			ls->leader = i;
+			ls->group_delay = t->delay_cycles;
+			lockstep_gather(ls, i);
 		}
-		else {
-			/* double word instructions cost one extra cycle */
-			t->delay_cycles++;
+		else if(t->reg[TNY_REG_PC].s == ls->reg[TNY_REG_PC][ls->leader] &&
+		        t->delay_cycles == ls->group_delay) {
+			lockstep_gather(ls, i);
 		}
+	}
 
-		/*
-		 * EXECUTE
-		 */
+	return;
+}
 
-		uint32_t tmp;  /* for quick use to determine carry */
+/* Whether handle_interrupts() would leave the instance exactly as it is */
+static inline bool interrupts_quiet(const teenyat *t) {
+	return __atomic_load_n(&t->mailbox, __ATOMIC_RELAXED) == 0;
+}
 
-		switch(opcode) {
-		case TNY_OPCODE_SET:
-			t->reg[reg1].s = t->reg[reg2].s + immed;
-			break;
-		case TNY_OPCODE_LOD:
-			{
-				t->delay_cycles += TNY_BUS_DELAY;
+/* Instructions the group can carry out together, given suitable addresses */
+static inline bool lockstep_safe(const tny_decoded *d) {
+	switch(d->opcode) {
+	case TNY_OPCODE_CAL:
+	case TNY_OPCODE_DLY:
+	case TNY_OPCODE_INT:
+	case TNY_OPCODE_RTI:
+		return false;
+	default:
+		return d->opcode <= TNY_OPCODE_RTI;
+	}
+}
 
-				tny_uword addr = t->reg[reg2].s + immed;
-				switch(addr) {
-				case TNY_PORTA_ADDRESS:
-					t->reg[reg1] = t->port_a;
-					break;
-				case TNY_PORTB_ADDRESS:
-					t->reg[reg1] = t->port_b;
-					break;
-				case TNY_PORTA_DIR_ADDRESS:
-					t->reg[reg1] = t->port_a_directions;
-					break;
-				case TNY_PORTB_DIR_ADDRESS:
-					t->reg[reg1] = t->port_b_directions;
-					break;
-				case TNY_RANDOM_ADDRESS:
-					t->reg[reg1].u = tny_random(t) & ((1 << 15) - 1);
-					break;
-				case TNY_RANDOM_BITS_ADDRESS:
-					t->reg[reg1].u = tny_random(t);
-					break;
-				case TNY_CONTROL_STATUS_REGISTER:
-					t->reg[reg1] = t->control_status_register;
-					break;
-				case TNY_INTERRUPT_ENABLE_REGISTER:
-					t->reg[reg1] = t->interrupt_enable_register;
-					break;
-				case TNY_INTERRUPT_QUEUE_REGISTER:
-					t->reg[reg1] = t->interrupt_queue_register;
-					break;
-				default:
-					/* Check if reading from interrupt service */
-					if(addr >= TNY_INTERRUPT_VECTOR_TABLE_START &&
-					   addr <= TNY_INTERRUPT_VECTOR_TABLE_END
-					  ) {
-						t->reg[reg1] = t->interrupt_vector_table[addr - TNY_INTERRUPT_VECTOR_TABLE_START];
-					}
-					else if(addr >= TNY_PERIPHERAL_BASE_ADDRESS) {
-						/* read from peripheral address */
-						t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
-
-						tny_word data = {.u = 0};
-						uint16_t delay = 0;
-						t->bus_read(t, addr, &data, &delay);
-						t->reg[reg1] = data;
-						t->delay_cycles += delay;
-					}
-					else if(addr <= TNY_MAX_RAM_ADDRESS) {
-						/* read from RAM */
-						t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+static inline void lane_set_elg_flags(tny_lockstep *ls, unsigned i, tny_sword alu_result) {
+	ls->equals[i]  = (alu_result == 0);
+	ls->less[i]    = (alu_result >> 15) & 1;
+	ls->greater[i] = (alu_result > 0);
 
-						t->reg[reg1] = t->ram[addr];
-					}
-					else {
-						/* 
-						 * This is an attempt to access an unaccounted for
-						 * address in the "Microcontroller Device Space".
-						 */
-					}
-					break;
-				}
-			}
-			break;
-		case TNY_OPCODE_STR:
-			{
-				/*
-				 * To promote student use of registers, all bus operations,
-				 * including RAM access comes with an extra penalty.
-				 */
-				t->delay_cycles += TNY_BUS_DELAY;
-
-				tny_uword addr = t->reg[reg1].s + immed;
-				switch(addr) {
-				case TNY_PORTA_ADDRESS:
-					tny_modify_port_levels(t, false, t->reg[reg2], true);
-					break;
-				case TNY_PORTB_ADDRESS:
-					tny_modify_port_levels(t, false, t->reg[reg2], false);
-					break;
-				case TNY_PORTA_DIR_ADDRESS:
-					t->port_a_directions = t->reg[reg2];
-					break;
-				case TNY_PORTB_DIR_ADDRESS:
-					t->port_b_directions = t->reg[reg2];
-					break;
-				case TNY_RANDOM_ADDRESS:
-					/* Do nothing */
-					break;
-				case TNY_RANDOM_BITS_ADDRESS:
-					/* Do nothing */
-					break;
-				case TNY_CONTROL_STATUS_REGISTER:
-					t->control_status_register = t->reg[reg2];
-					break;
-				case TNY_INTERRUPT_ENABLE_REGISTER:
-					t->interrupt_enable_register = t->reg[reg2];
-					break;
-				case TNY_INTERRUPT_QUEUE_REGISTER:
-					t->interrupt_queue_register = t->reg[reg2];
-					break;
-				default:
-					/* Check if writing to interrupt service */
-					if(addr >= TNY_INTERRUPT_VECTOR_TABLE_START &&
-					   addr <= TNY_INTERRUPT_VECTOR_TABLE_END
-					  ) {
-						t->interrupt_vector_table[addr - TNY_INTERRUPT_VECTOR_TABLE_START] = t->reg[reg2];
-					}
-					else if(addr >= TNY_PERIPHERAL_BASE_ADDRESS) {
-						/* write to peripheral address */
-						t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+	return;
+}
 
-						uint16_t delay = 0;
-						t->bus_write(t, addr, t->reg[reg2], &delay);
-						t->delay_cycles += delay;
-					}
-					else if(addr <= TNY_MAX_RAM_ADDRESS) {
-						/* write to RAM */
-						t->delay_cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+/*
+ * Carry out one instruction for every lane.  Each case mirrors its exec_*()
+ * counterpart.
+ */
+static void lockstep_execute(tny_lockstep *ls, const tny_decoded *d) {
+	const unsigned K = ls->lane_cnt;
+	tny_sword *r1 = ls->reg[d->reg1];
+	tny_sword *r2 = ls->reg[d->reg2];
+	tny_sword *sp = ls->reg[TNY_REG_SP];
+	tny_sword *pc = ls->reg[TNY_REG_PC];
+	tny_sword immed = d->immed;
 
-						t->ram[addr] = t->reg[reg2];
-					}
-					else {
-						/* 
-						 * This is an attempt to access an unaccounted for
-						 * address in the "Microcontroller Device Space".
-						 */
-					}
-					break;
-				}
-			}
-			break;
-		case TNY_OPCODE_PSH:
-			t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
-			t->ram[t->reg[TNY_REG_SP].u].u = t->reg[reg2].s + immed;
-			t->reg[TNY_REG_SP].u--;
-			t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
-			/*
-			 * To promote student use of registers, all bus operations,
-			 * including RAM access comes with an extra penalty.
-			 */
-			t->delay_cycles += TNY_BUS_DELAY;
-			break;
-		case TNY_OPCODE_POP:
-			t->reg[TNY_REG_SP].u++;
-			t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
-			t->reg[reg1] = t->ram[t->reg[TNY_REG_SP].u];
-			/*
-			 * To promote student use of registers, all bus operations,
-			 * including RAM access comes with an extra penalty.
-			 */
-			t->delay_cycles += TNY_BUS_DELAY;
-			break;
-		case TNY_OPCODE_BTS:
-			{
-				tny_sword bit = t->reg[reg2].s + immed;
-				if(bit >= 0 && bit <= 15) {
-					t->reg[reg1].s |= (1 << bit);
-					set_elg_flags(t, t->reg[reg1].s);
-				}
+	switch(d->opcode) {
+	case TNY_OPCODE_SET:
+		for(unsigned i = 0; i < K; i++) {
+			r1[i] = r2[i] + immed;
+		}
+		break;
+	case TNY_OPCODE_LOD:
+		if(ls->addr[ls->leader] <= TNY_MAX_RAM_ADDRESS) {
+			for(unsigned i = 0; i < K; i++) {
+				r1[i] = ram_read(ls->lanes[i], ls->addr[i] & TNY_MAX_RAM_ADDRESS).s;
 			}
-			break;
-		case TNY_OPCODE_BTC:
-			{
-				tny_sword bit = t->reg[reg2].s + immed;
-				if(bit >= 0 && bit <= 15) {
-					t->reg[reg1].s &= ~(1 << bit);
-					set_elg_flags(t, t->reg[reg1].s);
+		}
+		else {
+			for(unsigned i = 0; i < K; i++) {
+				tny_uword addr = ls->addr[i];
+				if(addr == TNY_RANDOM_ADDRESS || addr == TNY_RANDOM_BITS_ADDRESS) {
+					tny_uword bits = pcg_next(&(ls->random_state[i]), ls->random_increment[i]);
+					if(addr == TNY_RANDOM_ADDRESS) {
+						bits &= (1 << 15) - 1;
+					}
+					r1[i] = (tny_sword)bits;
 				}
-			}
-			break;
-		case TNY_OPCODE_BTF:
-			{
-				tny_sword bit = t->reg[reg2].s + immed;
-				if(bit >= 0 && bit <= 15) {
-					t->reg[reg1].s ^= (1 << bit);
-					set_elg_flags(t, t->reg[reg1].s);
+				else {
+					tny_word data = {.s = r1[i]};
+					read_onboard(ls->lanes[i], addr, &data);
+					r1[i] = data.s;
 				}
 			}
-			break;
-		case TNY_OPCODE_CAL:
-			t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
-			t->ram[t->reg[TNY_REG_SP].u] = t->reg[TNY_REG_PC];
-			t->reg[TNY_REG_SP].u--;
-			t->reg[TNY_REG_SP].u &= TNY_MAX_RAM_ADDRESS;
-			set_pc(t, t->reg[reg2].s + immed);
-			/*
-			 * To promote student use of registers, all bus operations,
-			 * including RAM access comes with an extra penalty.
-			 */
-			t->delay_cycles += TNY_BUS_DELAY;
-			break;
-		case TNY_OPCODE_ADD:
-			tmp = (uint32_t)(t->reg[reg1].s) + (uint32_t)((uint32_t)(t->reg[reg2].s) + (uint32_t)immed);
-			t->flags.carry = tmp & (1 << 16);
-			t->reg[reg1].s = tmp;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_SUB:
-			tmp = (uint32_t)(t->reg[reg1].s) - (uint32_t)((uint32_t)(t->reg[reg2].s) + (uint32_t)immed);
-			t->flags.carry = tmp & (1 << 16);
-			t->reg[reg1].s = tmp;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_MPY:
-			tmp = (uint32_t)(t->reg[reg1].s) * (uint32_t)((uint32_t)(t->reg[reg2].s) + (uint32_t)immed);
-			t->flags.carry = tmp & (1 << 16);
-			t->reg[reg1].s = tmp;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_DIV:
-			if(t->reg[reg2].s + immed != 0) {
-				t->reg[reg1].s /= t->reg[reg2].s + immed;
-				set_elg_flags(t, t->reg[reg1].s);
-			}
-			else {
-				/* No behavior defined on divide-by-zero */
+		}
+		break;
+	case TNY_OPCODE_STR:
+		for(unsigned i = 0; i < K; i++) {
+			if(ls->in_group[i]) {
+				tny_word data = {.s = r2[i]};
+				ram_write(ls->lanes[i], ls->addr[i], data);
 			}
-			break;
-		case TNY_OPCODE_MOD:
-			if(t->reg[reg2].s + immed != 0) {
-				t->reg[reg1].s %= t->reg[reg2].s + immed;
-				set_elg_flags(t, t->reg[reg1].s);
+		}
+		break;
+	case TNY_OPCODE_PSH:
+		for(unsigned i = 0; i < K; i++) {
+			if(ls->in_group[i]) {
+				sp[i] = (tny_uword)sp[i] & TNY_MAX_RAM_ADDRESS;
+				tny_word data = {.s = r2[i] + immed};
+				ram_write(ls->lanes[i], (tny_uword)sp[i], data);
+				sp[i] = ((tny_uword)sp[i] - 1) & TNY_MAX_RAM_ADDRESS;
 			}
-			else {
-				/* No behavior defined on divide-by-zero */
+		}
+		break;
+	case TNY_OPCODE_POP:
+		for(unsigned i = 0; i < K; i++) {
+			sp[i] = ((tny_uword)sp[i] + 1) & TNY_MAX_RAM_ADDRESS;
+			r1[i] = ram_read(ls->lanes[i], (tny_uword)sp[i]).s;
+		}
+		break;
+	case TNY_OPCODE_BTS:
+	case TNY_OPCODE_BTC:
+	case TNY_OPCODE_BTF:
+		for(unsigned i = 0; i < K; i++) {
+			tny_sword bit = r2[i] + immed;
+			if(bit >= 0 && bit <= 15) {
+				if(d->opcode == TNY_OPCODE_BTS) r1[i] |= (1 << bit);
+				else if(d->opcode == TNY_OPCODE_BTC) r1[i] &= ~(1 << bit);
+				else r1[i] ^= (1 << bit);
+				lane_set_elg_flags(ls, i, r1[i]);
 			}
-			break;
-		case TNY_OPCODE_AND:
-			t->reg[reg1].s &= t->reg[reg2].s + immed;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_OR:
-			t->reg[reg1].s |= t->reg[reg2].s + immed;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_XOR:
-			t->reg[reg1].s ^= t->reg[reg2].s + immed;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_SHF:
-			{
-				tny_sword bits_to_shift = t->reg[reg2].s + immed;
-				if(bits_to_shift < 0) {
-					/* shift left */
-					bits_to_shift *= -1;
-					if(bits_to_shift <= 15) {
-						t->reg[reg1].u <<= bits_to_shift - 1;
-						t->flags.carry = (t->reg[reg1].u >> 15) & 1;
-						t->reg[reg1].u <<= 1;
-					}
-					else {
-						if(bits_to_shift == 16) {
-							t->flags.carry = t->reg[reg1].u & (1 << 0);
-						}
-						else {
-							t->flags.carry = 0;
-						}
-						t->reg[reg1].u = 0;
-					}
-				}
-				else if(bits_to_shift > 0) {
-					/* shift right */
-					if(bits_to_shift <= 15) {
-						t->reg[reg1].u >>= bits_to_shift - 1;
-						t->flags.carry = t->reg[reg1].u & (1 << 0);
-						t->reg[reg1].u >>= 1;
-					}
-					else {
-						if(bits_to_shift == 16) {
-							t->flags.carry = (t->reg[reg1].u >> 15) & 1;
-						}
-						else {
-							t->flags.carry = 0;
-						}
-						t->reg[reg1].u = 0;
-					}
-				}
-				set_elg_flags(t, t->reg[reg1].s);
+		}
+		break;
+	case TNY_OPCODE_ADD:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)r1[i] + (uint32_t)((uint32_t)r2[i] + (uint32_t)immed);
+			ls->carry[i] = (tmp >> 16) & 1;
+			r1[i] = tmp;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_SUB:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)r1[i] - (uint32_t)((uint32_t)r2[i] + (uint32_t)immed);
+			ls->carry[i] = (tmp >> 16) & 1;
+			r1[i] = tmp;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_MPY:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)r1[i] * (uint32_t)((uint32_t)r2[i] + (uint32_t)immed);
+			ls->carry[i] = (tmp >> 16) & 1;
+			r1[i] = tmp;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_DIV:
+		for(unsigned i = 0; i < K; i++) {
+			if(r2[i] + immed != 0) {
+				r1[i] /= r2[i] + immed;
+				lane_set_elg_flags(ls, i, r1[i]);
 			}
-			break;
-		case TNY_OPCODE_ROT:
-			{
-				/* calculate remainder as rotate could go around many times */
-				tny_sword bits_to_rotate = (t->reg[reg2].s + immed) % 16;
-				if(bits_to_rotate < 0) {
-					/* rotate left */
-					bits_to_rotate *= -1;
-					tny_uword main_part = t->reg[reg1].u << bits_to_rotate;
-					tny_uword wrap_part = t->reg[reg1].u >> (16 - bits_to_rotate);
-					t->reg[reg1].u = main_part | wrap_part;
-					t->flags.carry = t->reg[reg1].u & (1 << 0);
-				}
-				else if(bits_to_rotate > 0) {
-					/* rotate right */
-					tny_uword main_part = t->reg[reg1].u >> bits_to_rotate;
-					tny_uword wrap_part = t->reg[reg1].u << (16 - bits_to_rotate);
-					t->reg[reg1].u = main_part | wrap_part;
-					t->flags.carry = (t->reg[reg1].u >> 15) & 1;
-				}
-				set_elg_flags(t, t->reg[reg1].s);
+		}
+		break;
+	case TNY_OPCODE_MOD:
+		for(unsigned i = 0; i < K; i++) {
+			if(r2[i] + immed != 0) {
+				r1[i] %= r2[i] + immed;
+				lane_set_elg_flags(ls, i, r1[i]);
 			}
-			break;
-		case TNY_OPCODE_NEG:
-			tmp = (uint32_t)0 - (uint32_t)(t->reg[reg1].s);
-			t->flags.carry = tmp & (1 << 16);
-			t->reg[reg1].s = tmp;
-			set_elg_flags(t, t->reg[reg1].s);
-			break;
-		case TNY_OPCODE_CMP:
-			tmp = (uint32_t)(t->reg[reg1].s) - (uint32_t)((uint32_t)(t->reg[reg2].s) + (uint32_t)immed);
-			t->flags.carry = tmp & (1 << 16);
-			set_elg_flags(t, (tny_sword)tmp);
-			break;
-		case TNY_OPCODE_JMP:
-			{
-				bool flags_checked = false;
-				bool condition_satisfied = false;
-				if(carry) {
-					flags_checked = true;
-					condition_satisfied |= t->flags.carry;
-				}
-				if(equals) {
-					flags_checked = true;
-					condition_satisfied |= t->flags.equals;
-				}
-				if(less) {
-					flags_checked = true;
-					condition_satisfied |= t->flags.less;
-				}
-				if(greater) {
-					flags_checked = true;
-					condition_satisfied |= t->flags.greater;
-				}
-				if(!flags_checked || condition_satisfied) {
-					set_pc(t, t->reg[reg1].s + immed);
-				}
+		}
+		break;
+	case TNY_OPCODE_AND:
+		for(unsigned i = 0; i < K; i++) {
+			r1[i] &= r2[i] + immed;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_OR:
+		for(unsigned i = 0; i < K; i++) {
+			r1[i] |= r2[i] + immed;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_XOR:
+		for(unsigned i = 0; i < K; i++) {
+			r1[i] ^= r2[i] + immed;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_SHF:
+		for(unsigned i = 0; i < K; i++) {
+			bool carry = ls->carry[i];
+			r1[i] = alu_shf((tny_uword)r1[i], r2[i] + immed, &carry);
+			ls->carry[i] = carry;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_ROT:
+		for(unsigned i = 0; i < K; i++) {
+			bool carry = ls->carry[i];
+			r1[i] = alu_rot((tny_uword)r1[i], r2[i] + immed, &carry);
+			ls->carry[i] = carry;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_NEG:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)0 - (uint32_t)r1[i];
+			ls->carry[i] = (tmp >> 16) & 1;
+			r1[i] = tmp;
+			lane_set_elg_flags(ls, i, r1[i]);
+		}
+		break;
+	case TNY_OPCODE_CMP:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)r1[i] - (uint32_t)((uint32_t)r2[i] + (uint32_t)immed);
+			ls->carry[i] = (tmp >> 16) & 1;
+			lane_set_elg_flags(ls, i, (tny_sword)tmp);
+		}
+		break;
+	case TNY_OPCODE_JMP: {
+		tny_word cond = {.u = d->cond};
+		bool check_c = cond.inst_flags.carry;
+		bool check_e = cond.inst_flags.equals;
+		bool check_l = cond.inst_flags.less;
+		bool check_g = cond.inst_flags.greater;
+		bool flags_checked = check_c || check_e || check_l || check_g;
+		for(unsigned i = 0; i < K; i++) {
+			bool condition_satisfied = (check_c && ls->carry[i]) ||
+			                           (check_e && ls->equals[i]) ||
+			                           (check_l && ls->less[i]) ||
+			                           (check_g && ls->greater[i]);
+			if(!flags_checked || condition_satisfied) {
+				pc[i] = (tny_uword)(r1[i] + immed) & TNY_MAX_RAM_ADDRESS;
 			}
-			break;
-		case TNY_OPCODE_LUP:
-			tmp = (uint32_t)(t->reg[reg1].s) - 1;
-			t->flags.carry = tmp & (1 << 16);
-			t->reg[reg1].s = tmp;
-			set_elg_flags(t, (tny_sword)tmp);
+		}
+		break;
+	}
+	case TNY_OPCODE_LUP:
+		for(unsigned i = 0; i < K; i++) {
+			uint32_t tmp = (uint32_t)r1[i] - 1;
+			ls->carry[i] = (tmp >> 16) & 1;
+			r1[i] = tmp;
+			lane_set_elg_flags(ls, i, (tny_sword)tmp);
 			if(tmp != 0) {
-				set_pc(t, t->reg[reg2].s + immed);
-			}
-			break;
-		case TNY_OPCODE_DLY:
-			{
-				tny_uword delay_prescale = t->reg[reg1].u;
-				if(delay_prescale == 0) {
-					delay_prescale = 1;
-				}
-				tny_uword delay_cnt = (tny_uword)(t->reg[reg2].s + immed);
-				uint64_t prescaled_delay_cycles = delay_prescale * delay_cnt;
-				if(prescaled_delay_cycles >= 1) {
-					/* current instruction already 1 cycle */
-					t->delay_cycles += prescaled_delay_cycles - 1;
-				}
+				pc[i] = (tny_uword)(r2[i] + immed) & TNY_MAX_RAM_ADDRESS;
 			}
-			break;
-		case TNY_OPCODE_INT:
-			{
-				tny_sword interrupt_number = t->reg[reg2].s + immed;
-
-				/*
-				 * Make a mask with a 1 in the position of the interrupt number
-				 *
-				 * interrupt > 15 are wrapped
-				 */
-				tny_uword interrupt_mask = 1U << (interrupt_number % 16);
-				/* mask in the interrupt into the upper half of our iqr */
-				t->interrupt_queue_register.u |= interrupt_mask;
+		}
+		break;
+	}
+
+	if(d->reg1 == TNY_REG_ZERO) {
+		memset(ls->reg[TNY_REG_ZERO], 0, K * sizeof(tny_sword));
+	}
+
+	return;
+}
+
+/*
+ * Have the group carry out the instruction at its PC together, as
+ * begin_instruction() and execute_decoded() would for each lane.  Returns
+ * false, having changed nothing, if the group can't.
+ */
+static bool lockstep_step(tny_lockstep *ls) {
+	const unsigned K = ls->lane_cnt;
+
+	/*
+	 * Other threads may post to any lane at any time, so every lane's
+	 * mailbox is looked at before every step.  Anything there is taken
+	 * with the lanes stepped on their own.
+	 */
+	for(unsigned i = 0; i < K; i++) {
+		if(ls->in_group[i] && !interrupts_quiet(ls->lanes[i])) return false;
+	}
+
+	teenyat *leader = ls->lanes[ls->leader];
+	tny_uword orig_PC = (tny_uword)ls->reg[TNY_REG_PC][ls->leader] & TNY_MAX_RAM_ADDRESS;
+	tny_decoded scratch;
+	tny_decoded d = *fetch_instruction(leader, orig_PC, &scratch);
+	if(!lockstep_safe(&d)) return false;
+
+	uint64_t cycles = d.cycles;
+	tny_uword next_PC = (orig_PC + d.length) & TNY_MAX_RAM_ADDRESS;
+
+	if(d.opcode == TNY_OPCODE_LOD || d.opcode == TNY_OPCODE_STR) {
+		/* by the time the address is worked out, the PC is already past it */
+		uint8_t base = (d.opcode == TNY_OPCODE_LOD) ? d.reg2 : d.reg1;
+		for(unsigned i = 0; i < K; i++) {
+			tny_sword value = (base == TNY_REG_PC) ? (tny_sword)next_PC : ls->reg[base][i];
+			ls->addr[i] = value + d.immed;
+		}
+
+		/*
+		 * Every lane has to be going to RAM or, for loads only, every lane
+		 * to the on-board registers.  Peripherals need their callbacks.
+		 */
+		bool ram = ls->addr[ls->leader] <= TNY_MAX_RAM_ADDRESS;
+		for(unsigned i = 0; i < K; i++) {
+			if(!ls->in_group[i]) continue;
+			tny_uword addr = ls->addr[i];
+			bool onboard = (addr > TNY_MAX_RAM_ADDRESS && addr < TNY_PERIPHERAL_BASE_ADDRESS);
+			if(ram ? (addr > TNY_MAX_RAM_ADDRESS) : (!onboard || d.opcode == TNY_OPCODE_STR)) {
+				return false;
 			}
-			break;
-		case TNY_OPCODE_RTI:
-			set_pc(t, t->interrupt_return_address.u);  // restore pc
-			t->flags = t->interrupt_return_flags;     // restore flags
-			t->control_status_register.csr.interrupt_enable = 1;  // reenable interrupts
-			break;
-		default:
-			fprintf(stderr, "Unknown opcode (%d) encountered at 0x%04X on cycle %" PRIu64 "\n",
-					opcode, orig_PC, t->cycle_cnt);
-			break;
 		}
+		if(ram) {
+			cycles += TNY_BUS_EXTERNAL_DELAY_ADJUST;
+		}
+	}
 
-		/* Ensure the zero register still has a zero in it */
-		t->reg[TNY_REG_ZERO].u = 0;
+	/* Lanes whose own code differs here can't follow the leader */
+	tny_uword next_addr = (orig_PC + 1) & TNY_MAX_RAM_ADDRESS;
+	tny_uword word0 = ram_read(leader, orig_PC).u;
+	tny_uword word1 = ram_read(leader, next_addr).u;
+	for(unsigned i = 0; i < K; i++) {
+		if(!ls->in_group[i]) continue;
+		const teenyat *lane = ls->lanes[i];
+		if(ram_read(lane, orig_PC).u != word0 ||
+		   (d.length == 2 && ram_read(lane, next_addr).u != word1)) {
+			lockstep_scatter(ls, i);
+		}
 	}
 
-	/* Jump out if unclocked instance of the TeenyAT */
-	if(t->clock_manager.cycles_until_calibrate < 0) return;
+	tny_sword *pc = ls->reg[TNY_REG_PC];
+	for(unsigned i = 0; i < K; i++) {
+		pc[i] = next_PC;
+	}
+
+	lockstep_execute(ls, &d);
+
+	/* the current instruction's cycle is already being counted */
+	ls->group_delay = cycles - 1;
+	ls->now++;
+
+	/* Lanes that branched elsewhere carry on alone */
+	if(d.opcode == TNY_OPCODE_JMP || d.opcode == TNY_OPCODE_LUP || d.reg1 == TNY_REG_PC) {
+		tny_sword group_PC = pc[ls->leader];
+		for(unsigned i = 0; i < K; i++) {
+			if(ls->in_group[i] && pc[i] != group_PC) {
+				lockstep_scatter(ls, i);
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Have every lane of the group carry out the instruction at its PC on its
+ * own, just as tny_run() would.  Those that still agree afterwards are
+ * merged back into a group on the next go around.
+ */
+static void lockstep_step_each(tny_lockstep *ls) {
+	for(unsigned i = 0; i < ls->lane_cnt; i++) {
+		if(!ls->in_group[i]) continue;
 
-	if(--(t->clock_manager.cycles_until_calibrate) == 0) {
-		/* Time to recalibrate our busy loop count */
-		uint64_t now_us = us_clock();
-		uint64_t us_elapsed = now_us - t->clock_manager.last_calibration_time;
-		uint64_t mhz_loop_count = t->clock_manager.busy_loop_cnt * t->clock_manager.calibrate_cycles / t->clock_manager.target_mhz;
-		t->clock_manager.busy_loop_cnt = mhz_loop_count / us_elapsed;
+		lockstep_scatter(ls, i);
 
-		uint64_t time_since_epoch_us = now_us - t->clock_manager.epoch;
-		if(time_since_epoch_us > t->cycle_cnt) {
-			/* too slow, speed up by busy looping 5% less */
-			t->clock_manager.busy_loop_cnt = (t->clock_manager.busy_loop_cnt * 95) / 100;
+		teenyat *t = ls->lanes[i];
+		t->cycle_cnt++;
+		execute_instruction(t);
+		pace_cycles(t, 1);
+
+		/* a bus callback may have scheduled an event for this very cycle */
+		if(t->events) {
+			fire_events(t);
 		}
-		else if(time_since_epoch_us < t->cycle_cnt) {
-			/* too fast, slow down by busy looping 5% more*/
-			/* NOTE: 1+ ensures even tiny busy_loop_count will at least go up by 1 */
-			t->clock_manager.busy_loop_cnt = 1 + (t->clock_manager.busy_loop_cnt * 105) / 100;
+
+		ls->ran[i]++;
+		if(t->stop_requested) {
+			ls->done[i] = true;
 		}
-	
-		t->clock_manager.last_calibration_time = now_us;
-		t->clock_manager.cycles_until_calibrate = t->clock_manager.calibrate_cycles;
 	}
 
-	/* Busy wait to fix the cycle rate */
-	for(volatile uint64_t i = 0; i < t->clock_manager.busy_loop_cnt; i++);
-	
+	ls->now++;
+
 	return;
 }
 
-tny_uword tny_random(teenyat *t) {
-	uint64_t tmp = t->random.state;
+uint64_t tny_lockstep_run(tny_lockstep *ls, uint64_t cycles) {
+	if(!ls) return 0;
 
-	/*
-	 * Find the next state in the sequence.  The weird large immediate value
-	 * is a special constant chosen by the world at large to do great
-	 * things for the random number. ... We don't really know about it,
-	 * but it seems to work ;-)
-	 */
-	t->random.state = tmp * 6364136223846793005ULL + t->random.increment;
+	const unsigned K = ls->lane_cnt;
+	uint64_t chunk = 1;
 
-	/*
-	 * The code below involves some shifts of seemingly random amounts.
-	 * They determine the amounts of manipulation of 64 and 16 bit values.
-	 * 27 = 32 - 5
-	 * 18 = floor((64 - 27) / 2)
-	 * 59 = 64 - 5
-	 */
+	ls->now = 0;
+	ls->group_cnt = 0;
+	for(unsigned i = 0; i < K; i++) {
+		ls->in_group[i] = false;
+		ls->done[i] = false;
+		ls->ran[i] = 0;
+	}
 
-	/* use top 5 bits of previous state to "randomly" rotate */
-	unsigned bitcnt_to_rotate = tmp >> 59;
+	while(ls->now < cycles) {
+		lockstep_merge(ls);
+		if(ls->group_cnt == 0 && lockstep_all_done(ls)) break;
 
-	/* scramble the previous state and truncate to 16 bits */
-	uint32_t to_rotate = (tmp >> 18 ^ tmp) >> 27;
+		if(ls->group_cnt < 2) {
+			/* nothing to be gained from a group of one, so let it run a while */
+			lockstep_dissolve(ls);
+			uint64_t n = (chunk < cycles - ls->now) ? chunk : cycles - ls->now;
+			ls->now += n;
+			if(chunk < TNY_LOCKSTEP_MAX_CHUNK) {
+				chunk *= 2;
+			}
+		}
+		else if(ls->group_delay > 0) {
+			uint64_t n = (ls->group_delay < cycles - ls->now) ? ls->group_delay : cycles - ls->now;
+			ls->group_delay -= n;
+			ls->now += n;
+			chunk = 1;
+		}
+		else if(lockstep_step(ls)) {
+			/* let go of the instruction's delay right away, too */
+			uint64_t n = (ls->group_delay < cycles - ls->now) ? ls->group_delay : cycles - ls->now;
+			ls->group_delay -= n;
+			ls->now += n;
+			chunk = 1;
+		}
+		else {
+			lockstep_step_each(ls);
+		}
 
-	/* return the right-rotated the scrambled previous state */
-	uint32_t result = to_rotate >> bitcnt_to_rotate;
-	/* the bitmask below ensures the left shift is fewer than 32 bits */
-	result |= to_rotate << (-bitcnt_to_rotate & ~(~0U << 5));
+		/* catch every other lane up with the group */
+		for(unsigned i = 0; i < K; i++) {
+			if(ls->in_group[i] || ls->done[i] || ls->ran[i] == ls->now) continue;
 
-	/* truncate result and return as 16-bit tny_uword */
-	return (tny_uword)result;
+			uint64_t n = ls->now - ls->ran[i];
+			uint64_t ran = tny_run(ls->lanes[i], n);
+			ls->ran[i] += ran;
+			if(ran < n || ls->lanes[i]->stop_requested) {
+				ls->done[i] = true;
+			}
+		}
+	}
+
+	lockstep_dissolve(ls);
+
+	uint64_t most = 0;
+	for(unsigned i = 0; i < K; i++) {
+		if(ls->ran[i] > most) most = ls->ran[i];
+		/* lanes stepped on their own may have written windows */
+		finish_windows(ls->lanes[i]);
+	}
+
+	return most;
 }
 
 /*
@@ -25,6 +25,21 @@ typedef struct teenyat teenyat;
 typedef uint16_t tny_uword;
 typedef int16_t tny_sword;
 typedef union tny_word tny_word;
+typedef struct tny_decoded tny_decoded;
+typedef struct tny_image tny_image;
+typedef struct tny_ram_page tny_ram_page;
+typedef struct tny_peripheral_map tny_peripheral_map;
+typedef struct tny_write_queue tny_write_queue;
+typedef struct tny_perf tny_perf;
+typedef struct tny_profile tny_profile;
+typedef struct tny_trace tny_trace;
+typedef struct tny_spin tny_spin;
+typedef struct tny_event_queue tny_event_queue;
+typedef struct tny_waiter tny_waiter;
+typedef struct tny_pacer tny_pacer;
+typedef struct tny_cluster tny_cluster;
+typedef struct tny_lockstep tny_lockstep;
+typedef struct tny_jit tny_jit;
 
 /**
  * @brief
@@ -75,6 +90,72 @@ typedef void(*TNY_READ_FROM_BUS_FNPTR)(teenyat *t, tny_uword addr, tny_word *dat
  */
 typedef void(*TNY_WRITE_TO_BUS_FNPTR)(teenyat *t, tny_uword addr, tny_word data, uint16_t *delay);
 
+/**
+ * @brief
+ *   Callback function to handle reads from a registered peripheral
+ *
+ * This is the same as a TNY_READ_FROM_BUS_FNPTR, only for the address range
+ * of one peripheral.  See tny_register_peripheral().
+ *
+ * @param ctx
+ *   The context pointer the peripheral was registered with
+ */
+typedef void(*TNY_PERIPHERAL_READ_FNPTR)(teenyat *t, void *ctx, tny_uword addr, tny_word *data, uint16_t *delay);
+
+/**
+ * @brief
+ *   Callback function to handle writes to a registered peripheral
+ *
+ * This is the same as a TNY_WRITE_TO_BUS_FNPTR, only for the address range
+ * of one peripheral.  See tny_register_peripheral().
+ *
+ * @param ctx
+ *   The context pointer the peripheral was registered with
+ */
+typedef void(*TNY_PERIPHERAL_WRITE_FNPTR)(teenyat *t, void *ctx, tny_uword addr, tny_word data, uint16_t *delay);
+
+/**
+ * @brief
+ *   Callback function telling the system a mapped window has been written
+ *
+ * See tny_map_window().
+ *
+ * @param t
+ *   The TeenyAT instance that wrote to the window
+ *
+ * @param ctx
+ *   The context pointer the window was mapped with
+ *
+ * @param first
+ *   The lowest address written since the last callback
+ *
+ * @param last
+ *   The highest address written since the last callback
+ */
+typedef void(*TNY_WINDOW_WRITTEN_FNPTR)(teenyat *t, void *ctx, tny_uword first, tny_uword last);
+
+/**
+ * @brief
+ *   Callback function to apply a write taken from a write queue
+ *
+ * This runs on the queue's own worker thread, not the thread running the
+ * TeenyAT, so it is given no instance and cannot add any delay.  See
+ * tny_write_queue_create().
+ *
+ * @param ctx
+ *   The context pointer the queue was created with
+ *
+ * @param addr
+ *   Address of the write
+ *
+ * @param data
+ *   The data written
+ *
+ * @param cycle
+ *   The instance's cycle count when the write was made
+ */
+typedef void(*TNY_QUEUED_WRITE_FNPTR)(void *ctx, tny_uword addr, tny_word data, uint64_t cycle);
+
 /**
  * @brief
  *   System calllback function to handle TeenyAT output port pin changes
@@ -97,10 +178,48 @@ typedef void(*TNY_WRITE_TO_BUS_FNPTR)(teenyat *t, tny_uword addr, tny_word data,
  */
 typedef void(*TNY_PORT_CHANGE_FNPTR)(teenyat *t, bool is_port_a, tny_word port);
 
+/**
+ * @brief
+ *   System callback function run when an instance in a cluster completes
+ *
+ * Callbacks are run on whichever of the cluster's worker threads ran the
+ * instance last, so they may run concurrently with one another.
+ *
+ * @param t
+ *   The TeenyAT instance that completed
+ *
+ * @param halted
+ *   True if the instance was stopped with tny_stop(), false if it used up
+ *   its cycle budget
+ */
+typedef void(*TNY_CLUSTER_DONE_FNPTR)(teenyat *t, bool halted);
+
+/**
+ * @brief
+ *   Callback function for an event scheduled with tny_schedule_event()
+ *
+ * The event is finished with before the callback is made, so the callback
+ * is free to schedule it again, eg, one period later for a periodic timer.
+ *
+ * @param t
+ *   The TeenyAT instance the event was scheduled on
+ *
+ * @param ctx
+ *   The context pointer the event was scheduled with
+ *
+ * @param cycle
+ *   The cycle the event was scheduled for
+ */
+typedef void(*TNY_EVENT_FNPTR)(teenyat *t, void *ctx, uint64_t cycle);
+
 /* While the TeenyAT has a 16 bit address space, RAM is only 32K words */
 #define TNY_RAM_SIZE 0x8000
 #define TNY_MAX_RAM_ADDRESS 0x7FFF
 
+/* RAM is made of 1K word pages, each copied only when first written */
+#define TNY_RAM_PAGE_SIZE 0x400
+#define TNY_RAM_PAGE_CNT (TNY_RAM_SIZE / TNY_RAM_PAGE_SIZE)
+
 #define TNY_PORTA_DIR_ADDRESS 0x8000
 #define TNY_PORTB_DIR_ADDRESS 0x8001
 #define TNY_PORTA_ADDRESS 0x8002
@@ -109,6 +228,12 @@ typedef void(*TNY_PORT_CHANGE_FNPTR)(teenyat *t, bool is_port_a, tny_word port);
 #define TNY_RANDOM_ADDRESS 0x8010  /* positive random values */
 #define TNY_RANDOM_BITS_ADDRESS 0x8011  /* random 16-bit pattern */
 
+/*
+ * CSR bits: 0 enables interrupts, 1 clears queued interrupts that aren't
+ * enabled in the IER, and 2 waits for an interrupt.  Storing the CSR with
+ * bit 2 set stops the TeenyAT, with cycles still going by, until an
+ * interrupt enabled in the IER is queued, then clears the bit again.
+ */
 #define TNY_CONTROL_STATUS_REGISTER 0x8EFF
 
 #define TNY_INTERRUPT_VECTOR_TABLE_START 0x8E00
@@ -119,6 +244,9 @@ typedef void(*TNY_PORT_CHANGE_FNPTR)(teenyat *t, bool is_port_a, tny_word port);
 
 
 #define TNY_PERIPHERAL_BASE_ADDRESS 0x9000
+/* Registered peripherals are looked up in pages of this many words */
+#define TNY_PERIPHERAL_PAGE_SIZE 0x10
+#define TNY_PERIPHERAL_PAGE_CNT ((0x10000 - TNY_PERIPHERAL_BASE_ADDRESS) / TNY_PERIPHERAL_PAGE_SIZE)
 
 /*
 * To promote student use of registers, all bus operations,
@@ -128,6 +256,7 @@ typedef void(*TNY_PORT_CHANGE_FNPTR)(teenyat *t, bool is_port_a, tny_word port);
 #define TNY_BUS_EXTERNAL_DELAY_ADJUST 2
 
 #define TNY_DEFAULT_CALIBRATE_CYCLES 500
+#define TNY_DEFAULT_PACING_QUANTUM_US 1000
 
 typedef struct alu_flags {
 	bool greater : 1;
@@ -158,7 +287,8 @@ union tny_word {
 	struct {
 		tny_uword interrupt_enable  : 1;
 		tny_uword interrupt_clearing  : 1;
-		tny_uword reserved : 14;
+		tny_uword wait_for_interrupt  : 1;
+		tny_uword reserved : 13;
 	} csr;
 
 	struct {
@@ -193,10 +323,68 @@ union tny_word {
 struct teenyat {
 	/** Has this TeenyAT ever been initialized */
 	bool initialized;
-	/** Memory used for a program's code/data */
-	tny_word ram[TNY_RAM_SIZE];
-	/** copy of original bin file for resets */
-	tny_word bin_image[TNY_RAM_SIZE];
+	/**
+	 * Memory used for a program's code/data, as pages of TNY_RAM_PAGE_SIZE
+	 * words shared copy-on-write with the image and any forked instances.
+	 * Use tny_get_ram() and tny_set_ram() to access it from the system.
+	 */
+	tny_ram_page *ram[TNY_RAM_PAGE_CNT];
+	/**
+	 * The original .bin file for resets, possibly shared with other instances
+	 */
+	tny_image *image;
+	/**
+	 * One bit per RAM page written since the last reset, which are the only
+	 * pages that aren't still the image's own
+	 */
+	uint32_t dirty_pages;
+	/**
+	 * One bit per RAM page held by this instance alone, which can be written
+	 * without first making a copy
+	 */
+	uint32_t private_pages;
+	/**
+	 * Optional cache of already decoded instructions, indexed by RAM address.
+	 * NULL unless enabled with tny_set_decode_cache().
+	 */
+	tny_decoded *decode_cache;
+	/**
+	 * Performance counters, when the TeenyAT is built with TNY_PERF_COUNTERS.
+	 * NULL unless enabled with tny_set_perf_counters().
+	 */
+	tny_perf *perf;
+	/**
+	 * Sampling profiler.  NULL unless enabled with tny_set_profiler().
+	 */
+	tny_profile *profile;
+	/**
+	 * Ring of the most recent instructions.  NULL unless enabled with
+	 * tny_set_trace().
+	 */
+	tny_trace *trace;
+	/**
+	 * Idle loop detection.  NULL unless enabled with tny_set_spin_skip().
+	 */
+	tny_spin *spin;
+	/**
+	 * Events scheduled by the system.  NULL until the first
+	 * tny_schedule_event().
+	 */
+	tny_event_queue *events;
+	/**
+	 * What a clocked instance waiting for an interrupt blocks on.  NULL
+	 * until it first waits.
+	 */
+	tny_waiter *waiter;
+	/**
+	 * Native code translated from the program by TNY_ENGINE_JIT.  NULL
+	 * under any other engine, or where there is no JIT for the host.
+	 */
+	tny_jit *jit;
+	/**
+	 * The engine used by tny_run() to execute instructions
+	 */
+	uint8_t engine;
     /** The 16 addresses in which we can jump to in ram for interrupts */
     tny_word interrupt_vector_table[TNY_INTERRUPT_CNT];
 	/**
@@ -237,11 +425,21 @@ struct teenyat {
 	 * System calllback function to handle TeenyAT write requests
 	 */
 	TNY_WRITE_TO_BUS_FNPTR bus_write;
+	/**
+	 * Peripherals handling their own address ranges in place of bus_read
+	 * and bus_write.  NULL until one is registered.
+	 */
+	tny_peripheral_map *peripherals;
 	/**
 	 * The number of remaining cycles to delay to simulate the cost of the
 	 * previous instruction.
 	 */
 	uint64_t delay_cycles;
+	/**
+	 * The address of the instruction started most recently, which is the
+	 * one still under way while delay_cycles is nonzero.
+	 */
+	tny_uword instruction_address;
 	/**
 	 * The held values on port A
 	 */
@@ -286,6 +484,14 @@ struct teenyat {
 	 */
 	tny_word interrupt_return_address;
 	alu_flags interrupt_return_flags;
+	/**
+	 * External interrupts and port levels posted from other threads, packed
+	 * into one word taken atomically before the next instruction.  See
+	 * tny_post_external_interrupt() and tny_post_ports().  Its top bit is set
+	 * whenever an interrupt is ready to be taken or cleared, so the word is
+	 * only nonzero when there is something to do before the next instruction.
+	 */
+	uint64_t mailbox;
 
 	/**
 	 * Each teenyat instance has a unique random number generator stream,
@@ -319,12 +525,28 @@ struct teenyat {
 		uint16_t target_mhz;
 		/* The total number of cycles needed before recalibration */
 		int16_t calibrate_cycles;
+		/* TNY_PACING_BUSY or TNY_PACING_HYBRID */
+		uint8_t pacing;
+		/* Microseconds worth of cycles run between sleeps when hybrid pacing */
+		uint32_t quantum_us;
+		/* The cycle at which hybrid pacing next checks the time */
+		uint64_t sync_cycle;
 	} clock_manager;
 	/**
 	 * The number of cycles this instance has been running since initialization
 	 * or reset.
 	 */
 	uint64_t cycle_cnt;
+	/**
+	 * The cycle the part of tny_run() under way ends on.  Scheduling an
+	 * event any sooner brings it in, so the run stops in time for it.
+	 */
+	uint64_t run_end;
+	/**
+	 * Set by tny_stop() to have tny_run() return early.  Also set when a
+	 * write to RAM is lost because there's no memory to copy a shared page.
+	 */
+	bool stop_requested;
 	/**
 	 * An extra pointer for system developers so data can follow a TeenyAT
 	 * instance through read/write callback functions, for example.
@@ -358,6 +580,22 @@ struct teenyat {
 #define TNY_OPCODE_DLY 23
 #define TNY_OPCODE_INT 24
 #define TNY_OPCODE_RTI 25
+#define TNY_OPCODE_CNT 32  /* every value the 5-bit opcode field can take */
+
+#define TNY_ENGINE_SWITCH   0  /* one switch over every opcode (default) */
+#define TNY_ENGINE_THREADED 1  /* threaded dispatch over predecoded instructions */
+#define TNY_ENGINE_BLOCK    2  /* whole basic blocks of register-only code at once */
+#define TNY_ENGINE_JIT      3  /* those blocks translated to x86-64 code (TNY_ENGINE_BLOCK elsewhere) */
+
+#define TNY_PACING_BUSY   0  /* busy-wait after every cycle (default) */
+#define TNY_PACING_HYBRID 1  /* run in bursts, then sleep until the wall clock catches up */
+
+#define TNY_SNAPSHOT_VERSION 1
+#define TNY_SNAPSHOT_FULL  0  /* all of RAM, loadable without the image */
+#define TNY_SNAPSHOT_DELTA 1  /* only RAM that differs from the image */
+
+#define TNY_PERF_DUMP_TEXT 0  /* a table for people */
+#define TNY_PERF_DUMP_JSON 1  /* a single JSON object for tools */
 
 #define TNY_REG_ZERO 0
 #define TNY_REG_PC   1
@@ -467,6 +705,76 @@ bool tny_init_unclocked(teenyat *t, FILE *bin_file,
 						TNY_READ_FROM_BUS_FNPTR bus_read,
 						TNY_WRITE_TO_BUS_FNPTR bus_write);
 
+/**
+ * @brief
+ *   Load a pre-assembled .bin file into a program image
+ *
+ * An image is a read-only copy of a .bin file that any number of TeenyAT
+ * instances can be initialized from and reset to without each keeping a
+ * copy of its own.  Images are reference counted.  The caller's reference
+ * from this function must eventually be given up with tny_image_release(),
+ * but it may be done as soon as the image has been used to initialize every
+ * instance that needs it, since instances hold references of their own.
+ *
+ * @param bin_file
+ *   The pre-assembled .bin file to load
+ *
+ * @return
+ *   The new image, or NULL on failure
+ */
+tny_image *tny_image_load(FILE *bin_file);
+
+/**
+ * @brief
+ *   Take an additional reference to a program image
+ *
+ * @param image
+ *   The image
+ *
+ * @return
+ *   The same image
+ */
+tny_image *tny_image_retain(tny_image *image);
+
+/**
+ * @brief
+ *   Give up a reference to a program image, freeing it after the last one
+ *
+ * @param image
+ *   The image
+ */
+void tny_image_release(tny_image *image);
+
+/**
+ * @brief
+ *   Initialize a 1MHz instance of the TeenyAT from an already loaded image
+ *
+ * This is the same as tny_init_from_file(), except the instance shares the
+ * given image rather than loading its own.  Use tny_set_calibration_window()
+ * with -1 afterward for an unclocked instance.
+ *
+ * @param t
+ *   The TeenyAT instance to initialize
+ *
+ * @param image
+ *   The program image to load and execute, see tny_image_load()
+ *
+ * @param bus_read
+ *   Callback function for handling read requests
+ *
+ * @param bus_write
+ *   Callback function for handling write requests
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   The instance holds its own reference to the image until tny_destroy().
+ */
+bool tny_init_from_image(teenyat *t, tny_image *image,
+                         TNY_READ_FROM_BUS_FNPTR bus_read,
+                         TNY_WRITE_TO_BUS_FNPTR bus_write);
+
 /**
  * @brief
  *   Helper function for setting the initial pace
@@ -489,106 +797,1253 @@ bool tny_set_calibration_window(teenyat *t,int16_t calibrate_cycles);
 
 /**
  * @brief
- *   Reinitialize the TeenyAT
+ *   Choose how a clocked TeenyAT instance holds itself to its target rate
  *
- * Restore the TeenyAT to its initialized state as if it had just been done so
- * from the original .bin file
+ * TNY_PACING_BUSY busy-waits a calibrated amount after every cycle, which
+ * keeps cycles evenly spaced but occupies a full host core no matter what
+ * the TeenyAT is doing.  TNY_PACING_HYBRID instead lets cycles run as fast as
+ * they can for up to quantum_us microseconds worth at the target rate, then
+ * sleeps until the wall clock catches up, spinning only for the last few
+ * microseconds to land on time.  Host CPU use then follows the work actually
+ * being done.  Unclocked instances are unaffected either way.
  *
  * @param t
- *   The TeenyAT instance to reset
+ *   The TeenyAT instance
+ *
+ * @param pacing
+ *   TNY_PACING_BUSY or TNY_PACING_HYBRID
+ *
+ * @param quantum_us
+ *   The length of a burst in microseconds, or 0 for
+ *   TNY_DEFAULT_PACING_QUANTUM_US.  Ignored by TNY_PACING_BUSY.
  *
  * @return
  *   True on success, false otherwise.
- *   Attempting to reset an uninitialized TeenyAT will always return false.
  */
-bool tny_reset(teenyat *t);
+bool tny_set_pacing(teenyat *t, uint8_t pacing, uint32_t quantum_us);
 
 /**
  * @brief
- *   Advance the TeenyAT instance by one clock cycle
+ *   Enable or disable the decode cache of a TeenyAT instance
  *
- * This function provides the TeenyAT with something similar to a CPU clock
- * pulse.  The TeenyAT will handle all the internals of the traditional Fetch,
- * Decode, and Execute processes, but it is the caller's responsibility to
- * check whether an any bus requests were made after EVERY cycle.
+ * With the cache enabled, each instruction is decoded only the first time it
+ * is executed from a given address.  Instruction stores into RAM (STR, PSH,
+ * and CAL) automatically discard any cached instruction they overwrite.
+ * Disabling the cache puts the instance back on TNY_ENGINE_SWITCH.
  *
- * The caller MUST check t's bus state for whether the access is a read or
- * write.  Read/writes from/to external devices must be handled immediately...
- * before calling tny_clock() again.  Check the character in t->bus.state to
- * determine the type of bus access request.  'R' indicates t was trying to read
- * from the device at the address t->bus.address.  'W' indicates t was trying to
- * write the data in t->bus.data to the device at the address t->bus.address.
- * the state member may also contain 'X', indicating no request at all.
+ * @param t
+ *   The TeenyAT instance
  *
- * On read requests, the caller MUST satisfy the request via tny_lod_result().
+ * @param enable
+ *   Whether the cache should be used
  *
- * On write requests, the caller MUST satisfy the request via tny_str_result().
+ * @return
+ *   True on success, false otherwise (eg, the cache could not be allocated).
+ *
+ * @note
+ *   The cache is allocated on the heap.  Use tny_destroy() to release it
+ *   once the instance is no longer needed.
+ */
+bool tny_set_decode_cache(teenyat *t, bool enable);
+
+/**
+ * @brief
+ *   Select the engine tny_run() uses to execute instructions
+ *
+ * Every engine is bit-exact with every other, down to the cycle, so this is
+ * purely a matter of host performance.  The threaded engine is generally the
+ * fastest on code that touches the bus and RAM a lot, while the block engine
+ * is for code that spends its time in register-only loops.  The JIT engine
+ * runs the same blocks as native code on x86-64 hosts, and is the block
+ * engine on any other.  While the perf counters, trace, or spin skip are
+ * enabled, it runs its blocks just as the block engine does, since they need
+ * to see every instruction.  All three are best chosen right after
+ * initialization and enable the decode cache (see tny_set_decode_cache()),
+ * as they depend on it.
  *
  * @param t
  *   The TeenyAT instance
+ *
+ * @param engine
+ *   TNY_ENGINE_SWITCH, TNY_ENGINE_THREADED, TNY_ENGINE_BLOCK, or
+ *   TNY_ENGINE_JIT
+ *
+ * @return
+ *   True on success, false otherwise.
  */
-void tny_clock(teenyat *t);
+bool tny_set_engine(teenyat *t, uint8_t engine);
 
 /**
  * @brief
- *   Get the current bit levels on ports A and B.
+ *   Discard all decoded instructions held in the decode cache
+ *
+ * This is rarely needed, since every write to RAM, including those made with
+ * tny_set_ram(), already keeps the cache up to date.
  *
  * @param t
  *   The TeenyAT instance
- * 
- * @param[out] a
- *   Returns the current bit levels held on port A
- * 
- * @param[out] b
- *   Returns the current bit levels held on port B
- * 
- * @note
- *   A NULL tny_word pointer argument identifies that port is to be ignored.
  */
-void tny_get_ports(teenyat *t, tny_word *a, tny_word *b);
+void tny_flush_decode_cache(teenyat *t);
+
+/**
+ * What an instance with performance counters has been up to.  See
+ * tny_set_perf_counters().
+ */
+typedef struct tny_perf_counters {
+	/** Instructions retired, by opcode */
+	uint64_t retired[TNY_OPCODE_CNT];
+	/**
+	 * Cycles spent, by opcode, counting every cycle up to the start of the
+	 * next instruction, so bus delays and DLY are included
+	 */
+	uint64_t cycles[TNY_OPCODE_CNT];
+	/** Reads and writes of RAM and the on-board registers, stack included */
+	uint64_t internal_reads;
+	uint64_t internal_writes;
+	/** Reads and writes of the peripheral address space */
+	uint64_t external_reads;
+	uint64_t external_writes;
+	/** Interrupts taken */
+	uint64_t interrupts;
+	/** Cycles asked for by DLY instructions */
+	uint64_t dly_cycles;
+} tny_perf_counters;
 
 /**
  * @brief
- *   Set the current bit levels on ports A and B for those pins operating
- *   as input pins.
+ *   Enable or disable the performance counters of a TeenyAT instance
+ *
+ * Counting is only compiled into the TeenyAT when it is built with
+ * TNY_PERF_COUNTERS defined (the CMake option of the same name), so it
+ * costs nothing at all otherwise.  When built in, each instance still only
+ * counts once enabled.  Counts carry on through resets.
  *
  * @param t
  *   The TeenyAT instance
  *
- * @param a
- *   New potential bits levels for port A
+ * @param enable
+ *   Whether to count.  Enabling starts every count from zero.
  *
- * @param b
- *   Returns the current bit levels held on port B
+ * @return
+ *   True on success, false otherwise (eg, counting wasn't built in).
  *
  * @note
- *   A NULL tny_word pointer argument identifies that port is to be ignored.
+ *   Instances counting under tny_lockstep_run() are always run on their own,
+ *   so nothing they do goes uncounted.
  */
-void tny_set_ports(teenyat *t, tny_word *a, tny_word *b);
+bool tny_set_perf_counters(teenyat *t, bool enable);
 
 /**
  * @brief
- *   Register a callback for external port level changes
+ *   Get the performance counts of a TeenyAT instance
  *
  * @param t
  *   The TeenyAT instance
  *
- * @param port_change
- *   Callback for handling external port level changes
+ * @param[out] counters
+ *   The counts so far
+ *
+ * @return
+ *   True on success, false otherwise (eg, the instance isn't counting).
  */
-void tny_port_change(teenyat *t, TNY_PORT_CHANGE_FNPTR port_change);
+bool tny_get_perf_counters(teenyat *t, tny_perf_counters *counters);
 
 /**
  * @brief
- *   Trigger an external interrupt
+ *   Start every performance count of a TeenyAT instance over from zero
+ *
+ * @param t
+ *   The TeenyAT instance
+ */
+void tny_reset_perf_counters(teenyat *t);
+
+/**
+ * @brief
+ *   Write the performance counts of a TeenyAT instance out in one go
  *
  * @param t
  *   The TeenyAT instance
  *
- * @param external_interrupt
- *   A number from 0-7 denoting which external interrupt to queue
+ * @param out
+ *   The file to write to, such as stdout
+ *
+ * @param format
+ *   TNY_PERF_DUMP_TEXT or TNY_PERF_DUMP_JSON
+ *
+ * @return
+ *   True on success, false otherwise (eg, the instance isn't counting).
  */
-void tny_external_interrupt(teenyat* t, tny_uword external_interrupt);
+bool tny_dump_perf_counters(teenyat *t, FILE *out, uint8_t format);
+
+/**
+ * @brief
+ *   Enable or disable the sampling profiler of a TeenyAT instance
+ *
+ * Every period cycles, the address of the instruction under way is tallied,
+ * so cycles spent waiting on the bus or in a DLY count against the
+ * instruction that asked for them.  tny_run() simply stops at each sample,
+ * so the cost is a little per sample and nothing per instruction, and a
+ * period in the hundreds of cycles or more is cheap enough to leave on.
+ * Samples carry on through resets.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param period
+ *   Cycles between samples, or zero to stop profiling.  Enabling starts
+ *   every tally from zero.  A prime period is least likely to fall into step
+ *   with the program's own loops.
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   Instances being profiled under tny_lockstep_run() are always run on
+ *   their own.
+ */
+bool tny_set_profiler(teenyat *t, uint32_t period);
+
+/**
+ * @brief
+ *   Get the samples taken by the profiler of a TeenyAT instance
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param[out] samples
+ *   TNY_RAM_SIZE tallies, one per instruction address
+ *
+ * @return
+ *   True on success, false otherwise (eg, the instance isn't profiling).
+ */
+bool tny_get_profile(teenyat *t, uint64_t *samples);
+
+/**
+ * @brief
+ *   Start every tally of the profiler of a TeenyAT instance over from zero
+ *
+ * @param t
+ *   The TeenyAT instance
+ */
+void tny_reset_profile(teenyat *t);
+
+/**
+ * @brief
+ *   Write the samples taken by the profiler of a TeenyAT instance out
+ *
+ * The output is a "#" comment line with the period and sample count, then an
+ * address (hex) and tally per line for each address sampled at least once.
+ * This is what tnprof reads to pair samples with lines of a tnasm listing.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param out
+ *   The file to write to
+ *
+ * @return
+ *   True on success, false otherwise (eg, the instance isn't profiling).
+ */
+bool tny_dump_profile(teenyat *t, FILE *out);
+
+/** No register was written by a traced instruction */
+#define TNY_TRACE_NO_REG 0xFF
+
+/** Flags of a trace record */
+#define TNY_TRACE_BUS_READ    0x01  /* bus_address and bus_data were read */
+#define TNY_TRACE_BUS_WRITE   0x02  /* bus_address and bus_data were written */
+#define TNY_TRACE_INTERRUPTED 0x04  /* an interrupt was taken just before */
+
+/**
+ * One instruction carried out by an instance with tracing on.  See
+ * tny_set_trace().
+ */
+typedef struct tny_trace_record {
+	/** Where the instruction was fetched from */
+	tny_uword pc;
+	/** The first word of the instruction */
+	tny_uword instruction;
+	/** The immediate, from the second word or from the teeny encoding */
+	tny_uword immediate;
+	/** What was left in reg afterward */
+	tny_uword reg_value;
+	/** The one bus access made, if either bus flag is set */
+	tny_uword bus_address;
+	tny_uword bus_data;
+	/**
+	 * The register written, or TNY_TRACE_NO_REG.  This is the SP for CAL and
+	 * PSH, and jumps don't count as writing the PC.
+	 */
+	uint8_t reg;
+	/** TNY_TRACE_* flags */
+	uint8_t flags;
+} tny_trace_record;
+
+/**
+ * @brief
+ *   Enable or disable the execution trace of a TeenyAT instance
+ *
+ * Each instruction adds a small record to a ring, overwriting the oldest,
+ * so the ring always holds the last capacity instructions to run.  This is
+ * meant for post mortems of long runs, like what led up to a crash after
+ * minutes of running.  Records carry on through resets.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param capacity
+ *   The number of records kept, rounded up to a power of two, or zero to
+ *   stop tracing.  Enabling starts with an empty ring.
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   Instances tracing under tny_lockstep_run() are always run on their own.
+ */
+bool tny_set_trace(teenyat *t, size_t capacity);
+
+/**
+ * @brief
+ *   Get the most recent records of the execution trace of a TeenyAT instance
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param[out] records
+ *   Filled with up to max records, oldest first
+ *
+ * @param max
+ *   The number of records there is room for
+ *
+ * @return
+ *   The number of records given, which is zero if the instance isn't
+ *   tracing.
+ */
+size_t tny_get_trace(teenyat *t, tny_trace_record *records, size_t max);
+
+/**
+ * @brief
+ *   Write the execution trace of a TeenyAT instance out, for tntrace
+ *
+ * The file is binary, little endian regardless of the host: "TNYT", a
+ * version (u16) and record size (u16), the number of instructions traced
+ * since tracing began (u64) and the number of records that follow (u64).
+ * Each record is then pc, instruction, immediate, reg_value, bus_address
+ * and bus_data (u16 each) and reg and flags (u8 each), oldest first.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param out
+ *   The file to write to, opened in binary mode
+ *
+ * @return
+ *   True on success, false otherwise (eg, the instance isn't tracing).
+ */
+bool tny_dump_trace(teenyat *t, FILE *out);
+
+/**
+ * What idle loop detection has saved an instance.  See tny_set_spin_skip().
+ */
+typedef struct tny_spin_stats {
+	/** Idle loops skipped ahead through */
+	uint64_t skips;
+	/** Cycles that went by without running the loop */
+	uint64_t cycles_skipped;
+} tny_spin_stats;
+
+/**
+ * @brief
+ *   Enable or disable skipping through idle loops of a TeenyAT instance
+ *
+ * Programs often wait by going around a tight loop, like reading a port
+ * until it changes, or jumping to themselves.  When a backward jump brings
+ * the instance back to where it was the time before, with every register
+ * and flag the same, and nothing in between wrote anything, read the random
+ * number generator or a peripheral, or took an interrupt, then every pass
+ * after it will be the same too until something from outside changes.  The
+ * instance then lets as many whole passes' worth of cycles go by at once as
+ * fit in the tny_run() or tny_fast_forward() under way, so where it ends up
+ * is exactly where running the loop would have left it.
+ *
+ * Changing the instance from outside, with tny_set_ports(),
+ * tny_external_interrupt(), tny_set_ram() and the like, ends a skip still
+ * under way at the next pass through the top of the loop.  Anything posted
+ * from another thread is seen at the end of the skip, which is kept to a
+ * millisecond of real time for clocked instances.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param enable
+ *   Whether to skip idle loops.  Enabling starts the statistics over.
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   Nothing is skipped while the instance is counting, profiling or
+ *   tracing, as those see every instruction.  Instances skipping idle loops
+ *   under tny_lockstep_run() are always run on their own.
+ */
+bool tny_set_spin_skip(teenyat *t, bool enable);
+
+/**
+ * @brief
+ *   Get what skipping idle loops has saved a TeenyAT instance so far
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param[out] stats
+ *   Where to put the statistics
+ *
+ * @return
+ *   True on success, false otherwise (eg, skipping isn't enabled).
+ */
+bool tny_get_spin_stats(teenyat *t, tny_spin_stats *stats);
+
+/**
+ * @brief
+ *   Release any resources held by a TeenyAT instance
+ *
+ * This includes the instance's reference to its program image.  The
+ * instance must be initialized again before any further use.
+ *
+ * @param t
+ *   The TeenyAT instance
+ */
+void tny_destroy(teenyat *t);
+
+/**
+ * @brief
+ *   Reinitialize the TeenyAT
+ *
+ * Restore the TeenyAT to its initialized state as if it had just been done so
+ * from the original .bin file.  Only the RAM pages written since the last
+ * reset are given back for those of the image, so frequent resets of a
+ * program that touches little memory are cheap.  The random number generator
+ * is seeded from a pool of entropy gathered once per process.
+ *
+ * @param t
+ *   The TeenyAT instance to reset
+ *
+ * @return
+ *   True on success, false otherwise.
+ *   Attempting to reset an uninitialized TeenyAT will always return false.
+ */
+bool tny_reset(teenyat *t);
+
+/**
+ * @brief
+ *   Reinitialize the TeenyAT with a particular random number seed
+ *
+ * This is the same as tny_reset(), except the random number generator is
+ * seeded from the given value, so resets with the same seed produce the
+ * same random numbers every time.
+ *
+ * @param t
+ *   The TeenyAT instance to reset
+ *
+ * @param seed
+ *   The random number seed
+ *
+ * @return
+ *   True on success, false otherwise.
+ *   Attempting to reset an uninitialized TeenyAT will always return false.
+ */
+bool tny_reset_with_seed(teenyat *t, uint64_t seed);
+
+/**
+ * @brief
+ *   Save the complete state of a TeenyAT instance to a buffer
+ *
+ * A snapshot holds RAM, registers, flags, ports, the interrupt state, the
+ * random number generator, and the cycle counters.  It does not include
+ * anything belonging to the system, such as the bus and port callbacks,
+ * ex_data, or clock settings.  The format is compact, versioned, and the
+ * same on every host.
+ *
+ * With TNY_SNAPSHOT_DELTA, only the RAM that differs from the program image
+ * is saved, which typically leaves just a few KiB.  Such a snapshot can only
+ * be loaded into an instance initialized from the same image.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param mode
+ *   TNY_SNAPSHOT_FULL or TNY_SNAPSHOT_DELTA
+ *
+ * @param buf
+ *   Where to save the snapshot, or NULL to only find its size
+ *
+ * @param size
+ *   The size of buf in bytes
+ *
+ * @return
+ *   The size of the snapshot in bytes, or 0 on failure.  The snapshot has
+ *   only been saved if this is no more than size.
+ */
+size_t tny_snapshot_save(const teenyat *t, uint8_t mode, void *buf, size_t size);
+
+/**
+ * @brief
+ *   Restore a TeenyAT instance to the state held in a snapshot
+ *
+ * The instance keeps its own callbacks, ex_data, and clock settings, so a
+ * snapshot can be loaded into any number of instances to clone it.  A
+ * clocked instance carries on at its target rate from the loaded cycle.
+ * The port change callback is not called for the loaded port values.
+ *
+ * @param t
+ *   The initialized TeenyAT instance
+ *
+ * @param buf
+ *   The snapshot, as saved by tny_snapshot_save()
+ *
+ * @param size
+ *   The size of the snapshot in bytes
+ *
+ * @return
+ *   True on success.  False if the snapshot is damaged, is of a different
+ *   version, or is a delta against some other image, in which case the
+ *   instance is left unchanged.  Also false if memory runs out copying
+ *   pages of RAM partway through, leaving the instance to be reset or
+ *   loaded again.
+ */
+bool tny_snapshot_load(teenyat *t, const void *buf, size_t size);
+
+/**
+ * @brief
+ *   Spawn a new TeenyAT instance in exactly the state of another
+ *
+ * The child is a complete copy of the parent, callbacks and ex_data
+ * included, but the two share all of RAM.  A page of RAM is only copied by
+ * whichever instance first writes to it, so a parent warmed up past its boot
+ * code can be forked thousands of times for little more than the pages each
+ * child goes on to change.  Parent and children can then run independently,
+ * on any threads.
+ *
+ * @param parent
+ *   The initialized TeenyAT instance to fork, which must not be running
+ *
+ * @param child
+ *   The TeenyAT instance to become the copy, which should not already be
+ *   initialized
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   A child of a clocked parent keeps its own pace, even if the parent is
+ *   attached to a pacer.  Release a child with tny_destroy() like any other
+ *   instance.
+ */
+bool tny_fork(teenyat *parent, teenyat *child);
+
+/**
+ * @brief
+ *   Advance the TeenyAT instance by one clock cycle
+ *
+ * This function provides the TeenyAT with something similar to a CPU clock
+ * pulse.  The TeenyAT will handle all the internals of the traditional Fetch,
+ * Decode, and Execute processes, but it is the caller's responsibility to
+ * check whether an any bus requests were made after EVERY cycle.
+ *
+ * The caller MUST check t's bus state for whether the access is a read or
+ * write.  Read/writes from/to external devices must be handled immediately...
+ * before calling tny_clock() again.  Check the character in t->bus.state to
+ * determine the type of bus access request.  'R' indicates t was trying to read
+ * from the device at the address t->bus.address.  'W' indicates t was trying to
+ * write the data in t->bus.data to the device at the address t->bus.address.
+ * the state member may also contain 'X', indicating no request at all.
+ *
+ * On read requests, the caller MUST satisfy the request via tny_lod_result().
+ *
+ * On write requests, the caller MUST satisfy the request via tny_str_result().
+ *
+ * @param t
+ *   The TeenyAT instance
+ */
+void tny_clock(teenyat *t);
+
+/**
+ * @brief
+ *   Advance the TeenyAT instance by up to the given number of clock cycles
+ *
+ * This is equivalent to calling tny_clock() the same number of times, but
+ * without paying for each of those calls.  Cycles spent waiting on the delay
+ * of a previous instruction (multi-word instructions, bus access penalties,
+ * DLY, etc.) are let go in a single step rather than one at a time.  The
+ * resulting cycle_cnt and the cycles on which bus callbacks are made and
+ * interrupts are handled are identical to those of repeated tny_clock() calls.
+ *
+ * The run ends early if tny_stop() is called, typically from within a bus or
+ * port callback.  In that case, the instruction making the callback still
+ * completes, but any delay cycles it incurs are left for the next run.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param cycles
+ *   The maximum number of cycles to run
+ *
+ * @return
+ *   The number of cycles actually run
+ */
+uint64_t tny_run(teenyat *t, uint64_t cycles);
+
+/**
+ * @brief
+ *   Clock the TeenyAT instance up to its next instruction boundary
+ *
+ * This is for hosts that clock an instance one step at a time and check on
+ * their own devices in between.  When an instruction is due to start, this
+ * is exactly one tny_clock().  While the instance is only waiting out the
+ * delay of a previous instruction (bus access penalties, DLY, etc.), all of
+ * the waiting cycles go by in one step instead, up to max_cycles.  Nothing
+ * can happen in those cycles, as interrupts, including any raised or posted
+ * meanwhile, are only ever handled when an instruction starts.
+ *
+ * With tny_set_spin_skip(), an idle loop the instruction closes is passed
+ * through in the same way, never beyond max_cycles.
+ *
+ * Use max_cycles to stop at the host's next event of its own, such as a
+ * screen refresh.  A clocked instance is still paced for every cycle, so a
+ * long delay blocks for as long as it would take in real time.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param max_cycles
+ *   The most cycles to advance by
+ *
+ * @return
+ *   The number of cycles the instance advanced by, 1 or more unless
+ *   max_cycles is 0
+ */
+uint64_t tny_fast_forward(teenyat *t, uint64_t max_cycles);
+
+/**
+ * @brief
+ *   Request that the currently executing tny_run() return
+ *
+ * @param t
+ *   The TeenyAT instance
+ */
+void tny_stop(teenyat *t);
+
+/**
+ * @brief
+ *   Create a pacer for keeping several TeenyAT instances in real time together
+ *
+ * A pacer holds any number of attached instances to one shared monotonic
+ * timeline, each at its own target rate, from a single thread.  Every
+ * tny_pacer_step() sleeps until the next quantum of the timeline, then runs
+ * each instance, unpaced, up to the cycle it should have reached by then.
+ * The instances never busy-wait, so they don't slow each other down or drift
+ * apart, and the host only spends the time the work actually takes.  The
+ * one calibration needed, how late the host wakes from sleep, is done here
+ * for the whole group.
+ *
+ * @param quantum_us
+ *   The length of a step in microseconds, or 0 for
+ *   TNY_DEFAULT_PACING_QUANTUM_US
+ *
+ * @return
+ *   The new pacer, or NULL on failure
+ */
+tny_pacer *tny_pacer_create(uint32_t quantum_us);
+
+/**
+ * @brief
+ *   Release a pacer, detaching any instances still attached to it
+ *
+ * @param p
+ *   The pacer
+ */
+void tny_pacer_destroy(tny_pacer *p);
+
+/**
+ * @brief
+ *   Attach a TeenyAT instance to a pacer
+ *
+ * From the next step on, the instance is held to the pacer's timeline at the
+ * given rate, starting from its current cycle_cnt.  Its own pacing is
+ * suspended for as long as it is attached.  An instance must only be attached
+ * to one pacer at a time, and must be detached before tny_destroy().
+ *
+ * @param p
+ *   The pacer
+ *
+ * @param t
+ *   The TeenyAT instance, clocked or unclocked
+ *
+ * @param MHz
+ *   The instance's target rate, or 0 to keep its current target_mhz
+ *
+ * @return
+ *   True on success, false otherwise.
+ */
+bool tny_pacer_attach(tny_pacer *p, teenyat *t, uint16_t MHz);
+
+/**
+ * @brief
+ *   Detach a TeenyAT instance from a pacer
+ *
+ * A clocked instance resumes its own pacing from where it is.
+ *
+ * @param p
+ *   The pacer
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @return
+ *   True on success, false if t was not attached to p.
+ */
+bool tny_pacer_detach(tny_pacer *p, teenyat *t);
+
+/**
+ * @brief
+ *   Wait for the next quantum and bring every attached instance up to it
+ *
+ * Each instance is advanced with tny_run(), so a tny_stop() from one of its
+ * callbacks ends that instance's share of the step early.  The cycles it
+ * missed are made up on later steps.
+ *
+ * @param p
+ *   The pacer
+ *
+ * @return
+ *   The total number of cycles run across all instances
+ */
+uint64_t tny_pacer_step(tny_pacer *p);
+
+/**
+ * @brief
+ *   Report how far behind the timeline the attached instances are
+ *
+ * @param p
+ *   The pacer
+ *
+ * @return
+ *   The sum of every attached instance's lag, in microseconds of its own
+ *   target rate, as of the end of the last step.  This stays near zero as
+ *   long as the host keeps up.
+ */
+uint64_t tny_pacer_lag_us(const tny_pacer *p);
+
+/**
+ * @brief
+ *   Create a cluster for running many independent TeenyAT instances at once
+ *
+ * Each worker thread has its own queue of instances and runs them a slice of
+ * cycles at a time.  Workers that run out take instances from the others, so
+ * the load stays balanced however long each instance ends up running.
+ * Instances are run unpaced by tny_run(), so each one's callbacks only ever
+ * run on one thread at a time, but callbacks of different instances may run
+ * concurrently.
+ *
+ * @param thread_cnt
+ *   The number of worker threads, or 0 for one per online host CPU
+ *
+ * @return
+ *   The new cluster, or NULL on failure
+ */
+tny_cluster *tny_cluster_create(unsigned thread_cnt);
+
+/**
+ * @brief
+ *   Release a cluster.  Any instances it has not finished are left as they are.
+ *
+ * @param c
+ *   The cluster
+ */
+void tny_cluster_destroy(tny_cluster *c);
+
+/**
+ * @brief
+ *   Queue a TeenyAT instance to be run by the cluster
+ *
+ * The instance runs until it either halts, by a callback calling tny_stop(),
+ * or has run cycle_budget cycles.  Either way, done is then called.  This
+ * must not be called while tny_cluster_run() is running.
+ *
+ * @param c
+ *   The cluster
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param cycle_budget
+ *   The most cycles the instance may run
+ *
+ * @param done
+ *   The function called once the instance completes, or NULL
+ *
+ * @return
+ *   True on success, false otherwise.
+ */
+bool tny_cluster_add(tny_cluster *c, teenyat *t, uint64_t cycle_budget,
+                     TNY_CLUSTER_DONE_FNPTR done);
+
+/**
+ * @brief
+ *   Run every queued instance to completion
+ *
+ * The calling thread works as one of the cluster's workers, and this only
+ * returns once every instance has completed.
+ *
+ * @param c
+ *   The cluster
+ *
+ * @return
+ *   The total number of cycles run across all instances
+ */
+uint64_t tny_cluster_run(tny_cluster *c);
+
+/**
+ * @brief
+ *   Group TeenyAT instances running the same binary to be run in lockstep
+ *
+ * Many runs of one program, differing only in their random seeds or port
+ * inputs, spend most of their time doing exactly the same things.  While
+ * such instances ("lanes") agree on where they are in the program, the
+ * lockstep engine decodes each instruction once and carries it out for all
+ * of them together, with their registers, flags and random number states
+ * laid out for the host's vector units.  Lanes that branch another way, or
+ * do something that can't be shared (bus callbacks, interrupts, CAL, DLY,
+ * INT, RTI), run on their own until they line up with the others again.
+ *
+ * Each lane ends up exactly where tny_run() would have left it, callbacks
+ * included.  Lanes are run unpaced and should be unclocked.
+ *
+ * @param lanes
+ *   The TeenyAT instances, which must stay valid until the group is destroyed
+ *
+ * @param lane_cnt
+ *   The number of instances
+ *
+ * @return
+ *   The new group, or NULL on failure
+ */
+tny_lockstep *tny_lockstep_create(teenyat **lanes, unsigned lane_cnt);
+
+/**
+ * @brief
+ *   Release a lockstep group.  The instances themselves are untouched.
+ *
+ * @param ls
+ *   The lockstep group
+ */
+void tny_lockstep_destroy(tny_lockstep *ls);
+
+/**
+ * @brief
+ *   Advance every lane of a lockstep group by up to the given number of cycles
+ *
+ * A lane that calls tny_stop() sits out the rest of the run, just as its own
+ * tny_run() would have returned early.
+ *
+ * @param ls
+ *   The lockstep group
+ *
+ * @param cycles
+ *   The maximum number of cycles to run
+ *
+ * @return
+ *   The number of cycles run by the lanes that ran the longest
+ */
+uint64_t tny_lockstep_run(tny_lockstep *ls, uint64_t cycles);
+
+/**
+ * @brief
+ *   Get the current bit levels on ports A and B.
+ *
+ * @param t
+ *   The TeenyAT instance
+ * 
+ * @param[out] a
+ *   Returns the current bit levels held on port A
+ * 
+ * @param[out] b
+ *   Returns the current bit levels held on port B
+ * 
+ * @note
+ *   A NULL tny_word pointer argument identifies that port is to be ignored.
+ */
+void tny_get_ports(teenyat *t, tny_word *a, tny_word *b);
+
+/**
+ * @brief
+ *   Read a word of the TeenyAT's RAM
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param addr
+ *   The RAM address, which is truncated to fit within RAM
+ *
+ * @return
+ *   The word at addr
+ */
+tny_word tny_get_ram(const teenyat *t, tny_uword addr);
+
+/**
+ * @brief
+ *   Write a word of the TeenyAT's RAM, just as a STR instruction would
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param addr
+ *   The RAM address, which is truncated to fit within RAM
+ *
+ * @param data
+ *   The word to write
+ */
+void tny_set_ram(teenyat *t, tny_uword addr, tny_word data);
+
+/**
+ * @brief
+ *   Set the current bit levels on ports A and B for those pins operating
+ *   as input pins.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param a
+ *   New potential bits levels for port A
+ *
+ * @param b
+ *   Returns the current bit levels held on port B
+ *
+ * @note
+ *   A NULL tny_word pointer argument identifies that port is to be ignored.
+ */
+void tny_set_ports(teenyat *t, tny_word *a, tny_word *b);
+
+/**
+ * @brief
+ *   Set the input bit levels on ports A and B from any thread
+ *
+ * This is tny_set_ports() for threads other than the one running the
+ * TeenyAT.  The levels are taken up, and any port change callback made, on
+ * the running thread before its next instruction.  Levels posted to a port
+ * before then replace one another, so only the latest is seen.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param a
+ *   New potential bits levels for port A
+ *
+ * @param b
+ *   New potential bits levels for port B
+ *
+ * @note
+ *   A NULL tny_word pointer argument identifies that port is to be ignored.
+ */
+void tny_post_ports(teenyat *t, tny_word *a, tny_word *b);
+
+/**
+ * @brief
+ *   Register a callback for external port level changes
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param port_change
+ *   Callback for handling external port level changes
+ */
+void tny_port_change(teenyat *t, TNY_PORT_CHANGE_FNPTR port_change);
+
+/**
+ * @brief
+ *   Register a peripheral to handle its own range of external addresses
+ *
+ * Reads and writes within the range go to the given callbacks, with the
+ * given context pointer, instead of to the instance's bus_read and bus_write.
+ * Addresses are dispatched through a table of TNY_PERIPHERAL_PAGE_SIZE word
+ * pages, so a peripheral whose range covers whole pages costs no searching at
+ * all, however many others there are.  Where ranges overlap, the most recent
+ * registration wins, and registering a range with neither callback hands it
+ * back to bus_read and bus_write.  Systems with a single pair of bus
+ * callbacks need not register anything.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param first
+ *   The first address of the range, at or above TNY_PERIPHERAL_BASE_ADDRESS
+ *
+ * @param last
+ *   The last address of the range
+ *
+ * @param read
+ *   Callback for reads within the range, or NULL to ignore them
+ *
+ * @param write
+ *   Callback for writes within the range, or NULL to ignore them
+ *
+ * @param ctx
+ *   Passed along to the callbacks
+ *
+ * @return
+ *   True on success, false otherwise.
+ */
+bool tny_register_peripheral(teenyat *t, tny_uword first, tny_uword last,
+                             TNY_PERIPHERAL_READ_FNPTR read,
+                             TNY_PERIPHERAL_WRITE_FNPTR write,
+                             void *ctx);
+
+/**
+ * @brief
+ *   Map a host buffer directly onto a range of external addresses
+ *
+ * Reads and writes within the range access the buffer itself, with no
+ * callback in between, so the TeenyAT reaches it as quickly as RAM.  This
+ * suits framebuffers and other plain memory a system shares with the
+ * TeenyAT.  Mapped windows take part in the same ordering of registrations
+ * as tny_register_peripheral().
+ *
+ * The system may learn of writes in either or both of two ways.  With dirty,
+ * a bit is set for each TNY_PERIPHERAL_PAGE_SIZE words of the window written,
+ * for the system to check and clear whenever it likes.  With written, the
+ * callback is made at the end of each tny_clock() or tny_run() with the span
+ * of addresses written during it, however many writes there were.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param first
+ *   The first address of the range, at or above TNY_PERIPHERAL_BASE_ADDRESS
+ *
+ * @param last
+ *   The last address of the range
+ *
+ * @param buffer
+ *   At least (last - first + 1) words, the first of which is at address first
+ *
+ * @param dirty
+ *   A bitmap with one bit per TNY_PERIPHERAL_PAGE_SIZE words of the window,
+ *   starting with the lowest bit of dirty[0], or NULL
+ *
+ * @param written
+ *   Callback for coalesced writes, or NULL
+ *
+ * @param ctx
+ *   Passed along to written
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   The buffer must remain valid until the range is mapped to something
+ *   else or the instance is destroyed.
+ */
+bool tny_map_window(teenyat *t, tny_uword first, tny_uword last, tny_word *buffer,
+                    uint64_t *dirty, TNY_WINDOW_WRITTEN_FNPTR written, void *ctx);
+
+/**
+ * @brief
+ *   Have a callback made once the TeenyAT reaches a given cycle
+ *
+ * This gives peripherals with timing of their own, like a vsync, a timer
+ * or a serial line's baud clock, a way to be called when they are due
+ * rather than being checked on every cycle.  The callback is made right
+ * after the instance's cycle count reaches cycle, exactly as if the system
+ * had clocked it there with tny_clock() and made the call itself, whether
+ * the instance is being run by tny_clock(), tny_fast_forward() or
+ * tny_run().  Runs are divided up at each event, so none of them is late,
+ * even one scheduled by a bus or port callback partway through a run.
+ * Events due on the same cycle are made in the order they were scheduled,
+ * and one for a cycle already reached is made after the next cycle.
+ *
+ * Events belong to the system, not the TeenyAT's state.  They carry on
+ * through resets, still due the same number of cycles later, and are left
+ * alone by snapshots.  A forked child gets copies of its parent's.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param cycle
+ *   The cycle count to make the callback at
+ *
+ * @param event
+ *   The callback
+ *
+ * @param ctx
+ *   Passed along to the callback
+ *
+ * @return
+ *   True on success, false otherwise.
+ *
+ * @note
+ *   Instances with events pending under tny_lockstep_run() are always run
+ *   on their own.
+ */
+bool tny_schedule_event(teenyat *t, uint64_t cycle, TNY_EVENT_FNPTR event, void *ctx);
+
+/**
+ * @brief
+ *   Cancel every pending event with the given callback and context pointer
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param event
+ *   The callback the events were scheduled with
+ *
+ * @param ctx
+ *   The context pointer the events were scheduled with
+ *
+ * @return
+ *   The number of events cancelled
+ */
+size_t tny_cancel_events(teenyat *t, TNY_EVENT_FNPTR event, void *ctx);
+
+/**
+ * @brief
+ *   Get the cycle the TeenyAT's next pending event is due on
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @return
+ *   The cycle of the earliest pending event, or UINT64_MAX if there are none
+ */
+uint64_t tny_next_event(const teenyat *t);
+
+/**
+ * @brief
+ *   Create a queue for applying peripheral writes on a thread of their own
+ *
+ * Writes to ranges registered with tny_register_queued_peripheral() are put
+ * in a lock-free ring of capacity entries and the TeenyAT moves straight on,
+ * while the queue's worker thread takes them out and applies them with the
+ * write callback.  This keeps slow side effects, like rendering or starting
+ * an audio device, from stalling emulation.
+ *
+ * Writes going through one queue are applied one at a time, in the order
+ * they were made.  They are not ordered against writes handled any other
+ * way, or through any other queue, except that a read from a queued range
+ * first waits for its queue to empty.  When the ring is full, the write
+ * waits for the worker to make room.  Writes are never dropped or merged.
+ *
+ * @param capacity
+ *   The number of writes the ring holds, rounded up to a power of two
+ *
+ * @param write
+ *   Callback applying each write, on the worker thread
+ *
+ * @param ctx
+ *   Passed along to write
+ *
+ * @return
+ *   The new queue, or NULL on failure
+ *
+ * @note
+ *   A queue has a single producer.  Every instance writing to it must run on
+ *   the same thread, which includes children forked from them.
+ */
+tny_write_queue *tny_write_queue_create(size_t capacity, TNY_QUEUED_WRITE_FNPTR write, void *ctx);
+
+/**
+ * @brief
+ *   Apply every write still in the queue, then stop its worker and free it
+ *
+ * @param q
+ *   The queue, no longer in use by any running instance
+ */
+void tny_write_queue_destroy(tny_write_queue *q);
+
+/**
+ * @brief
+ *   Wait for every write put in the queue so far to be applied
+ *
+ * Call this from the thread running the TeenyAT before touching state the
+ * write callback also touches.
+ *
+ * @param q
+ *   The queue
+ */
+void tny_write_queue_flush(tny_write_queue *q);
+
+/**
+ * @brief
+ *   Register a peripheral whose writes are applied through a write queue
+ *
+ * Reads within the range are handled by read as with
+ * tny_register_peripheral(), once the queue is empty.  Writes within the
+ * range are put in the queue and cost no extra cycles.  See
+ * tny_write_queue_create() for the ordering of queued writes.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param first
+ *   The first address of the range, at or above TNY_PERIPHERAL_BASE_ADDRESS
+ *
+ * @param last
+ *   The last address of the range
+ *
+ * @param read
+ *   Callback for reads within the range, or NULL to ignore them
+ *
+ * @param queue
+ *   The queue writes within the range go through
+ *
+ * @param ctx
+ *   Passed along to read
+ *
+ * @return
+ *   True on success, false otherwise.
+ */
+bool tny_register_queued_peripheral(teenyat *t, tny_uword first, tny_uword last,
+                                    TNY_PERIPHERAL_READ_FNPTR read,
+                                    tny_write_queue *queue,
+                                    void *ctx);
+
+/**
+ * @brief
+ *   Trigger an external interrupt
+ *
+ * An interrupt enabled in the IER ends any wait for an interrupt right
+ * away, so one raised by an event callback wakes the TeenyAT on the very
+ * cycle the event is made.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param external_interrupt
+ *   A number from 0-7 denoting which external interrupt to queue
+ */
+void tny_external_interrupt(teenyat* t, tny_uword external_interrupt);
+
+/**
+ * @brief
+ *   Trigger an external interrupt from any thread
+ *
+ * This is tny_external_interrupt() for threads other than the one running
+ * the TeenyAT, such as input or timer threads.  The interrupt is queued
+ * before the running thread's next instruction, after any ports posted
+ * along with it.
+ *
+ * A clocked TeenyAT waiting for an interrupt has the running thread
+ * blocked inside tny_run() or tny_fast_forward() until the end of the run,
+ * or until an interrupt enabled in the IER is posted with this.  Either
+ * way, it wakes with its cycle count caught up to the wall clock.
+ *
+ * @param t
+ *   The TeenyAT instance
+ *
+ * @param external_interrupt
+ *   A number from 0-7 denoting which external interrupt to queue
+ */
+void tny_post_external_interrupt(teenyat *t, tny_uword external_interrupt);
 
 #ifdef __cplusplus
 }
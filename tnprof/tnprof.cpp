@@ -0,0 +1,248 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <regex>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <cstdlib>
+#include <cstdint>
+
+using namespace std;
+
+/*
+ * tnprof pairs the samples written by tny_dump_profile() with the listing
+ * tnasm prints when it assembles the same program, so the hot spots show up
+ * as lines and labels of the original source.
+ */
+
+#define DEFAULT_REPORT_CNT 20
+
+struct source_line {
+    int line_no;
+    string asm_line;
+    /* the most recent label at or before this line */
+    string label;
+    uint64_t samples;
+};
+
+struct profile {
+    uint64_t period = 0;
+    /* tallies by address */
+    map <uint32_t, uint64_t> samples;
+};
+
+void print_usage() {
+    cerr << "Usage:   tnprof <profile> <listing> [count]" << endl;
+    cerr << endl;
+    cerr << "  profile   samples written by tny_dump_profile()" << endl;
+    cerr << "  listing   what tnasm printed assembling the program, eg" << endl;
+    cerr << "            \"tnasm prog.asm > prog.lst\"" << endl;
+    cerr << "  count     how many lines and labels to report (default "
+         << DEFAULT_REPORT_CNT << ")" << endl;
+
+    return;
+}
+
+bool read_listing(const string &path, vector <source_line> &lines, map <uint32_t, size_t> &addr_lines) {
+    ifstream f(path);
+    if(!f) {
+        cerr << "Unable to open listing " << path << endl;
+        return false;
+    }
+
+    /* see generate_listing() in tnasm for where these come from */
+    const regex word_line("^0x([0-9a-fA-F]{4})\\s+(\\d+): \\[ ((?:[0-9a-fA-F]{4} )+)\\s*\\]  (.*)$");
+    const regex more_words("^\\s+: \\[ ((?:[0-9a-fA-F]{4} )+)\\s*\\]  $");
+    const regex no_words("^\\s+(\\d+): \\[\\s+\\]  (.*)$");
+    const regex label("^\\s*(![^ \\[\\]\\t\\v\\r\\n;]+)");
+
+    string current_label = "(no label)";
+    uint32_t next_address = 0;
+    string s;
+    smatch m;
+
+    while(getline(f, s)) {
+        /* the listing carries along any carriage returns of the source */
+        if(!s.empty() && s.back() == '\r') {
+            s.pop_back();
+        }
+
+        if(regex_match(s, m, more_words)) {
+            /* the rest of a line with more than two words */
+            if(lines.empty()) continue;
+            size_t cnt = m[1].length() / 5;
+            for(size_t i = 0; i < cnt; i++) {
+                addr_lines[next_address++] = lines.size() - 1;
+            }
+            continue;
+        }
+
+        source_line sl;
+        if(regex_match(s, m, word_line)) {
+            uint32_t address = stoul(m[1].str(), nullptr, 16);
+            size_t cnt = m[3].length() / 5;
+            for(size_t i = 0; i < cnt; i++) {
+                addr_lines[address + i] = lines.size();
+            }
+            next_address = address + cnt;
+            sl.line_no = stoi(m[2].str());
+            sl.asm_line = m[4].str();
+        }
+        else if(regex_match(s, m, no_words)) {
+            sl.line_no = stoi(m[1].str());
+            sl.asm_line = m[2].str();
+        }
+        else {
+            /* not part of the listing (eg, warnings) */
+            continue;
+        }
+
+        smatch lm;
+        if(regex_search(sl.asm_line, lm, label)) {
+            current_label = lm[1].str();
+        }
+        sl.label = current_label;
+        sl.samples = 0;
+        lines.push_back(sl);
+    }
+
+    if(lines.empty()) {
+        cerr << path << " doesn't look like a tnasm listing" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool read_profile(const string &path, profile &p) {
+    ifstream f(path);
+    if(!f) {
+        cerr << "Unable to open profile " << path << endl;
+        return false;
+    }
+
+    const regex header("^# period (\\d+) cycles, (\\d+) samples$");
+    const regex tally("^0x([0-9a-fA-F]{4}) (\\d+)$");
+
+    string s;
+    smatch m;
+    while(getline(f, s)) {
+        if(regex_match(s, m, header)) {
+            p.period = stoull(m[1].str());
+        }
+        else if(regex_match(s, m, tally)) {
+            p.samples[stoul(m[1].str(), nullptr, 16)] += stoull(m[2].str());
+        }
+    }
+
+    if(p.period == 0) {
+        cerr << path << " doesn't look like a profile" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+void print_share(uint64_t samples, uint64_t total) {
+    cout << setw(10) << samples << "  ";
+    cout << fixed << setprecision(1) << setw(5) << (100.0 * samples / total) << "%  ";
+
+    return;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 3 || argc > 4) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    size_t report_cnt = DEFAULT_REPORT_CNT;
+    if(argc == 4) {
+        report_cnt = strtoul(argv[3], nullptr, 10);
+        if(report_cnt == 0) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    profile p;
+    vector <source_line> lines;
+    map <uint32_t, size_t> addr_lines;
+    if(!read_profile(argv[1], p) || !read_listing(argv[2], lines, addr_lines)) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* samples that fall outside the listing are reported by address alone */
+    uint64_t total = 0;
+    map <uint32_t, uint64_t> unlisted;
+    for(const auto &[address, samples] : p.samples) {
+        total += samples;
+        auto it = addr_lines.find(address);
+        if(it != addr_lines.end()) {
+            lines[it->second].samples += samples;
+        }
+        else {
+            unlisted[address] += samples;
+        }
+    }
+
+    cout << total << " samples, one every " << p.period << " cycles" << endl;
+    if(total == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    /* hottest lines, along with anything sampled that wasn't in the listing */
+    struct hot_line {
+        uint64_t samples;
+        const source_line *sl;
+        uint32_t address;
+    };
+    vector <hot_line> hot;
+    for(const source_line &sl : lines) {
+        if(sl.samples) {
+            hot.push_back({sl.samples, &sl, 0});
+        }
+    }
+    for(const auto &[address, samples] : unlisted) {
+        hot.push_back({samples, nullptr, address});
+    }
+    stable_sort(hot.begin(), hot.end(),
+                [](const hot_line &a, const hot_line &b) { return a.samples > b.samples; });
+
+    cout << endl << "Hottest lines" << endl;
+    cout << setw(10) << "samples" << "  " << setw(6) << "share" << "  "
+         << setw(6) << "line" << "  " << "source" << endl;
+    for(size_t i = 0; i < hot.size() && i < report_cnt; i++) {
+        print_share(hot[i].samples, total);
+        if(hot[i].sl) {
+            cout << setw(6) << hot[i].sl->line_no << "  " << hot[i].sl->asm_line << endl;
+        }
+        else {
+            cout << setw(6) << "?" << "  " << "(not in listing) 0x" << hex << setw(4)
+                 << setfill('0') << hot[i].address << dec << setfill(' ') << endl;
+        }
+    }
+
+    /* hottest labels, each taking in every line up to the next */
+    map <string, uint64_t> label_samples;
+    for(const source_line &sl : lines) {
+        if(sl.samples) {
+            label_samples[sl.label] += sl.samples;
+        }
+    }
+    vector <pair <string, uint64_t>> hot_labels(label_samples.begin(), label_samples.end());
+    stable_sort(hot_labels.begin(), hot_labels.end(),
+                [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    cout << endl << "Hottest labels" << endl;
+    cout << setw(10) << "samples" << "  " << setw(6) << "share" << "  " << "label" << endl;
+    for(size_t i = 0; i < hot_labels.size() && i < report_cnt; i++) {
+        print_share(hot_labels[i].second, total);
+        cout << hot_labels[i].first << endl;
+    }
+
+    return EXIT_SUCCESS;
+}
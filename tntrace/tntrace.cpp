@@ -0,0 +1,307 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <regex>
+#include <map>
+#include <vector>
+#include <string>
+
+#include <cstdlib>
+#include <cstdint>
+
+#include "../teenyat.h"
+
+using namespace std;
+
+/*
+ * tntrace turns the execution trace written by tny_dump_trace() back into
+ * readable disassembly, marking where each label of the program's tnasm
+ * listing was passed.
+ */
+
+#define TRACE_MAGIC "TNYT"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 14
+
+const char *reg_names[] = { "rZ", "PC", "SP", "rA", "rB", "rC", "rD", "rE" };
+
+struct trace {
+    uint64_t recorded;
+    vector <tny_trace_record> records;
+};
+
+void print_usage() {
+    cerr << "Usage:   tntrace <trace> [listing]" << endl;
+    cerr << endl;
+    cerr << "  trace     execution trace written by tny_dump_trace()" << endl;
+    cerr << "  listing   what tnasm printed assembling the program, eg" << endl;
+    cerr << "            \"tnasm prog.asm > prog.lst\", to show labels" << endl;
+
+    return;
+}
+
+uint16_t get_u16(istream &in) {
+    uint8_t b[2] = {0, 0};
+    in.read(reinterpret_cast<char *>(b), 2);
+
+    return b[0] | (b[1] << 8);
+}
+
+uint64_t get_u64(istream &in) {
+    uint64_t v = 0;
+    for(int i = 0; i < 4; i++) {
+        v |= (uint64_t)get_u16(in) << (16 * i);
+    }
+
+    return v;
+}
+
+bool read_trace(const string &path, trace &tr) {
+    ifstream f(path, ios::binary);
+    if(!f) {
+        cerr << "Unable to open trace " << path << endl;
+        return false;
+    }
+
+    char magic[4];
+    f.read(magic, 4);
+    if(!f || string(magic, 4) != TRACE_MAGIC) {
+        cerr << path << " isn't a TeenyAT trace" << endl;
+        return false;
+    }
+
+    uint16_t version = get_u16(f);
+    uint16_t record_size = get_u16(f);
+    if(version != TRACE_VERSION || record_size != TRACE_RECORD_SIZE) {
+        cerr << path << " is a trace version this tntrace doesn't know" << endl;
+        return false;
+    }
+
+    tr.recorded = get_u64(f);
+    uint64_t cnt = get_u64(f);
+    for(uint64_t i = 0; i < cnt && f; i++) {
+        tny_trace_record r;
+        r.pc = get_u16(f);
+        r.instruction = get_u16(f);
+        r.immediate = get_u16(f);
+        r.reg_value = get_u16(f);
+        r.bus_address = get_u16(f);
+        r.bus_data = get_u16(f);
+        r.reg = f.get();
+        r.flags = f.get();
+        if(f) {
+            tr.records.push_back(r);
+        }
+    }
+
+    if(tr.records.size() != cnt) {
+        cerr << path << " ends after " << tr.records.size() << " of its " << cnt << " records" << endl;
+    }
+
+    return true;
+}
+
+/* Gather the address of every label defined in a tnasm listing */
+bool read_labels(const string &path, multimap <uint16_t, string> &labels) {
+    ifstream f(path);
+    if(!f) {
+        cerr << "Unable to open listing " << path << endl;
+        return false;
+    }
+
+    /* see generate_listing() in tnasm for where these come from */
+    const regex word_line("^0x([0-9a-fA-F]{4})\\s+\\d+: \\[ [0-9a-fA-F ]+\\]  (.*)$");
+    const regex no_words("^\\s+\\d+: \\[\\s+\\]  (.*)$");
+    const regex label("^\\s*(![^ \\[\\]\\t\\v\\r\\n;]+)");
+
+    /* a label sits on a line of its own, naming the next address used */
+    vector <string> waiting;
+    string s;
+    smatch m, lm;
+    while(getline(f, s)) {
+        if(!s.empty() && s.back() == '\r') {
+            s.pop_back();
+        }
+
+        if(regex_match(s, m, word_line)) {
+            uint16_t address = stoul(m[1].str(), nullptr, 16);
+            for(const string &name : waiting) {
+                labels.insert({address, name});
+            }
+            waiting.clear();
+        }
+        else if(regex_match(s, m, no_words)) {
+            string asm_line = m[1].str();
+            if(regex_search(asm_line, lm, label)) {
+                waiting.push_back(lm[1].str());
+            }
+        }
+    }
+
+    return true;
+}
+
+string hex_word(tny_uword v) {
+    ostringstream os;
+    os << "0x" << hex << setw(4) << setfill('0') << v;
+
+    return os.str();
+}
+
+/* An immediate, as a label when it is the address of one and that's allowed */
+string immediate(tny_uword v, const multimap <uint16_t, string> &labels, bool allow_label) {
+    auto it = labels.find(v);
+    if(allow_label && it != labels.end()) {
+        return it->second;
+    }
+
+    tny_sword s = (tny_sword)v;
+    if(s >= -255 && s <= 255) {
+        return to_string(s);
+    }
+
+    return hex_word(v);
+}
+
+/* The "register plus immediate" operand most instructions share */
+string operand(int reg, tny_uword imm, const multimap <uint16_t, string> &labels, bool allow_label) {
+    if(reg == TNY_REG_ZERO) {
+        return immediate(imm, labels, allow_label);
+    }
+    if(imm == 0) {
+        return reg_names[reg];
+    }
+
+    tny_sword s = (tny_sword)imm;
+    if(s < 0 && s >= -255) {
+        return string(reg_names[reg]) + " - " + to_string(-s);
+    }
+
+    return string(reg_names[reg]) + " + " + immediate(imm, labels, false);
+}
+
+string jump_name(int cond) {
+    tny_word c = { .u = (tny_uword)cond };
+    bool g = c.inst_flags.greater;
+    bool l = c.inst_flags.less;
+    bool e = c.inst_flags.equals;
+    if(c.inst_flags.carry) {
+        return "jmp(" + to_string(cond) + ")";
+    }
+    if(!g && !l && !e) return "jmp";
+    if(!g && !l &&  e) return "je";
+    if( g &&  l && !e) return "jne";
+    if(!g &&  l && !e) return "jl";
+    if(!g &&  l &&  e) return "jle";
+    if( g && !l && !e) return "jg";
+    if( g && !l &&  e) return "jge";
+
+    return "jmp(" + to_string(cond) + ")";
+}
+
+string disassemble(const tny_trace_record &r, const multimap <uint16_t, string> &labels) {
+    tny_word w = { .u = r.instruction };
+    int opcode = w.instruction.opcode;
+    int reg1 = w.instruction.reg1;
+    int reg2 = w.instruction.reg2;
+    tny_uword imm = r.immediate;
+
+    string r1 = reg_names[reg1];
+    string src = operand(reg2, imm, labels, false);
+
+    switch(opcode) {
+    case TNY_OPCODE_SET: return "set " + r1 + ", " + operand(reg2, imm, labels, true);
+    case TNY_OPCODE_LOD: return "lod " + r1 + ", [" + src + "]";
+    case TNY_OPCODE_STR: return "str [" + operand(reg1, imm, labels, false) + "], " + reg_names[reg2];
+    case TNY_OPCODE_PSH: return "psh " + src;
+    case TNY_OPCODE_POP: return (reg1 == TNY_REG_PC) ? "ret" : "pop " + r1;
+    case TNY_OPCODE_BTS: return "bts " + r1 + ", " + src;
+    case TNY_OPCODE_BTC: return "btc " + r1 + ", " + src;
+    case TNY_OPCODE_BTF: return "btf " + r1 + ", " + src;
+    case TNY_OPCODE_CAL: return "cal " + operand(reg2, imm, labels, true);
+    case TNY_OPCODE_ADD: return "add " + r1 + ", " + src;
+    case TNY_OPCODE_SUB: return "sub " + r1 + ", " + src;
+    case TNY_OPCODE_MPY: return "mpy " + r1 + ", " + src;
+    case TNY_OPCODE_DIV: return "div " + r1 + ", " + src;
+    case TNY_OPCODE_MOD: return "mod " + r1 + ", " + src;
+    case TNY_OPCODE_AND: return "and " + r1 + ", " + src;
+    case TNY_OPCODE_OR:  return "or " + r1 + ", " + src;
+    case TNY_OPCODE_XOR: return "xor " + r1 + ", " + src;
+    case TNY_OPCODE_SHF: return "shf " + r1 + ", " + src;
+    case TNY_OPCODE_ROT: return "rot " + r1 + ", " + src;
+    case TNY_OPCODE_NEG: return "neg " + r1;
+    case TNY_OPCODE_CMP: return "cmp " + r1 + ", " + src;
+    case TNY_OPCODE_JMP:
+        /* the condition takes the place of a teeny jump's immediate */
+        return jump_name(r.instruction & 0xF) + " " +
+               operand(reg1, w.instruction.teeny ? 0 : imm, labels, true);
+    case TNY_OPCODE_LUP: return "lup " + r1 + ", " + operand(reg2, imm, labels, true);
+    case TNY_OPCODE_DLY: return (reg1 == TNY_REG_ZERO) ? "dly " + src : "dly " + r1 + ", " + src;
+    case TNY_OPCODE_INT: return "int " + src;
+    case TNY_OPCODE_RTI: return "rti";
+    default:
+        return "??? (opcode " + to_string(opcode) + ")";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2 || argc > 3) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    trace tr;
+    multimap <uint16_t, string> labels;
+    if(!read_trace(argv[1], tr) || (argc == 3 && !read_labels(argv[2], labels))) {
+        exit(EXIT_FAILURE);
+    }
+
+    cout << "Last " << tr.records.size() << " of " << tr.recorded << " instructions traced" << endl;
+
+    uint64_t number = tr.recorded - tr.records.size();
+    int number_width = to_string(tr.recorded).length();
+
+    for(const tny_trace_record &r : tr.records) {
+        if(r.flags & TNY_TRACE_INTERRUPTED) {
+            cout << "-- interrupt --" << endl;
+        }
+
+        auto range = labels.equal_range(r.pc);
+        for(auto it = range.first; it != range.second; ++it) {
+            cout << it->second << endl;
+        }
+
+        tny_word w = { .u = r.instruction };
+        cout << "  " << setw(number_width) << number++ << "  " << hex_word(r.pc) << "  ";
+        cout << hex << setfill('0') << setw(4) << r.instruction;
+        if(w.instruction.teeny) {
+            cout << "     ";
+        }
+        else {
+            cout << " " << setw(4) << r.immediate;
+        }
+        cout << dec << setfill(' ') << "  ";
+
+        /* what the instruction did, when there's something to show */
+        ostringstream effects;
+        if(r.reg != TNY_TRACE_NO_REG && r.reg < 8) {
+            effects << "  " << reg_names[r.reg] << " = " << hex_word(r.reg_value);
+        }
+        if(r.flags & TNY_TRACE_BUS_READ) {
+            effects << "  read " << hex_word(r.bus_data) << " from [" << hex_word(r.bus_address) << "]";
+        }
+        if(r.flags & TNY_TRACE_BUS_WRITE) {
+            effects << "  wrote " << hex_word(r.bus_data) << " to [" << hex_word(r.bus_address) << "]";
+        }
+
+        if(effects.str().empty()) {
+            cout << disassemble(r, labels) << endl;
+        }
+        else {
+            cout << left << setw(32) << disassemble(r, labels) << right << effects.str() << endl;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}